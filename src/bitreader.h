@@ -0,0 +1,223 @@
+// -*- mode: c++; -*-
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef SDF_BITREADER_H
+#define SDF_BITREADER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+// The core of the XTC decoder. Everything here is inline, because it
+// is called a few times for every atom.
+
+namespace libmd
+{
+    // Reads the bit stream of a compressed XTC frame, most significant
+    // bit first. The xdrfile implementation reads one byte at a time;
+    // this keeps up to 64 bits buffered and refills 8 bytes at a time.
+    //
+    // Reading past the end of the data gives zero bits rather than
+    // reading out of bounds.
+    class BitReader
+    {
+    public:
+        BitReader(const unsigned char* data, size_t size)
+                : Ptr(data), End(data + size) {}
+
+        // Read num_of_bits bits as an unsigned integer. num_of_bits
+        // is at most 56.
+        uint64_t read(int num_of_bits)
+        {
+            if(Bits < num_of_bits)
+            {
+                refill();
+            }
+            Bits -= num_of_bits;
+            return (Buffer >> Bits) & ((uint64_t(1) << num_of_bits) - 1);
+        }
+
+        // Read a num_of_bits-bit (at most 64) integer stored by
+        // encodeints(): bytes from the least significant, each byte
+        // most significant bit first, and the last (most significant)
+        // byte may be shorter than 8 bits.
+        uint64_t readBytesLE(int num_of_bits)
+        {
+            uint64_t Value = 0;
+            int Shift = 0;
+            while(num_of_bits > 8)
+            {
+                const int Bytes = std::min((num_of_bits - 1) / 8, 7);
+                const uint64_t Chunk = read(Bytes * 8);
+                Value |= (__builtin_bswap64(Chunk) >> (64 - Bytes * 8)) << Shift;
+                Shift += Bytes * 8;
+                num_of_bits -= Bytes * 8;
+            }
+            return Value | (read(num_of_bits) << Shift);
+        }
+
+    private:
+        void refill()
+        {
+            if(End - Ptr >= 8)
+            {
+                uint64_t Word;
+                std::memcpy(&Word, Ptr, sizeof(Word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                Word = __builtin_bswap64(Word);
+#endif
+                // Take as many whole bytes as fit. Never shift by 64.
+                const int Bytes = (63 - Bits) / 8;
+                Buffer = (Buffer << (Bytes * 8)) | (Word >> (64 - Bytes * 8));
+                Ptr += Bytes;
+                Bits += Bytes * 8;
+                return;
+            }
+            while(Bits <= 56)
+            {
+                Buffer = (Buffer << 8) | (Ptr < End ? *Ptr++ : 0);
+                Bits += 8;
+            }
+        }
+
+        const unsigned char* Ptr;
+        const unsigned char* End;
+        uint64_t Buffer = 0;
+        // Number of unread bits at the bottom of Buffer.
+        int Bits = 0;
+    };
+
+#ifdef __SIZEOF_INT128__
+    __extension__ typedef unsigned __int128 UInt128;
+#endif
+
+    // Division of a 64-bit number by a 32-bit divisor that is fixed
+    // for many divisions. With 128-bit integers available this
+    // multiplies by a precomputed reciprocal and corrects the
+    // estimate, which is exact and much cheaper than a div
+    // instruction.
+    class Divisor
+    {
+    public:
+        Divisor() = default;
+        explicit Divisor(uint32_t d) : D(d), Inv(UINT64_MAX / (d == 0 ? 1 : d)) {}
+
+        uint32_t value() const { return D; }
+
+        // Return v / D, and put v % D in rem.
+        uint64_t divide(uint64_t v, uint32_t& rem) const
+        {
+#ifdef __SIZEOF_INT128__
+            // The estimate is at most 1 too small.
+            uint64_t q = static_cast<uint64_t>((UInt128(v) * Inv) >> 64);
+            uint64_t r = v - q * D;
+            while(r >= D)
+            {
+                q++;
+                r -= D;
+            }
+            rem = static_cast<uint32_t>(r);
+            return q;
+#else
+            rem = static_cast<uint32_t>(v % D);
+            return v / D;
+#endif
+        }
+
+    private:
+        uint64_t D = 1;
+        uint64_t Inv = UINT64_MAX;
+    };
+
+    // Inverse of encodeints() for 3 integers, when num_of_bits is at
+    // most 64, so that the combined number fits in a uint64_t.
+    inline void decodeInts3(BitReader& bits, int num_of_bits,
+                            const Divisor sizes[3], int32_t nums[3])
+    {
+        uint64_t Value = bits.readBytesLE(num_of_bits);
+        uint32_t Rem;
+        Value = sizes[2].divide(Value, Rem);
+        nums[2] = Rem;
+        Value = sizes[1].divide(Value, Rem);
+        nums[1] = Rem;
+        nums[0] = static_cast<int32_t>(static_cast<uint32_t>(Value));
+    }
+
+    // The same as decodeInts3(), for the run-length encoded small
+    // integers, which use the same size for all 3.
+    inline void decodeSmallInts3(BitReader& bits, int num_of_bits,
+                                 const Divisor& size, int32_t nums[3])
+    {
+        uint64_t Value = bits.readBytesLE(num_of_bits);
+        uint32_t Rem;
+        Value = size.divide(Value, Rem);
+        nums[2] = Rem;
+        Value = size.divide(Value, Rem);
+        nums[1] = Rem;
+        nums[0] = static_cast<int32_t>(static_cast<uint32_t>(Value));
+    }
+
+    // Shamelessly copied from
+    // https://github.com/wesbarnett/libxdrfile/blob/master/src/xdrfile.c,
+    // and modified to read from a BitReader.
+    //
+    // decodeints - decode 'small' integers from the buf array
+    //
+    // this routine is the inverse from encodeints() and decodes the
+    // small integers written to buf by calculating the remainder and
+    // doing divisions with the given sizes[]. You need to specify the
+    // total number of bits to be used from buf in num_of_bits.
+    //
+    // This is only used when the combined integer does not fit in 64
+    // bits.
+    inline void decodeIntsGeneric(BitReader& buf, int32_t num_of_ints,
+                                  int32_t num_of_bits, const uint32_t sizes[],
+                                  int32_t nums[])
+    {
+        int32_t bytes[32];
+        int32_t i, j, num_of_bytes, p, num;
+
+        bytes[1] = bytes[2] = bytes[3] = 0;
+        num_of_bytes = 0;
+        while (num_of_bits > 8)
+        {
+            bytes[num_of_bytes++] = buf.read(8);
+            num_of_bits -= 8;
+        }
+        if (num_of_bits > 0)
+        {
+            bytes[num_of_bytes++] = buf.read(num_of_bits);
+        }
+        for (i = num_of_ints-1; i > 0; i--)
+        {
+            num = 0;
+            for (j = num_of_bytes-1; j >=0; j--)
+            {
+                num = (num << 8) | bytes[j];
+                p = num / sizes[i];
+                bytes[j] = p;
+                num = num - p * sizes[i];
+            }
+            nums[i] = num;
+        }
+        nums[0] = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (bytes[3] << 24);
+    }
+
+} // namespace libmd
+
+#endif
@@ -58,8 +58,20 @@ namespace sdf
         {
             throw std::runtime_error("Failed to parse input");
         }
-        Config.XtcFile = Input.child("sdf-run").child("input")
-            .child("trajectory").text().as_string();
+        // Any number of trajectories, each of which may be a
+        // wildcard pattern.
+        for(const auto& Trajectory: Input.child("sdf-run").child("input")
+                .children("trajectory"))
+        {
+            for(const auto& Path: expandPath(strip(Trajectory.text().as_string())))
+            {
+                Config.XtcFiles.push_back(Path);
+            }
+        }
+        if(Config.XtcFiles.empty())
+        {
+            throw std::runtime_error("No trajectory in input");
+        }
         Config.GroFile = Input.child("sdf-run").child("input")
             .child("structure").text().as_string();
 
@@ -95,7 +107,7 @@ namespace sdf
                 strip(Basis.child("thickness").text().as_string()).c_str());
             for(const auto& Exclude: Basis.child("excludes").children("exclude"))
             {
-                Params.OtherAtoms.insert(strip(Exclude.text().as_string()));
+                Params.OtherAtoms.push_back(strip(Exclude.text().as_string()));
             }
             Config.Params.emplace_back(std::move(Params));
         }
@@ -109,9 +121,9 @@ namespace sdf
         RuntimeConfig Config;
         std::string Buffer;
 
-        // XTC filename
+        // XTC filename, or a wildcard pattern of them
         std::getline(s, Buffer);
-        Config.XtcFile = Buffer;
+        Config.XtcFiles = expandPath(Buffer);
         // GRO filename
         std::getline(s, Buffer);
         Config.GroFile = Buffer;
@@ -144,18 +156,30 @@ namespace sdf
             // with the anchor, x atom, and xy atom.
             //
             // I still retain the code to read them here, but the
-            // values are not used.
+            // values are not used. Atoms to leave out are given on
+            // lines that start with “exclude”, one selection per
+            // line, like the <exclude>’s of the XML input.
+            auto ReadAtomLine = [&CurrentParams](const std::string& line)
+            {
+                const std::string Marker = "exclude ";
+                const std::string Line = strip(line);
+                if(Line.compare(0, Marker.size(), Marker) == 0)
+                {
+                    CurrentParams.OtherAtoms.push_back(
+                        strip(Line.substr(Marker.size())));
+                }
+            };
             std::getline(s, Buffer);
             s.peek();
             while(Buffer != "+++" && !s.eof())
             {
-                CurrentParams.OtherAtoms.insert(strip(Buffer));
+                ReadAtomLine(Buffer);
                 std::getline(s, Buffer);
                 s.peek();
             }
             if(Buffer != "+++")
             {
-                CurrentParams.OtherAtoms.insert(strip(Buffer));
+                ReadAtomLine(Buffer);
             }
 
             Config.Params.emplace_back(std::move(CurrentParams));
@@ -179,7 +203,10 @@ namespace sdf
         std::cout << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" << std::endl;
         std::cout << "<sdf-run>" << std::endl;
         std::cout << "<input>" << std::endl;
-        std::cout << "<trajectory>" << XtcFile << "</trajectory>" << std::endl;
+        for(const auto& XtcFile: XtcFiles)
+        {
+            std::cout << "<trajectory>" << XtcFile << "</trajectory>" << std::endl;
+        }
         std::cout << "<structure>" << GroFile << "</structure>" << std::endl;
         std::cout << "</input>" << std::endl;
         std::cout << "<config/>" << std::endl;
@@ -192,7 +219,12 @@ namespace sdf
             std::cout << "<xy>" << Param.AtomXY << "</xy>" << std::endl;
             std::cout << "<search-radius>" << Param.Distance << "</search-radius>" << std::endl;
             std::cout << "<thickness>" << Param.SliceThickness << "</thickness>" << std::endl;
-            std::cout << "<excludes/>" << std::endl;
+            std::cout << "<excludes>" << std::endl;
+            for(const auto& Exclude: Param.OtherAtoms)
+            {
+                std::cout << "<exclude>" << Exclude << "</exclude>" << std::endl;
+            }
+            std::cout << "</excludes>" << std::endl;
             std::cout << "</basis>" << std::endl;
         }
         std::cout << "</bases>\n</sdf-run>" << std::endl;
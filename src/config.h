@@ -52,7 +52,9 @@ namespace sdf
         libmd::AtomIdentifier AtomXY;
         float Distance;
         float SliceThickness;
-        std::unordered_set<libmd::AtomIdentifier> OtherAtoms;
+        // Atoms left out of the distribution, as AtomSelection’s.
+        // An atom matching any of them is left out.
+        std::vector<std::string> OtherAtoms;
         HCenter Center;
     };
 
@@ -72,7 +74,33 @@ namespace sdf
         void printXml() const;
 #endif
 
-        std::string XtcFile;
+        // Trajectories of the same system, all of which go into the
+        // same distribution. Each one is read by its own reader.
+        std::vector<std::string> XtcFiles;
+        libmd::XtcFile::IoMode XtcIoMode = libmd::XtcFile::MMAP;
+        // Only used if XtcIoMode is ASYNC.
+        libmd::PrefetchOptions Prefetch;
+        libmd::FrameSelection Frames;
+        // If not 0, only the first this many atoms of each frame are
+        // decoded. This is raised to include the anchor, X and XY
+        // atoms.
+        size_t MaxAtoms = 0;
+        // Reject atoms far from all the centers before decoding them
+        // to floats. This does not change the result.
+        bool Prefilter = true;
+        // If not empty, the local environments of the bases are
+        // replayed from this file when it was made by a run with the
+        // same trajectories, frames and bases, and saved to it
+        // otherwise. See EnvCache.
+        std::string EnvCacheFile;
+        // Keep reading the trajectory as it is being written, until
+        // no new frame has come for FollowTimeout seconds (never if
+        // 0). This needs a single, uncompressed trajectory file.
+        bool Follow = false;
+        // How often, in seconds, run() hands the distribution so far
+        // to its caller while following.
+        double FollowInterval = 60.0;
+        double FollowTimeout = 0.0;
         std::string GroFile;
         std::vector<Parameters> Params;
         size_t Resolution = 40;
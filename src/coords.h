@@ -0,0 +1,108 @@
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef SDF_COORDS_H
+#define SDF_COORDS_H
+
+#include <cstddef>
+#include <vector>
+
+#include "utils.h"
+
+namespace libmd
+{
+    // Where a decoder writes coordinates: the x, y and z of atom i go
+    // to X[i * Step], Y[i * Step] and Z[i * Step]. This way the same
+    // decoder fills both xyz triples and separate arrays.
+    struct CoordLayout
+    {
+        float* X;
+        float* Y;
+        float* Z;
+        size_t Step;
+
+        static CoordLayout interleaved(float xyz[])
+        {
+            return {xyz, xyz == nullptr ? nullptr : xyz + 1,
+                    xyz == nullptr ? nullptr : xyz + 2, 3};
+        }
+        static CoordLayout planar(float x[], float y[], float z[])
+        {
+            return {x, y, z, 1};
+        }
+
+        void set(size_t i, float x, float y, float z) const
+        {
+            X[i * Step] = x;
+            Y[i * Step] = y;
+            Z[i * Step] = z;
+        }
+    };
+
+    // The coordinates of a frame as three arrays of x, y and z,
+    // rather than xyz triples, so that loops over the atoms
+    // vectorize. The arrays are in one allocation aligned to 64
+    // bytes, and each is padded to a multiple of PADDING floats with
+    // zeros, so that every array is aligned, and a kernel may work on
+    // whole SIMD registers up to stride().
+    class Coordinates
+    {
+    public:
+        static const size_t PADDING = 16;
+
+        Coordinates() = default;
+        explicit Coordinates(size_t n) { resize(n); }
+
+        // The coordinates become zero.
+        void resize(size_t n)
+        {
+            Size = n;
+            Stride = (n + PADDING - 1) / PADDING * PADDING;
+            Data.assign(Stride * 3, 0.0f);
+        }
+        size_t size() const { return Size; }
+        // How many floats y(), and z(), are after x().
+        size_t stride() const { return Stride; }
+
+        float* x() { return Data.data(); }
+        float* y() { return Data.data() + Stride; }
+        float* z() { return Data.data() + 2 * Stride; }
+        const float* x() const { return Data.data(); }
+        const float* y() const { return Data.data() + Stride; }
+        const float* z() const { return Data.data() + 2 * Stride; }
+
+        V3Map vec(size_t i)
+        {
+            return V3Map(Data.data() + i, Eigen::InnerStride<>(Stride));
+        }
+        // Read-only, because it is const.
+        const V3Map vec(size_t i) const
+        {
+            return V3Map(const_cast<float*>(Data.data()) + i,
+                         Eigen::InnerStride<>(Stride));
+        }
+
+        CoordLayout layout() { return CoordLayout::planar(x(), y(), z()); }
+
+    private:
+        std::vector<float, AlignedAllocator<float>> Data;
+        size_t Size = 0;
+        size_t Stride = 0;
+    };
+
+} // namespace libmd
+
+#endif
@@ -18,49 +18,41 @@
 #define SDF_ENDIAN_H
 
 #include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
 
 namespace libmd
 {
     namespace Endian
     {
         enum Endian { BIG, LITTLE };
-        inline Endian current()
-        {
-            union{ uint16_t i; char c[2]; } bint = {0x0102};
 
-            if(bint.c[0] == 1)
-            {
-                return BIG;
-            }
-            else
-            {
-                return LITTLE;
-            }
+        // The byte order of this machine, known at compile time.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        constexpr Endian NATIVE = BIG;
+#else
+        constexpr Endian NATIVE = LITTLE;
+#endif
+
+        constexpr Endian current()
+        {
+            return NATIVE;
         }
 
         template <typename T> T swapped(const T& x)
         {
-            union U
-            {
-                T val;
-                std::array<std::uint8_t, sizeof(T)> raw;
-            } src, dst;
-
-            src.val = x;
-            std::reverse_copy(src.raw.begin(), src.raw.end(), dst.raw.begin());
-            return dst.val;
+            std::array<std::uint8_t, sizeof(T)> Raw;
+            std::memcpy(Raw.data(), &x, sizeof(T));
+            std::reverse(Raw.begin(), Raw.end());
+            T Result;
+            std::memcpy(&Result, Raw.data(), sizeof(T));
+            return Result;
         }
 
         template <typename T> void swap(T& x)
         {
-            union U
-            {
-                T val;
-                std::array<std::uint8_t, sizeof(T)> raw;
-            } src, dst;
-            src.val = x;
-            std::reverse_copy(src.raw.begin(), src.raw.end(), dst.raw.begin());
-            x = dst.val;
+            x = swapped(x);
         }
     }
 }
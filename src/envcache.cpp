@@ -0,0 +1,199 @@
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <unistd.h>
+
+#include "envcache.h"
+#include "xtcindex.h"
+
+namespace sdf
+{
+    namespace
+    {
+        constexpr char ENV_MAGIC[8] = {'S', 'D', 'F', 'E', 'N', 'V', 'C', '2'};
+
+        struct EnvHeader
+        {
+            char Magic[8];
+            uint64_t AtomSize;
+            uint64_t KeySize;
+            uint64_t ParamCount;
+            uint64_t EnvCount;
+            uint64_t AtomCount;
+        };
+
+        void addFile(std::ostream& key, const char* what, const std::string& path)
+        {
+            if(path == "-")
+            {
+                throw std::runtime_error(
+                    "Cannot cache the environments of standard input");
+            }
+            const auto Print = libmd::FileFingerprint::of(path);
+            key << what << " " << path << " " << Print.Size << " "
+                << Print.MTime << "\n";
+        }
+    } // namespace
+
+    std::string EnvCache :: key(const RuntimeConfig& config)
+    {
+        std::ostringstream Key;
+        // Floats are written exactly.
+        Key << std::hexfloat;
+        for(const auto& Path: config.XtcFiles)
+        {
+            addFile(Key, "trajectory", Path);
+        }
+        addFile(Key, "topology", config.GroFile);
+        Key << "frames " << config.Frames.Begin << " " << config.Frames.End
+            << " " << config.Frames.Stride << " " << config.Frames.Dt << "\n"
+            << "max-atoms " << config.MaxAtoms << "\n";
+        for(const auto& Params: config.Params)
+        {
+            Key << "basis " << Params.Anchor << " " << Params.AtomX << " "
+                << Params.AtomXY << " " << Params.Center.type() << " "
+                << Params.Distance << " " << Params.SliceThickness << "\n";
+            for(const auto& Exclude: Params.OtherAtoms)
+            {
+                Key << "exclude " << Exclude << "\n";
+            }
+        }
+        return Key.str();
+    }
+
+    void EnvCache :: reset(size_t param_count)
+    {
+        ParamCount = std::max<size_t>(param_count, 1);
+        Counts.clear();
+        Offsets.assign(1, 0);
+        Atoms.clear();
+    }
+
+    void EnvCache :: addFrame(const std::vector<std::vector<Atom>>& envs)
+    {
+        if(envs.size() != ParamCount)
+        {
+            throw std::runtime_error("Wrong number of environments in a frame");
+        }
+        for(const auto& Env: envs)
+        {
+            Counts.push_back(Env.size());
+            Atoms.insert(std::end(Atoms), std::begin(Env), std::end(Env));
+            Offsets.push_back(Atoms.size());
+        }
+    }
+
+    bool EnvCache :: load(const std::string& path, const std::string& key)
+    {
+        std::ifstream File(path, std::ios::binary);
+        if(!File)
+        {
+            return false;
+        }
+
+        EnvHeader Header;
+        if(!File.read(reinterpret_cast<char*>(&Header), sizeof(Header)))
+        {
+            return false;
+        }
+        if(std::memcmp(Header.Magic, ENV_MAGIC, sizeof(ENV_MAGIC)) != 0 ||
+           Header.AtomSize != sizeof(Atom) || Header.KeySize != key.size() ||
+           Header.ParamCount == 0 || Header.EnvCount % Header.ParamCount != 0)
+        {
+            return false;
+        }
+        std::string Key(Header.KeySize, '\0');
+        if(!File.read(&Key[0], Key.size()) || Key != key)
+        {
+            return false;
+        }
+
+        std::vector<uint32_t> LoadedCounts(Header.EnvCount);
+        if(!File.read(reinterpret_cast<char*>(LoadedCounts.data()),
+                      sizeof(uint32_t) * Header.EnvCount))
+        {
+            return false;
+        }
+        std::vector<uint64_t> LoadedOffsets(1, 0);
+        LoadedOffsets.reserve(Header.EnvCount + 1);
+        for(uint32_t Count: LoadedCounts)
+        {
+            LoadedOffsets.push_back(LoadedOffsets.back() + Count);
+        }
+        if(LoadedOffsets.back() != Header.AtomCount)
+        {
+            return false;
+        }
+        std::vector<Atom> LoadedAtoms(Header.AtomCount);
+        if(!File.read(reinterpret_cast<char*>(LoadedAtoms.data()),
+                      sizeof(Atom) * Header.AtomCount))
+        {
+            return false;
+        }
+
+        ParamCount = Header.ParamCount;
+        Counts = std::move(LoadedCounts);
+        Offsets = std::move(LoadedOffsets);
+        Atoms = std::move(LoadedAtoms);
+        return true;
+    }
+
+    bool EnvCache :: save(const std::string& path, const std::string& key) const
+    {
+        EnvHeader Header;
+        std::memcpy(Header.Magic, ENV_MAGIC, sizeof(ENV_MAGIC));
+        Header.AtomSize = sizeof(Atom);
+        Header.KeySize = key.size();
+        Header.ParamCount = ParamCount;
+        Header.EnvCount = Counts.size();
+        Header.AtomCount = Atoms.size();
+
+        const std::string TmpPath = path + ".tmp." + std::to_string(getpid());
+        {
+            std::ofstream File(TmpPath, std::ios::binary | std::ios::trunc);
+            if(!File)
+            {
+                return false;
+            }
+            File.write(reinterpret_cast<const char*>(&Header), sizeof(Header));
+            File.write(key.data(), key.size());
+            File.write(reinterpret_cast<const char*>(Counts.data()),
+                       sizeof(uint32_t) * Counts.size());
+            File.write(reinterpret_cast<const char*>(Atoms.data()),
+                       sizeof(Atom) * Atoms.size());
+            if(!File)
+            {
+                File.close();
+                std::remove(TmpPath.c_str());
+                return false;
+            }
+        }
+        if(std::rename(TmpPath.c_str(), path.c_str()) != 0)
+        {
+            std::remove(TmpPath.c_str());
+            return false;
+        }
+        return true;
+    }
+
+} // namespace sdf
@@ -0,0 +1,97 @@
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef SDF_ENVCACHE_H
+#define SDF_ENVCACHE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "config.h"
+
+namespace sdf
+{
+    // The local environments found by prepareFrame() in every frame
+    // of a run: for each frame and each basis, the atoms left around
+    // the basis after the cutoff and the slice, in the aligned
+    // coordinates. They are all the histogram needs, and a small
+    // fraction of the trajectory, so a later run that only changes
+    // the histogram (resolution, range, or measure) can be replayed
+    // from them without reading the trajectory.
+    //
+    // The file is a private cache, written in native byte order. It
+    // records the key() of the run that made it, and is only used by
+    // runs with the same key.
+    class EnvCache
+    {
+    public:
+        // The slice is thin, and the histogram is in its plane, so
+        // only x and y are kept.
+        struct Atom
+        {
+            // Index of the atom in the topology.
+            uint32_t Index;
+            float X;
+            float Y;
+        };
+
+        // Everything in config that decides which atoms end up where:
+        // the trajectories and the topology with their fingerprints,
+        // the frame selection, the atom limit, and the bases. Throws
+        // std::runtime_error if a file cannot be stat’ed, which is
+        // the case for standard input.
+        static std::string key(const RuntimeConfig& config);
+
+        // Forget all frames, and expect param_count environments per
+        // frame from now on.
+        void reset(size_t param_count);
+        // Add a frame, with one environment per basis, in the order
+        // of RuntimeConfig::Params. Frames can be added in any order.
+        void addFrame(const std::vector<std::vector<Atom>>& envs);
+
+        size_t frameCount() const { return Counts.size() / ParamCount; }
+        size_t paramCount() const { return ParamCount; }
+        // The atoms in the environment of the param-th basis in the
+        // frame-th frame.
+        const Atom* begin(size_t frame, size_t param) const
+        {
+            return Atoms.data() + Offsets[frame * ParamCount + param];
+        }
+        const Atom* end(size_t frame, size_t param) const
+        {
+            return Atoms.data() + Offsets[frame * ParamCount + param + 1];
+        }
+
+        // Return false if the file does not exist, is malformed, or
+        // was made by a run with a different key.
+        bool load(const std::string& path, const std::string& key);
+        // Return false if the file cannot be written. The write is
+        // atomic, like XtcIndex::save().
+        bool save(const std::string& path, const std::string& key) const;
+
+    private:
+        size_t ParamCount = 1;
+        // Number of atoms in each environment, frame by frame.
+        std::vector<uint32_t> Counts;
+        // Where each environment begins in Atoms, plus the end.
+        std::vector<uint64_t> Offsets = {0};
+        std::vector<Atom> Atoms;
+    };
+
+} // namespace sdf
+
+#endif
@@ -0,0 +1,258 @@
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+#include <unistd.h>
+
+#include "framecache.h"
+
+namespace libmd
+{
+    namespace
+    {
+        constexpr char CACHE_MAGIC[8] = {'S', 'D', 'F', 'C', 'A', 'C', 'H', 'E'};
+        // Also tells a cache written on a machine of the other byte
+        // order.
+        constexpr uint32_t CACHE_VERSION = 1;
+        constexpr uint64_t ALIGNMENT = 64;
+
+        struct CacheHeader
+        {
+            char Magic[8];
+            uint32_t Version;
+            uint32_t AtomCount;
+            uint64_t FrameCount;
+            uint64_t FrameSize;
+            char Padding[32];
+        };
+        static_assert(sizeof(CacheHeader) == ALIGNMENT, "Bad cache header size");
+
+        struct CacheFrameHeader
+        {
+            int32_t Step;
+            float Time;
+            float BoxDim[9];
+            char Padding[20];
+        };
+        static_assert(sizeof(CacheFrameHeader) == ALIGNMENT,
+                      "Bad cache frame header size");
+
+        uint64_t arraySize(size_t atom_count)
+        {
+            return (atom_count * sizeof(float) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        }
+
+        bool readHeader(std::istream& s, CacheHeader& header)
+        {
+            return static_cast<bool>(s.read(reinterpret_cast<char*>(&header),
+                                            sizeof(header))) &&
+                std::memcmp(header.Magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 &&
+                header.Version == CACHE_VERSION;
+        }
+    } // namespace
+
+    bool FrameCache :: isCache(const std::string& path)
+    {
+        std::ifstream File(path, std::ios::binary);
+        CacheHeader Header;
+        return readHeader(File, Header);
+    }
+
+    size_t FrameCache :: build(XtcFile& xtc, const std::string& path,
+                               std::ostream* progress)
+    {
+        const std::string TmpPath = path + ".tmp." + std::to_string(getpid());
+        std::ofstream File(TmpPath, std::ios::binary | std::ios::trunc);
+        if(!File)
+        {
+            throw std::runtime_error("Failed to write " + TmpPath);
+        }
+
+        CacheHeader Header;
+        std::memset(&Header, 0, sizeof(Header));
+        std::memcpy(Header.Magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        Header.Version = CACHE_VERSION;
+        // Filled in at the end.
+        File.write(reinterpret_cast<const char*>(&Header), sizeof(Header));
+
+        // Its arrays are padded like those in the file.
+        static_assert(Coordinates::PADDING * sizeof(float) == ALIGNMENT,
+                      "Coordinates are not padded like the cache");
+        Coordinates Coords;
+        uint64_t ArraySize = 0;
+        while(!xtc.eof())
+        {
+            const auto Meta = xtc.readFrameMeta();
+            if(Header.FrameCount == 0)
+            {
+                Header.AtomCount = Meta.AtomCount;
+                ArraySize = arraySize(Meta.AtomCount);
+                Header.FrameSize = sizeof(CacheFrameHeader) + 3 * ArraySize;
+                Coords.resize(Meta.AtomCount);
+            }
+            else if(static_cast<uint32_t>(Meta.AtomCount) != Header.AtomCount)
+            {
+                File.close();
+                std::remove(TmpPath.c_str());
+                throw std::runtime_error("Atom count changes along the trajectory");
+            }
+            xtc.readFrame(Coords.layout());
+
+            CacheFrameHeader FrameHeader;
+            std::memset(&FrameHeader, 0, sizeof(FrameHeader));
+            FrameHeader.Step = Meta.Step;
+            FrameHeader.Time = Meta.Time;
+            for(size_t i = 0; i < 9; i++)
+            {
+                FrameHeader.BoxDim[i] = Meta.BoxDim[i / 3][i % 3];
+            }
+            File.write(reinterpret_cast<const char*>(&FrameHeader), sizeof(FrameHeader));
+            File.write(reinterpret_cast<const char*>(Coords.x()), ArraySize);
+            File.write(reinterpret_cast<const char*>(Coords.y()), ArraySize);
+            File.write(reinterpret_cast<const char*>(Coords.z()), ArraySize);
+            Header.FrameCount++;
+            if(progress != nullptr && Header.FrameCount % 100 == 0)
+            {
+                *progress << "." << std::flush;
+            }
+        }
+
+        File.seekp(0);
+        File.write(reinterpret_cast<const char*>(&Header), sizeof(Header));
+        File.close();
+        if(!File || std::rename(TmpPath.c_str(), path.c_str()) != 0)
+        {
+            std::remove(TmpPath.c_str());
+            throw std::runtime_error("Failed to write " + path);
+        }
+        return Header.FrameCount;
+    }
+
+    void FrameCache :: open(const std::string& path)
+    {
+        close();
+        std::ifstream File(path, std::ios::binary);
+        CacheHeader Header;
+        if(!readHeader(File, Header))
+        {
+            throw std::runtime_error("Not a frame cache: " + path);
+        }
+        File.close();
+        if(!Map.open(path) ||
+           Map.size() != sizeof(Header) + Header.FrameCount * Header.FrameSize ||
+           Header.FrameSize != sizeof(CacheFrameHeader) + 3 * arraySize(Header.AtomCount))
+        {
+            close();
+            throw std::runtime_error("Broken frame cache: " + path);
+        }
+        Map.adviseSequential();
+        FrameCount = Header.FrameCount;
+        AtomCount = Header.AtomCount;
+        ArraySize = arraySize(AtomCount);
+        FrameSize = Header.FrameSize;
+    }
+
+    void FrameCache :: close()
+    {
+        Map.close();
+        FrameCount = 0;
+        AtomCount = 0;
+        Index.clear();
+        IndexReady = false;
+    }
+
+    uint64_t FrameCache :: offset(size_t frame) const
+    {
+        return sizeof(CacheHeader) + frame * FrameSize;
+    }
+
+    size_t FrameCache :: frameAt(uint64_t offset) const
+    {
+        if(offset <= sizeof(CacheHeader))
+        {
+            return 0;
+        }
+        const uint64_t Frame = (offset - sizeof(CacheHeader) + FrameSize - 1) / FrameSize;
+        return std::min<uint64_t>(Frame, FrameCount);
+    }
+
+    XtcFile::FrameMeta FrameCache :: meta(size_t frame) const
+    {
+        CacheFrameHeader Header;
+        std::memcpy(&Header, Map.data() + offset(frame), sizeof(Header));
+        XtcFile::FrameMeta Meta;
+        Meta.AtomCount = AtomCount;
+        Meta.Step = Header.Step;
+        Meta.Time = Header.Time;
+        for(size_t i = 0; i < 9; i++)
+        {
+            Meta.BoxDim[i / 3][i % 3] = Header.BoxDim[i];
+        }
+        return Meta;
+    }
+
+    const float* FrameCache :: coords(size_t frame, size_t dim) const
+    {
+        return reinterpret_cast<const float*>(
+            Map.data() + offset(frame) + sizeof(CacheFrameHeader) + dim * ArraySize);
+    }
+
+    void FrameCache :: copy(size_t frame, size_t n, const CoordLayout& out) const
+    {
+        const float* X = x(frame);
+        const float* Y = y(frame);
+        const float* Z = z(frame);
+        n = std::min(n, AtomCount);
+        if(out.Step == 1)
+        {
+            std::memcpy(out.X, X, n * sizeof(float));
+            std::memcpy(out.Y, Y, n * sizeof(float));
+            std::memcpy(out.Z, Z, n * sizeof(float));
+            return;
+        }
+        for(size_t i = 0; i < n; i++)
+        {
+            out.set(i, X[i], Y[i], Z[i]);
+        }
+    }
+
+    const XtcIndex& FrameCache :: index()
+    {
+        if(!IndexReady)
+        {
+            Index.clear();
+            for(size_t i = 0; i < FrameCount; i++)
+            {
+                const auto Meta = meta(i);
+                XtcIndex::Entry Entry;
+                Entry.Offset = offset(i);
+                Entry.Step = Meta.Step;
+                Entry.Time = Meta.Time;
+                Entry.BoxDim = Meta.BoxDim;
+                Index.add(Entry);
+            }
+            IndexReady = true;
+        }
+        return Index;
+    }
+
+} // namespace libmd
@@ -0,0 +1,105 @@
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef SDF_FRAMECACHE_H
+#define SDF_FRAMECACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#include "mappedfile.h"
+#include "xtcindex.h"
+#include "xtcio.h"
+
+namespace libmd
+{
+    // A trajectory decoded once and saved as plain floats, so that
+    // later runs read it without decoding anything.
+    //
+    // The file is a 64-byte header followed by one fixed-size record
+    // per frame: a 64-byte frame header, then the x, y and z
+    // coordinates of all atoms as three float arrays, each padded to
+    // a multiple of 64 bytes. So every array is aligned in a memory
+    // mapping, and frame n is at a known offset. Like the frame
+    // index, this is a private cache, and is in native byte order.
+    class FrameCache
+    {
+    public:
+        static std::string defaultPath(const std::string& xtc_path)
+        {
+            return xtc_path + ".sdfcache";
+        }
+
+        // Whether path is a frame cache, judging by its magic number.
+        static bool isCache(const std::string& path);
+
+        // Decode the frames of xtc from the current position to the
+        // end, and write them to path. Return the number of frames.
+        // The write is atomic, like XtcIndex::save(). Throws
+        // std::runtime_error if path cannot be written, or if the
+        // atom count changes along the trajectory. If progress is not
+        // null, a dot is written to it every 100 frames.
+        static size_t build(XtcFile& xtc, const std::string& path,
+                            std::ostream* progress = nullptr);
+
+        FrameCache() = default;
+        FrameCache(const FrameCache&) = delete;
+        FrameCache& operator=(const FrameCache&) = delete;
+
+        // Throws std::runtime_error if path is not a valid cache.
+        void open(const std::string& path);
+        void close();
+        bool isOpen() const { return Map.isOpen(); }
+
+        size_t frameCount() const { return FrameCount; }
+        size_t atomCount() const { return AtomCount; }
+        uint64_t size() const { return Map.size(); }
+
+        XtcFile::FrameMeta meta(size_t frame) const;
+        const float* x(size_t frame) const { return coords(frame, 0); }
+        const float* y(size_t frame) const { return coords(frame, 1); }
+        const float* z(size_t frame) const { return coords(frame, 2); }
+        // Copy the first n atoms of a frame to “out”.
+        void copy(size_t frame, size_t n, const CoordLayout& out) const;
+
+        // Byte offset of a frame record. offset(frameCount()) is the
+        // size of the file.
+        uint64_t offset(size_t frame) const;
+        // The first frame that begins at or after byte offset
+        // “offset”, or frameCount() if there is none.
+        size_t frameAt(uint64_t offset) const;
+        // The frames as an XtcIndex, with offsets into this file.
+        // Built on the first call.
+        const XtcIndex& index();
+
+    private:
+        const float* coords(size_t frame, size_t dim) const;
+
+        MappedFile Map;
+        size_t FrameCount = 0;
+        size_t AtomCount = 0;
+        // Bytes of one coordinate array, with padding.
+        uint64_t ArraySize = 0;
+        uint64_t FrameSize = 0;
+        XtcIndex Index;
+        bool IndexReady = false;
+    };
+
+} // namespace libmd
+
+#endif
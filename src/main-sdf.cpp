@@ -14,7 +14,12 @@
 // along with this program. If not, see
 // <https://www.gnu.org/licenses/>.
 
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <stdexcept>
 #include <string>
 #include <thread>
 
@@ -26,7 +31,9 @@
 #include <getopt.h>
 
 
+#include "framecache.h"
 #include "sdf.h"
+#include "xtcscan.h"
 
 
 void handler(int sig)
@@ -44,9 +51,33 @@ void handler(int sig)
 }
 
 
+// Parse a size in bytes with an optional K, M, or G suffix. Return 0
+// if it is not valid.
+size_t parseSize(const char* s)
+{
+    char* End;
+    const unsigned long long Value = std::strtoull(s, &End, 10);
+    switch(*End)
+    {
+    case '\0':
+        return Value;
+    case 'k': case 'K':
+        return End[1] == '\0' ? Value << 10 : 0;
+    case 'm': case 'M':
+        return End[1] == '\0' ? Value << 20 : 0;
+    case 'g': case 'G':
+        return End[1] == '\0' ? Value << 30 : 0;
+    default:
+        return 0;
+    }
+}
+
 void usage(const std::string& prog_name)
 {
-    std::cout << "Usage: " << prog_name << " [OPTIONS] INPUT\n";
+    std::cout << "Usage: " << prog_name << " [OPTIONS] INPUT\n"
+              << "       " << prog_name << " --scan [--io MODE] XTC_FILE\n"
+              << "       " << prog_name
+              << " cache build [--io MODE] [-p] XTC_FILE [CACHE_FILE]\n";
 }
 
 void help(const std::string& prog_name)
@@ -82,9 +113,163 @@ void help(const std::string& prog_name)
 "--measure TYPE                 The quantity of which to make\n"
 "    distribution. Valid arguments are 'count', 'charge', and\n"
 "    'count-per-atom'. Default: count.\n\n"
+"--io MODE                      How to read the trajectory. Valid modes\n"
+"    are 'mmap', 'stream', and 'async'. 'async' keeps several large\n"
+"    reads in flight ahead of the decoder, which helps on network and\n"
+"    parallel file systems. 'mmap' and 'async' fall back to 'stream' if\n"
+"    they cannot be used. Default: mmap. Trajectories compressed with\n"
+"    gzip or zstd, pipes, and standard input (given as '-') are always\n"
+"    read front to back, and decompressed on a separate thread.\n\n"
+"--queue-depth N                Number of reads in flight with --io\n"
+"    async. Default: 8.\n\n"
+"--read-size N                  Size of each read with --io async, in\n"
+"    bytes, optionally with a K, M, or G suffix. Default: 4M.\n\n"
+"--direct                       Bypass the page cache (O_DIRECT) with\n"
+"    --io async, if the file system allows it.\n\n"
+"--begin T                      Skip frames before time T, in the\n"
+"    time unit of the XTC file.\n\n"
+"--end T                        Skip frames after time T.\n\n"
+"--stride N                     Only use every Nth frame, counting from\n"
+"    the first frame not before --begin. Default: 1.\n\n"
+"--dt T                         Only use frames whose time after that of\n"
+"    the first frame not before --begin is a multiple of T. Frames\n"
+"    not selected by these options are skipped without being decoded.\n\n"
+"--max-atoms N                  Only read the first N atoms of each\n"
+"    frame, which is faster if the atoms of interest come first in the\n"
+"    topology. The anchor, X and XY atoms are always read. Default: read\n"
+"    all atoms.\n\n"
+"--no-prefilter                 Decode every atom to floats before\n"
+"    applying the distance cutoff, instead of first rejecting atoms far\n"
+"    away using the integers in the XTC file. The result is the same;\n"
+"    this is only useful for checking that.\n\n"
+"--env-cache FILE               Save the atoms found around each basis in\n"
+"    every frame to FILE, after alignment. A later run with the same\n"
+"    trajectories, frames, --max-atoms and bases (atoms, center,\n"
+"    distance cutoff and slice thickness) reads them back from FILE\n"
+"    instead of the trajectory, so changing only the resolution,\n"
+"    histogram range or measure is fast. FILE is rewritten if any of\n"
+"    those differ, or if a trajectory changes.\n\n"
+"-o FILE, --output FILE         Write the result to FILE instead of\n"
+"    the standard output. FILE is replaced atomically.\n\n"
+"-f, --follow                   Keep reading the trajectory as a running\n"
+"    simulation writes it. Frames already in the file are used as\n"
+"    usual; after that, new frames are used as soon as they are\n"
+"    complete. The result so far is written to the --output file, which\n"
+"    is required, every --follow-interval seconds. This needs a single\n"
+"    uncompressed trajectory file, which is read by one reader.\n\n"
+"--follow-interval T            Seconds between updates of the output\n"
+"    with --follow. Default: 60.\n\n"
+"--follow-timeout T             Stop following if no frame has come for\n"
+"    T seconds, and write the final result. Default: never; the output\n"
+"    file then holds the last update when the program is killed.\n\n"
+"--scan                         Instead of running the analysis, list\n"
+"    the frames of the XTC file given as INPUT, and summarize the frame\n"
+"    count, time range and box changes. Only frame headers are read.\n\n"
+"cache build                    Decode all frames of XTC_FILE once, and\n"
+"    write them as plain floats to CACHE_FILE (default:\n"
+"    XTC_FILE.sdfcache). The cache can be given instead of the XTC file\n"
+"    as the trajectory of later runs, which then do not decode\n"
+"    anything. It takes about 3 times the space of the XTC file.\n\n"
         ;
 }
 
+// Write “text” to “path”, or standard output if “path” is empty. The
+// file is replaced atomically, so a reader never sees half of it.
+bool writeOutput(const std::string& path, const std::string& text)
+{
+    if(path.empty())
+    {
+        std::cout << text << std::flush;
+        return static_cast<bool>(std::cout);
+    }
+    const std::string TmpPath = path + ".tmp." + std::to_string(getpid());
+    {
+        std::ofstream File(TmpPath, std::ios::trunc);
+        File << text;
+        if(!File)
+        {
+            File.close();
+            std::remove(TmpPath.c_str());
+            std::cerr << "Failed to write " << path << std::endl;
+            return false;
+        }
+    }
+    if(std::rename(TmpPath.c_str(), path.c_str()) != 0)
+    {
+        std::remove(TmpPath.c_str());
+        std::cerr << "Failed to write " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Run the analysis, and write the result. Results so far are written
+// as they come when following.
+template <class DistTraits>
+int runAndWrite(const sdf::RuntimeConfig& config, const std::string& output)
+{
+    try
+    {
+        const auto Result = sdf::run<DistTraits>(
+            config, [&](const sdf::Distribution2<DistTraits>& so_far)
+            {
+                writeOutput(output, so_far.jsonMesh(config.AverageOverFrameCount));
+            });
+        return writeOutput(output, Result.jsonMesh(config.AverageOverFrameCount)) ? 0 : 1;
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
+
+int scan(const std::string& xtc_file, libmd::XtcFile::IoMode mode)
+{
+    libmd::XtcFile File;
+    File.open(xtc_file.c_str(), mode);
+    if(!File.isOpen())
+    {
+        std::cerr << "Failed to open " << xtc_file << std::endl;
+        return 1;
+    }
+
+    std::cout << "# frame\toffset\tstep\ttime\tbox_x\tbox_y\tbox_z\n";
+    const auto Summary = libmd::scanXtc(File, &std::cout);
+    std::cout << "# Frames: " << Summary.FrameCount << "\n"
+              << "# Atoms: " << Summary.AtomCount << "\n"
+              << "# Steps: " << Summary.FirstStep << " - " << Summary.LastStep << "\n"
+              << "# Time: " << Summary.FirstTime << " - " << Summary.LastTime << "\n"
+              << "# Box changes: " << Summary.BoxChanges << std::endl;
+    if(Summary.Truncated)
+    {
+        std::cerr << "Warning: stopped at an unreadable frame at byte "
+                  << File.tell() << std::endl;
+    }
+    return 0;
+}
+
+int buildCache(const std::string& xtc_file, const std::string& cache_file,
+               libmd::XtcFile::IoMode mode, bool progress)
+{
+    libmd::XtcFile File;
+    File.open(xtc_file.c_str(), mode);
+    if(!File.isOpen())
+    {
+        std::cerr << "Failed to open " << xtc_file << std::endl;
+        return 1;
+    }
+
+    const size_t Count = libmd::FrameCache::build(
+        File, cache_file, progress ? &std::cerr : nullptr);
+    if(progress)
+    {
+        std::cerr << std::endl;
+    }
+    std::cout << "Wrote " << Count << " frames to " << cache_file << std::endl;
+    return 0;
+}
+
 int main(int argc, char** argv)
 {
     signal(SIGSEGV, handler);
@@ -105,6 +290,28 @@ int main(int argc, char** argv)
     std::string Measure("count");
     const std::unordered_set<std::string> ValidMeasures =
         {"count", "charge", "count-per-atom"};
+    libmd::XtcFile::IoMode IoMode = libmd::XtcFile::MMAP;
+    bool Scan = false;
+    libmd::FrameSelection Frames;
+    size_t MaxAtoms = 0;
+    bool Prefilter = true;
+    libmd::PrefetchOptions Prefetch;
+    std::string EnvCacheFile;
+    std::string OutputFile;
+    bool Follow = false;
+    double FollowInterval = 60.0;
+    double FollowTimeout = 0.0;
+
+    // “cache build” is a subcommand. Hide it from getopt.
+    bool CacheBuild = false;
+    if(argc >= 3 && std::string(argv[1]) == "cache" &&
+       std::string(argv[2]) == "build")
+    {
+        CacheBuild = true;
+        argv[2] = argv[0];
+        argc -= 2;
+        argv += 2;
+    }
 
     {
         static struct option Options[] = {
@@ -119,11 +326,27 @@ int main(int argc, char** argv)
             { "average", no_argument, nullptr, 'a' },
             { "center", required_argument, nullptr, 'c' },
             { "measure", required_argument, &MeasureSpecified, 1},
+            { "io", required_argument, nullptr, 'i' },
+            { "scan", no_argument, nullptr, 'S' },
+            { "begin", required_argument, nullptr, 'B' },
+            { "end", required_argument, nullptr, 'E' },
+            { "stride", required_argument, nullptr, 'K' },
+            { "dt", required_argument, nullptr, 'T' },
+            { "max-atoms", required_argument, nullptr, 'M' },
+            { "no-prefilter", no_argument, nullptr, 'P' },
+            { "queue-depth", required_argument, nullptr, 'Q' },
+            { "read-size", required_argument, nullptr, 'R' },
+            { "direct", no_argument, nullptr, 'O' },
+            { "env-cache", required_argument, nullptr, 'V' },
+            { "output", required_argument, nullptr, 'o' },
+            { "follow", no_argument, nullptr, 'f' },
+            { "follow-interval", required_argument, nullptr, 'I' },
+            { "follow-timeout", required_argument, nullptr, 'W' },
             { nullptr, 0, nullptr, 0 }
         };
 
         int ch;
-        while ((ch = getopt_long(argc, argv, "ht:d:s:r:pa", Options, nullptr)) != -1)
+        while ((ch = getopt_long(argc, argv, "ht:d:s:r:pao:f", Options, nullptr)) != -1)
         {
             switch (ch)
             {
@@ -159,6 +382,80 @@ int main(int argc, char** argv)
             case 'c':
                 CenterType = std::string(optarg);
                 break;
+            case 'i':
+                if(std::string(optarg) == "mmap")
+                {
+                    IoMode = libmd::XtcFile::MMAP;
+                }
+                else if(std::string(optarg) == "stream")
+                {
+                    IoMode = libmd::XtcFile::STREAM;
+                }
+                else if(std::string(optarg) == "async")
+                {
+                    IoMode = libmd::XtcFile::ASYNC;
+                }
+                else
+                {
+                    std::cerr << "Invalid IO mode: " << optarg << std::endl;
+                    return -1;
+                }
+                break;
+            case 'S':
+                Scan = true;
+                break;
+            case 'B':
+                Frames.Begin = std::atof(optarg);
+                break;
+            case 'E':
+                Frames.End = std::atof(optarg);
+                break;
+            case 'K':
+                if(std::atoi(optarg) < 1)
+                {
+                    std::cerr << "Invalid stride: " << optarg << std::endl;
+                    return -1;
+                }
+                Frames.Stride = std::atoi(optarg);
+                break;
+            case 'T':
+                Frames.Dt = std::atof(optarg);
+                break;
+            case 'M':
+                MaxAtoms = std::atoi(optarg);
+                break;
+            case 'P':
+                Prefilter = false;
+                break;
+            case 'Q':
+                Prefetch.QueueDepth = std::max(std::atoi(optarg), 1);
+                break;
+            case 'R':
+                Prefetch.ReadSize = parseSize(optarg);
+                if(Prefetch.ReadSize == 0)
+                {
+                    std::cerr << "Invalid read size: " << optarg << std::endl;
+                    return -1;
+                }
+                break;
+            case 'O':
+                Prefetch.Direct = true;
+                break;
+            case 'V':
+                EnvCacheFile = optarg;
+                break;
+            case 'o':
+                OutputFile = optarg;
+                break;
+            case 'f':
+                Follow = true;
+                break;
+            case 'I':
+                FollowInterval = std::atof(optarg);
+                break;
+            case 'W':
+                FollowTimeout = std::atof(optarg);
+                break;
             case 0:
                 if(MeasureSpecified == 1)
                 {
@@ -174,12 +471,35 @@ int main(int argc, char** argv)
         argv += optind;
     }
 
+    if(CacheBuild)
+    {
+        if(argc < 1 || argc > 2)
+        {
+            usage(ProgName);
+            return -1;
+        }
+        return buildCache(argv[0], argc == 2 ? argv[1] :
+                          libmd::FrameCache::defaultPath(argv[0]),
+                          IoMode, Progress);
+    }
+
     if(argc != 1)
     {
         usage(ProgName);
         return -1;
     }
 
+    if(Scan)
+    {
+        return scan(argv[0], IoMode);
+    }
+
+    if(Follow && OutputFile.empty())
+    {
+        std::cerr << "--follow needs --output" << std::endl;
+        return -1;
+    }
+
     if(ValidMeasures.find(Measure) == std::end(ValidMeasures))
     {
         std::cerr << "Invalid measure: " << Measure << std::endl;
@@ -226,27 +546,31 @@ int main(int argc, char** argv)
     }
     Config.Progress = Progress;
     Config.AverageOverFrameCount = Average;
+    Config.XtcIoMode = IoMode;
+    Config.Frames = Frames;
+    Config.MaxAtoms = MaxAtoms;
+    Config.Prefilter = Prefilter;
+    Config.Prefetch = Prefetch;
+    Config.EnvCacheFile = EnvCacheFile;
+    Config.Follow = Follow;
+    Config.FollowInterval = FollowInterval;
+    Config.FollowTimeout = FollowTimeout;
 
     if(Measure == "count")
     {
-        const auto Result = sdf::run<sdf::DistCountTraits>(Config);
-        std::cout << Result.jsonMesh(Config.AverageOverFrameCount);
+        return runAndWrite<sdf::DistCountTraits>(Config, OutputFile);
     }
     else if(Measure == "charge")
     {
-        const auto Result = sdf::run<sdf::DistChargeTraits>(Config);
-        std::cout << Result.jsonMesh(Config.AverageOverFrameCount);
+        return runAndWrite<sdf::DistChargeTraits>(Config, OutputFile);
     }
     else if(Measure == "count-per-atom")
     {
-        const auto Result = sdf::run<sdf::DistDetailedCountTraits>(Config);
-        std::cout << Result.jsonMesh(Config.AverageOverFrameCount);
+        return runAndWrite<sdf::DistDetailedCountTraits>(Config, OutputFile);
     }
     else
     {
         std::cerr << "Shit happened!" << std::endl;
         return 1;
     }
-
-    return 0;
 }
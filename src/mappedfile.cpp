@@ -0,0 +1,90 @@
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mappedfile.h"
+
+namespace libmd
+{
+    bool MappedFile :: open(const std::string& path)
+    {
+        close();
+        int Fd = ::open(path.c_str(), O_RDONLY);
+        if(Fd < 0)
+        {
+            return false;
+        }
+
+        struct stat Info;
+        // mmap() of an empty file fails, and there is nothing to map
+        // for pipes and the like.
+        if(fstat(Fd, &Info) != 0 || !S_ISREG(Info.st_mode) || Info.st_size == 0)
+        {
+            ::close(Fd);
+            return false;
+        }
+
+        void* Mapped = mmap(nullptr, Info.st_size, PROT_READ, MAP_PRIVATE, Fd, 0);
+        // The mapping stays valid after the descriptor is closed.
+        ::close(Fd);
+        if(Mapped == MAP_FAILED)
+        {
+            return false;
+        }
+        Data = static_cast<const unsigned char*>(Mapped);
+        Size = Info.st_size;
+        return true;
+    }
+
+    void MappedFile :: close()
+    {
+        if(Data != nullptr)
+        {
+            munmap(const_cast<unsigned char*>(Data), Size);
+            Data = nullptr;
+            Size = 0;
+        }
+    }
+
+    void MappedFile :: adviseSequential() const
+    {
+        if(Data != nullptr)
+        {
+            madvise(const_cast<unsigned char*>(Data), Size, MADV_SEQUENTIAL);
+        }
+    }
+
+    void MappedFile :: willNeed(size_t offset, size_t length) const
+    {
+        if(Data == nullptr || offset >= Size)
+        {
+            return;
+        }
+        // madvise() wants a page-aligned address.
+        static const size_t PageSize = sysconf(_SC_PAGESIZE);
+        const size_t Begin = offset / PageSize * PageSize;
+        const size_t End = std::min(Size, offset + length);
+        madvise(const_cast<unsigned char*>(Data) + Begin, End - Begin,
+                MADV_WILLNEED);
+    }
+
+} // namespace libmd
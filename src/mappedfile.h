@@ -0,0 +1,57 @@
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef SDF_MAPPEDFILE_H
+#define SDF_MAPPEDFILE_H
+
+#include <cstddef>
+#include <string>
+
+namespace libmd
+{
+    // A read-only memory mapping of a whole file.
+    class MappedFile
+    {
+    public:
+        MappedFile() = default;
+        ~MappedFile() { close(); }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        // Return false if the file cannot be opened or mapped, in
+        // which case the caller should fall back to regular reads.
+        bool open(const std::string& path);
+        void close();
+        bool isOpen() const { return Data != nullptr; }
+
+        const unsigned char* data() const { return Data; }
+        size_t size() const { return Size; }
+
+        // Tell the kernel the mapping will be read front to back, so
+        // it reads ahead aggressively and drops pages behind us.
+        void adviseSequential() const;
+        // Tell the kernel [offset, offset+length) will be needed soon.
+        void willNeed(size_t offset, size_t length) const;
+
+    private:
+        const unsigned char* Data = nullptr;
+        size_t Size = 0;
+    };
+
+} // namespace libmd
+
+#endif
@@ -39,7 +39,15 @@ namespace libmd
         {
             return std::sqrt(distSquare(lhs, rhs));
         }
-        float distSquare(const VecRefType& lhs, const VecRefType& rhs) const;
+        // Inline and without branches, so that a loop over atoms
+        // calling this vectorizes.
+        float distSquare(const VecRefType& lhs, const VecRefType& rhs) const
+        {
+            const float x = dist1d(0, lhs[0], rhs[0]);
+            const float y = dist1d(1, lhs[1], rhs[1]);
+            const float z = dist1d(2, lhs[2], rhs[2]);
+            return x*x + y*y + z*z;
+        }
 
         void wrapVec(const float base[], float to_wrap[]) const;
 
@@ -50,18 +58,47 @@ namespace libmd
         // But for some reason it does not compile with both arguments
         // being Vector3f: “calling a private constructor of class
         // 'Eigen::Ref<Eigen::Matrix<float, 3, 1, 0, 3, 1>, 0,
-        // Eigen::InnerStride<1> >'”...
-        template <typename T>
-        void wrapVec(const T& base, T& to_wrap) const
+        // Eigen::InnerStride<1> >'”... This also takes the strided
+        // V3Map’s of Coordinates, which are temporaries.
+        template <typename T, typename U>
+        void wrapVec(const T& base, U&& to_wrap) const
         {
-            wrapVec(base.data(), to_wrap.data());
+            for(size_t Dim = 0; Dim < 3; Dim++)
+            {
+                to_wrap[Dim] = wrap1d(Dim, base[Dim], to_wrap[Dim]);
+            }
         }
 
         const float DiagLength;
 
     private:
-        float dist1d(const size_t dim_idx, float lhs, float rhs) const;
-        float wrap1d(const size_t dim_idx, float base, float rhs) const;
+        float dist1d(const size_t dim_idx, float lhs, float rhs) const
+        {
+            const float Dim = Dimension[dim_idx];
+            float Dist = std::abs(lhs - rhs);
+            Dist -= Dist > Dim ? std::floor(Dist / Dim) * Dim : 0.0f;
+            return Dist > Dim * 0.5f ? Dim - Dist : Dist;
+        }
+        // Inline, because prepareFrame() wraps atom by atom.
+        float wrap1d(const size_t dim_idx, float base, float rhs) const
+        {
+            const float Dim = Dimension[dim_idx];
+            float Dist = rhs - base;
+            if(Dist > Dim || -Dist >= Dim)
+            {
+                rhs -= std::floor(Dist / Dim) * Dim;
+            }
+            if(rhs - base > Dim * 0.5)
+            {
+                rhs -= Dim;
+            }
+            else if(base - rhs > Dim * 0.5) // See test case “PBC wrap forward”.
+            {
+                rhs += Dim;
+            }
+
+            return rhs;
+        }
 
         const std::array<float, 3> Dimension;
     };
@@ -0,0 +1,245 @@
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "prefetch.h"
+
+namespace libmd
+{
+    namespace
+    {
+        // O_DIRECT wants the buffer, offset and length aligned to the
+        // logical block size. 4 KiB covers every common device.
+        constexpr size_t ALIGNMENT = 4096;
+    } // namespace
+
+    bool PrefetchReader :: open(const std::string& path,
+                                const PrefetchOptions& options)
+    {
+        close();
+        int Flags = O_RDONLY;
+#ifdef O_DIRECT
+        if(options.Direct)
+        {
+            Flags |= O_DIRECT;
+        }
+#endif
+        Fd = ::open(path.c_str(), Flags);
+        if(Fd < 0 && Flags != O_RDONLY)
+        {
+            // Some file systems (tmpfs, for one) refuse O_DIRECT.
+            Fd = ::open(path.c_str(), O_RDONLY);
+        }
+        if(Fd < 0)
+        {
+            return false;
+        }
+        struct stat Info;
+        if(fstat(Fd, &Info) != 0 || !S_ISREG(Info.st_mode))
+        {
+            ::close(Fd);
+            Fd = -1;
+            return false;
+        }
+        Size = Info.st_size;
+        Pos = 0;
+
+        ChunkSize = std::max<size_t>(
+            (options.ReadSize + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT, ALIGNMENT);
+        Slots.resize(std::max<size_t>(options.QueueDepth, 1));
+        for(auto& S: Slots)
+        {
+            void* Buffer = nullptr;
+            if(posix_memalign(&Buffer, ALIGNMENT, ChunkSize) != 0)
+            {
+                close();
+                throw std::bad_alloc();
+            }
+            S.Buffer = static_cast<unsigned char*>(Buffer);
+        }
+
+        Stopping = false;
+        for(size_t i = 0; i < Slots.size(); i++)
+        {
+            Workers.emplace_back(&PrefetchReader::work, this);
+        }
+        return true;
+    }
+
+    void PrefetchReader :: close()
+    {
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            Stopping = true;
+            Queue.clear();
+        }
+        Requested.notify_all();
+        for(auto& Worker: Workers)
+        {
+            Worker.join();
+        }
+        Workers.clear();
+        for(auto& S: Slots)
+        {
+            std::free(S.Buffer);
+        }
+        Slots.clear();
+        if(Fd >= 0)
+        {
+            ::close(Fd);
+            Fd = -1;
+        }
+        Size = 0;
+        Pos = 0;
+    }
+
+    void PrefetchReader :: work()
+    {
+        std::unique_lock<std::mutex> Guard(Lock);
+        while(true)
+        {
+            Requested.wait(Guard, [this] { return Stopping || !Queue.empty(); });
+            if(Stopping)
+            {
+                return;
+            }
+            const auto Request = Queue.front();
+            Queue.pop_front();
+            Slot& S = Slots[Request.first];
+            // The slot may have been given to another chunk since.
+            if(S.Chunk != Request.second || S.State != PENDING)
+            {
+                continue;
+            }
+            S.State = READING;
+            const uint64_t Offset = S.Chunk * ChunkSize;
+            const size_t Wanted = std::min<uint64_t>(ChunkSize, Size - Offset);
+            Guard.unlock();
+
+            size_t Got = 0;
+            int Error = 0;
+            while(Got < Wanted)
+            {
+                // With O_DIRECT the length has to be aligned too, so
+                // always ask for the whole chunk.
+                const ssize_t Result = pread(Fd, S.Buffer + Got, ChunkSize - Got,
+                                             Offset + Got);
+                if(Result < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if(Result < 0)
+                {
+                    Error = errno;
+                    break;
+                }
+                if(Result == 0)
+                {
+                    // The file got shorter.
+                    Error = EIO;
+                    break;
+                }
+                Got += Result;
+            }
+
+            Guard.lock();
+            S.Length = std::min(Got, Wanted);
+            S.Error = Error;
+            S.State = Error != 0 ? FAILED : READY;
+            Done.notify_all();
+        }
+    }
+
+    void PrefetchReader :: request(uint64_t chunk,
+                                   std::unique_lock<std::mutex>& lock)
+    {
+        const size_t Index = chunk % Slots.size();
+        Slot& S = Slots[Index];
+        if(S.Chunk == chunk && S.State != EMPTY)
+        {
+            return;
+        }
+        // The buffer cannot be taken while it is being read into.
+        Done.wait(lock, [&S] { return S.State != READING; });
+        S.Chunk = chunk;
+        S.State = PENDING;
+        Queue.emplace_back(Index, chunk);
+        Requested.notify_one();
+    }
+
+    PrefetchReader::Slot& PrefetchReader :: current()
+    {
+        const uint64_t Chunk = Pos / ChunkSize;
+        const uint64_t ChunkCount = (Size + ChunkSize - 1) / ChunkSize;
+        std::unique_lock<std::mutex> Guard(Lock);
+        for(uint64_t i = Chunk; i < std::min<uint64_t>(Chunk + Slots.size(), ChunkCount); i++)
+        {
+            request(i, Guard);
+        }
+        Slot& S = Slots[Chunk % Slots.size()];
+        Done.wait(Guard, [&S] { return S.State == READY || S.State == FAILED; });
+        if(S.State == FAILED)
+        {
+            // Try again next time.
+            S.State = EMPTY;
+            throw std::runtime_error(std::string("failed to read trajectory: ") +
+                                     std::strerror(S.Error));
+        }
+        return S;
+    }
+
+    bool PrefetchReader :: read(void* dest, size_t n)
+    {
+        if(Pos + n > Size)
+        {
+            return false;
+        }
+        unsigned char* Dest = static_cast<unsigned char*>(dest);
+        while(n > 0)
+        {
+            const Slot& S = current();
+            const size_t Begin = Pos - S.Chunk * ChunkSize;
+            const size_t Count = std::min(n, S.Length - Begin);
+            std::memcpy(Dest, S.Buffer + Begin, Count);
+            Dest += Count;
+            Pos += Count;
+            n -= Count;
+        }
+        return true;
+    }
+
+    const unsigned char* PrefetchReader :: view(size_t n)
+    {
+        if(n == 0 || Pos + n > Size || Pos / ChunkSize != (Pos + n - 1) / ChunkSize)
+        {
+            return nullptr;
+        }
+        const Slot& S = current();
+        const unsigned char* Result = S.Buffer + (Pos - S.Chunk * ChunkSize);
+        Pos += n;
+        return Result;
+    }
+
+} // namespace libmd
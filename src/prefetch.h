@@ -0,0 +1,115 @@
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef SDF_PREFETCH_H
+#define SDF_PREFETCH_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace libmd
+{
+    struct PrefetchOptions
+    {
+        // Number of reads kept in flight.
+        size_t QueueDepth = 8;
+        // Size of each read. Rounded up to a multiple of 4 KiB.
+        size_t ReadSize = 4 << 20;
+        // Bypass the page cache with O_DIRECT, if the file system
+        // allows it.
+        bool Direct = false;
+    };
+
+    // Reads a file through a window of large, aligned reads that are
+    // issued ahead of the read position by a pool of threads, so that
+    // several reads are in flight at any time. This hides latency on
+    // file systems where a single sequential reader cannot saturate
+    // the bandwidth, such as network or parallel file systems.
+    //
+    // The file is cut into fixed chunks of ReadSize bytes. Whenever
+    // the read position enters a chunk, the next QueueDepth - 1
+    // chunks are requested.
+    class PrefetchReader
+    {
+    public:
+        PrefetchReader() = default;
+        ~PrefetchReader() { close(); }
+
+        PrefetchReader(const PrefetchReader&) = delete;
+        PrefetchReader& operator=(const PrefetchReader&) = delete;
+
+        // Return false if the file cannot be opened.
+        bool open(const std::string& path, const PrefetchOptions& options);
+        void close();
+        bool isOpen() const { return Fd >= 0; }
+
+        // Copy the next n bytes to dest. Return false if there are not
+        // n bytes left. Throws std::runtime_error on read errors.
+        bool read(void* dest, size_t n);
+        // Return a pointer to the next n bytes and move past them, if
+        // they are all in one chunk. Otherwise return nullptr without
+        // moving, and the caller should read() them instead. The
+        // pointer is valid until the next call.
+        const unsigned char* view(size_t n);
+
+        void seek(uint64_t pos) { Pos = pos; }
+        uint64_t tell() const { return Pos; }
+        uint64_t size() const { return Size; }
+        bool eof() const { return Pos >= Size; }
+
+    private:
+        enum SlotState { EMPTY, PENDING, READING, READY, FAILED };
+        struct Slot
+        {
+            uint64_t Chunk = 0;
+            SlotState State = EMPTY;
+            unsigned char* Buffer = nullptr;
+            size_t Length = 0;
+            // errno of a failed read.
+            int Error = 0;
+        };
+
+        // Make sure the chunk Pos is in is ready, and the ones after
+        // it are requested. Return the slot of the current chunk.
+        Slot& current();
+        // Called with Lock held.
+        void request(uint64_t chunk, std::unique_lock<std::mutex>& lock);
+        void work();
+
+        int Fd = -1;
+        uint64_t Size = 0;
+        uint64_t Pos = 0;
+        size_t ChunkSize = 0;
+        std::vector<Slot> Slots;
+        std::vector<std::thread> Workers;
+
+        std::mutex Lock;
+        std::condition_variable Requested;
+        std::condition_variable Done;
+        // Pairs of slot index and chunk.
+        std::deque<std::pair<size_t, uint64_t>> Queue;
+        bool Stopping = false;
+    };
+
+} // namespace libmd
+
+#endif
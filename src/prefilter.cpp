@@ -0,0 +1,142 @@
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <cmath>
+
+#include "prefilter.h"
+
+namespace libmd
+{
+    namespace
+    {
+        // The box in quantized units. A dimension whose Period is 0
+        // is not periodic, either because there is no box, or because
+        // the sphere covers all of it anyway.
+        struct IntBox
+        {
+            std::array<int64_t, 3> Period;
+            std::array<int64_t, 3> Half;
+        };
+
+        // Whether d (per dimension) is within r under PBC. Every
+        // period added or subtracted may be off by half a unit from
+        // the real box, so the allowance grows with it.
+        inline bool within1d(int64_t d, int64_t r, int64_t period, int64_t half)
+        {
+            if(period == 0)
+            {
+                return true;
+            }
+            int64_t Slack = 0;
+            while(d > half)
+            {
+                d -= period;
+                Slack++;
+            }
+            while(d < -half)
+            {
+                d += period;
+                Slack++;
+            }
+            return std::abs(d) <= r + Slack;
+        }
+    } // namespace
+
+    void AtomPrefilter :: addSphere(uint32_t center, float radius)
+    {
+        Spheres.push_back({center, radius});
+        IntSpheres.resize(Spheres.size());
+        addAtom(center);
+    }
+
+    void AtomPrefilter :: addAtom(uint32_t atom)
+    {
+        auto Pos = std::lower_bound(std::begin(Keep), std::end(Keep), atom);
+        if(Pos == std::end(Keep) || *Pos != atom)
+        {
+            Keep.insert(Pos, atom);
+        }
+    }
+
+    void AtomPrefilter :: apply(
+        const int32_t* ints, size_t atom_count, float precision,
+        float inv_precision, const BoxDimType& box, const CoordLayout& result,
+        std::vector<uint32_t>& kept) const
+    {
+        kept.clear();
+
+        // Centers that are not in the frame cannot be filtered
+        // around, so then everything survives.
+        bool FilterAll = Spheres.empty();
+        IntBox Box;
+        for(size_t i = 0; i < Spheres.size(); i++)
+        {
+            const Sphere& S = Spheres[i];
+            if(S.Center >= atom_count)
+            {
+                FilterAll = true;
+                break;
+            }
+            for(size_t Dim = 0; Dim < 3; Dim++)
+            {
+                IntSpheres[i].Center[Dim] = ints[S.Center * 3 + Dim];
+            }
+            // One unit for rounding the coordinates to integers, and
+            // one for the floats the exact test works with.
+            IntSpheres[i].Radius = static_cast<int64_t>(
+                std::ceil(S.Radius * precision)) + 2;
+        }
+        for(size_t Dim = 0; Dim < 3; Dim++)
+        {
+            const int64_t Period = std::llround(box[Dim][Dim] * precision);
+            bool Covered = Period <= 0;
+            for(size_t i = 0; i < Spheres.size() && !FilterAll; i++)
+            {
+                Covered = Covered || 2 * IntSpheres[i].Radius + 2 >= Period;
+            }
+            Box.Period[Dim] = Covered ? 0 : Period;
+            Box.Half[Dim] = Period / 2;
+        }
+
+        auto NextKeep = std::begin(Keep);
+        for(size_t Atom = 0; Atom < atom_count; Atom++)
+        {
+            const int32_t* Coord = ints + Atom * 3;
+            bool Survives = FilterAll;
+            if(NextKeep != std::end(Keep) && *NextKeep == Atom)
+            {
+                Survives = true;
+                ++NextKeep;
+            }
+            for(size_t i = 0; i < Spheres.size() && !Survives; i++)
+            {
+                const IntSphere& S = IntSpheres[i];
+                Survives =
+                    within1d(Coord[0] - S.Center[0], S.Radius, Box.Period[0], Box.Half[0]) &&
+                    within1d(Coord[1] - S.Center[1], S.Radius, Box.Period[1], Box.Half[1]) &&
+                    within1d(Coord[2] - S.Center[2], S.Radius, Box.Period[2], Box.Half[2]);
+            }
+            if(Survives)
+            {
+                result.set(Atom, Coord[0] * inv_precision, Coord[1] * inv_precision,
+                           Coord[2] * inv_precision);
+                kept.push_back(Atom);
+            }
+        }
+    }
+
+} // namespace libmd
@@ -0,0 +1,83 @@
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef SDF_PREFILTER_H
+#define SDF_PREFILTER_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "coords.h"
+
+namespace libmd
+{
+    // A cheap first pass of a distance cutoff, done on the quantized
+    // integer coordinates of an XTC frame before they are turned into
+    // floats. An atom survives if it is within the bounding box of a
+    // cutoff sphere around any of the centers, under periodic boundary
+    // conditions, or if it is always kept.
+    //
+    // This is conservative: it lets through every atom the exact
+    // float test would, and some more. So the exact test still has to
+    // be done on the survivors.
+    class AtomPrefilter
+    {
+    public:
+        using BoxDimType = std::array<std::array<float, 3>, 3>;
+
+        // Keep atoms within “radius” of atom “center” in each
+        // dimension.
+        void addSphere(uint32_t center, float radius);
+        // Always keep atom “atom”.
+        void addAtom(uint32_t atom);
+        bool empty() const { return Spheres.empty() && Keep.empty(); }
+
+        // Go through the quantized coordinates “ints” of the first
+        // atom_count atoms of a frame. Write the float coordinates of
+        // the survivors to their places in result, and their indices,
+        // in ascending order, to kept. Other atoms in result are not
+        // touched.
+        void apply(const int32_t* ints, size_t atom_count, float precision,
+                   float inv_precision, const BoxDimType& box,
+                   const CoordLayout& result, std::vector<uint32_t>& kept) const;
+
+    private:
+        struct Sphere
+        {
+            uint32_t Center;
+            float Radius;
+        };
+        // A cutoff sphere in quantized units.
+        struct IntSphere
+        {
+            std::array<int64_t, 3> Center;
+            int64_t Radius;
+        };
+
+        std::vector<Sphere> Spheres;
+        // Spheres of the frame apply() is working on. Sized with
+        // Spheres, so that apply() does not allocate. So one
+        // AtomPrefilter cannot be applied by two threads at once.
+        mutable std::vector<IntSphere> IntSpheres;
+        // Sorted.
+        std::vector<uint32_t> Keep;
+    };
+
+} // namespace libmd
+
+#endif
@@ -70,6 +70,55 @@ namespace libmd
 
 namespace sdf
 {
+    CompiledBasis :: CompiledBasis(const Parameters& params, const Trajectory& t)
+            : Params(params)
+    {
+        auto Index = [&](const AtomIdentifier& atom)
+        {
+            const size_t Found = t.topology().find(atom);
+            if(Found == t.topology().size())
+            {
+                throw std::runtime_error(std::string("Unknown atom: ") + atom.toStr());
+            }
+            return Found;
+        };
+        AtomX = Index(params.AtomX);
+        AtomXY = Index(params.AtomXY);
+        Anchor = Index(params.Anchor);
+        switch(params.Center.type())
+        {
+        case HCenter::X:
+            Center = AtomX;
+            break;
+        case HCenter::XY:
+            Center = AtomXY;
+            break;
+        case HCenter::ANCHOR:
+            Center = Anchor;
+            break;
+        default:
+            throw std::runtime_error("Invalid center");
+        }
+
+        const auto& Topo = t.topology();
+        Excluded = AtomSet(Topo.size());
+        for(size_t i = 0; i < Topo.size(); i++)
+        {
+            const auto& Atom = Topo.atom(i);
+            if(Atom.Res == params.Anchor.Res ||
+               Atom.NameId == params.Anchor.NameId ||
+               Atom.NameId == params.AtomX.NameId ||
+               Atom.NameId == params.AtomXY.NameId)
+            {
+                Excluded.insert(i);
+            }
+        }
+        for(const auto& Selection: params.OtherAtoms)
+        {
+            Excluded |= AtomSelection::parse(Selection).resolve(Topo);
+        }
+    }
+
     const typename DistCountTraits::ValueType DistCountTraits::Zero = 0;
     const typename DistChargeTraits::ValueType DistChargeTraits::Zero = 0;
     const typename DistDetailedCountTraits::ValueType DistDetailedCountTraits::Zero = {};
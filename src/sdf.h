@@ -21,62 +21,25 @@
 #include <type_traits>
 #include <unordered_set>
 #include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
 #include <thread>
 #include <mutex>
 #include <iomanip>
+#include <limits>
 #include <stdexcept>
 
 #include "utils.h"
 #include "trajectory.h"
 #include "pbc.h"
 #include "config.h"
+#include "envcache.h"
+#include "selection.h"
 
 namespace libmd
 {
-    template<class FrameType>
-    void wrapFrame(const AtomIdentifier& anchor_name, FrameType& frame)
-    {
-        static_assert(std::is_same<FrameType, Trajectory>::value ||
-                      std::is_same<FrameType, TrajectorySnapshot>::value,
-                      "FrameType can only be either Trajectory or "
-                      "TrajectorySnapshot");
-
-        const auto& Anchor = frame.vec(anchor_name);
-        const auto& BoxDim = frame.meta().BoxDim;
-        const RectPbc3d Pbc(BoxDim[0][0], BoxDim[1][1], BoxDim[2][2]);
-
-        for(int32_t i = 0; i < frame.meta().AtomCount; i++)
-        {
-            Pbc.wrapVec(Anchor, frame.vec(i));
-        }
-    }
-
-    template<class VecType, class FrameType>
-    void shiftFrame(const VecType& by, FrameType& frame)
-    {
-        static_assert(std::is_same<FrameType, Trajectory>::value ||
-                      std::is_same<FrameType, TrajectorySnapshot>::value,
-                      "FrameType can only be either Trajectory or "
-                      "TrajectorySnapshot");
-        for(int32_t i = 0; i < frame.meta().AtomCount; i++)
-        {
-            frame.vec(i) += by;
-        }
-    }
-
-    template<class FrameType>
-    void rotateFrame(const Eigen::Ref<Eigen::Matrix3f>& rot, FrameType& frame)
-    {
-        static_assert(std::is_same<FrameType, Trajectory>::value ||
-                      std::is_same<FrameType, TrajectorySnapshot>::value,
-                      "FrameType can only be either Trajectory or "
-                      "TrajectorySnapshot");
-        for(int32_t i = 0; i < frame.meta().AtomCount; i++)
-        {
-            frame.vec(i) = rot * frame.vec(i);
-        }
-    }
-
     // Return a rotation matrix, which would rotate vec to +x, and
     // in_xy to somewhere in the xy plane; in_xy x vec would point to
     // -z (which means the y component of in_xy > 0).
@@ -138,124 +101,179 @@ namespace sdf
         std::unordered_map<std::string, std::array<float, 2>> Specials;
     };
 
+    // The atoms in the slice of a frame around a basis, in the plane
+    // of the basis, plus the aligned positions of some atoms that are
+    // not in the slice (the basis atoms). Atoms are known by their
+    // indices in the topology of the frame.
+    //
+    // A prepared frame can be filled again by prepareFrame(), which
+    // reuses its buffers.
     class PreparedFrame
     {
     public:
-        PreparedFrame() = delete;
-        PreparedFrame(const libmd::TrajectorySnapshot& frame)
-                : Frame(frame) {}
-        void addExtra(const libmd::AtomIdentifier& id,
-                      const libmd::VecRefType& vec)
+        // The same as what goes into an EnvCache.
+        using Atom = EnvCache::Atom;
+
+        PreparedFrame() = default;
+        void addAtom(size_t atom, float x, float y)
         {
-            ExtraAtoms[id] = vec;
+            Atoms.push_back({static_cast<uint32_t>(atom), x, y});
         }
-
-        const std::unordered_map<libmd::AtomIdentifier, Eigen::Vector3f>
-        extraAtoms() const
+        void addExtra(size_t atom, const libmd::VecRefType& vec)
+        {
+            ExtraAtoms.emplace_back(atom, vec);
+        }
+        void clear()
         {
-            return ExtraAtoms;
+            Atoms.clear();
+            ExtraAtoms.clear();
         }
 
-        const libmd::TrajectorySnapshot& snapshot() const
+        // The position given to addExtra() for atom “atom” (an index
+        // in the topology). Throws std::out_of_range if there is
+        // none.
+        Eigen::Vector3f extraAtom(size_t atom) const
         {
-            return Frame;
+            for(const auto& Extra: ExtraAtoms)
+            {
+                if(Extra.first == atom)
+                {
+                    return Extra.second;
+                }
+            }
+            throw std::out_of_range("No extra atom " + std::to_string(atom));
         }
 
+        const std::vector<Atom>& atoms() const { return Atoms; }
+
     private:
-    std::unordered_map<libmd::AtomIdentifier, Eigen::Vector3f> ExtraAtoms;
-    const libmd::TrajectorySnapshot Frame;
+        std::vector<Atom> Atoms;
+        // There are only a few of these.
+        std::vector<std::pair<size_t, Eigen::Vector3f>> ExtraAtoms;
+    };
+
+    // A basis with everything about its atoms that does not change
+    // between frames worked out once, against the topology of a
+    // trajectory. This way prepareFrame() only deals with indices.
+    struct CompiledBasis
+    {
+        // Throws std::runtime_error if an atom of the basis is not in
+        // the topology of “t”, or one of params.OtherAtoms is not a
+        // valid AtomSelection.
+        CompiledBasis(const Parameters& params, const libmd::Trajectory& t);
+
+        Parameters Params;
+        // Indices in the topology.
+        size_t Anchor;
+        size_t AtomX;
+        size_t AtomXY;
+        // One of the above, depending on Params.Center.
+        size_t Center;
+        // Atoms left out of the distribution: the other atoms of the
+        // anchor’s residue, the atoms that share name with the anchor,
+        // x atom, or xy atom, and Params.OtherAtoms.
+        libmd::AtomSet Excluded;
+    };
+
+    // What a thread of run() keeps from frame to frame: its own copy
+    // of the frame, when it does not own the reader, and the frames
+    // prepareFrame() makes. These keep their buffers, so once they
+    // have grown to fit the frames, working on a frame does not
+    // allocate.
+    struct FrameWorkspace
+    {
+        libmd::TrajectorySnapshot Frame;
+        // One for each basis.
+        std::vector<PreparedFrame> Prepared;
     };
 
+    // The position in “frame” of the basis atom with topology index
+    // “atom”. Throws std::out_of_range if the frame does not have it,
+    // e.g. with the wrong topology, or a frame filtered without it.
+    template <class FrameType>
+    size_t basisAtomPosition(const FrameType& frame, size_t atom)
+    {
+        const size_t i = frame.find(atom);
+        if(i >= frame.size())
+        {
+            throw std::out_of_range("Basis atom not in frame: " +
+                                    frame.topology().atom(atom).toStr());
+        }
+        return i;
+    }
+
+    // Put the atoms of “frame” in the slice of “basis” into “result”,
+    // in the coordinates of the basis.
+    //
+    // This is one pass over the atoms. The basis atoms are aligned
+    // first, and then each atom is tested against the cutoff, wrapped
+    // next to the x atom, moved and rotated into the basis, and tested
+    // against the slice, without being written anywhere until it is
+    // known to be in the slice.
     template <class FrameType>
-    PreparedFrame prepareFrame(
-        const Parameters& params, const FrameType& frame)
+    void prepareFrame(const CompiledBasis& basis, const FrameType& frame,
+                      PreparedFrame& result)
     {
         static_assert(std::is_same<FrameType, libmd::Trajectory>::value ||
                       std::is_same<FrameType, libmd::TrajectorySnapshot>::value,
                       "FrameType can only be either Trajectory or "
                       "TrajectorySnapshot");
 
-        const auto& AtomX = frame.vec(params.AtomX);
-        const auto& AtomXY = frame.vec(params.AtomXY);
-        const auto& Anchor = frame.vec(params.Anchor);
+        const Eigen::Vector3f Center = frame.vec(basisAtomPosition(frame, basis.Center));
 
         const auto& BoxDim = frame.meta().BoxDim;
         const libmd::RectPbc3d Pbc(BoxDim[0][0], BoxDim[1][1], BoxDim[2][2]);
 
-        // Filter by distance
-        auto Frame = filterFrame(
-            frame,
-            [&](const libmd::AtomIdentifier& name, size_t _, const auto& vec)
+        // Everything is wrapped next to the x atom, and moved so that
+        // the anchor is at the origin.
+        const Eigen::Vector3f WrapBase = frame.vec(basisAtomPosition(frame, basis.AtomX));
+        Eigen::Vector3f Anchor = frame.vec(basisAtomPosition(frame, basis.Anchor));
+        Eigen::Vector3f AtomX = WrapBase;
+        Eigen::Vector3f AtomXY = frame.vec(basisAtomPosition(frame, basis.AtomXY));
+        Pbc.wrapVec(WrapBase, Anchor);
+        Pbc.wrapVec(WrapBase, AtomX);
+        Pbc.wrapVec(WrapBase, AtomXY);
+        const Eigen::Vector3f ShiftBy = -Anchor;
+        Anchor += ShiftBy;
+        AtomX += ShiftBy;
+        AtomXY += ShiftBy;
+        const Eigen::Matrix3f Rot = libmd::rotateToAlignX(AtomX, AtomXY);
+
+        result.clear();
+        result.addExtra(basis.Anchor, Rot * Anchor);
+        result.addExtra(basis.AtomX, Rot * AtomX);
+        result.addExtra(basis.AtomXY, Rot * AtomXY);
+
+        // The basis atoms are always excluded, so they are not in the
+        // slice.
+        const float HalfThickness = basis.Params.SliceThickness * 0.5;
+        frame.forEachAtom([&](size_t i)
+        {
+            const size_t Atom = frame.atomIndex(i);
+            if(basis.Excluded.contains(Atom))
             {
-                UNUSED(_);
-                if(name == params.Anchor || name == params.AtomX ||
-                   name == params.AtomXY)
-                {
-                    return true;
-                }
-
-                if(name.Res == params.Anchor.Res)
-                {
-                    return false;
-                }
-
-                // if(params.OtherAtoms.find(name) == std::end(params.OtherAtoms))
-                // {
-                //     return false;
-                // }
-
-                switch(params.Center.type())
-                {
-                case HCenter::X:
-                    return Pbc.dist(AtomX, vec) < params.Distance;
-                case HCenter::XY:
-                    return Pbc.dist(AtomXY, vec) < params.Distance;
-                case HCenter::ANCHOR:
-                    return Pbc.dist(Anchor, vec) < params.Distance;
-                default:
-                    throw std::runtime_error("Invalid center");
-                }
-
-            });
-
-        // std::cout << Frame.debugString() << std::endl;
-
-        wrapFrame(params.AtomX, Frame);
-        Eigen::Vector3f ShiftBy = -(Frame.vec(params.Anchor));
-        shiftFrame(ShiftBy, Frame);
-        auto Rot = libmd::rotateToAlignX(Frame.vec(params.AtomX),
-                                  Frame.vec(params.AtomXY));
-        rotateFrame(Rot, Frame);
-        // std::cerr << Frame.debugString() << std::endl;
-
-        // Ditch the anchors, x atoms, and xy atoms, and take a slice
-        // at the XY plane.
-        float HalfThickness = params.SliceThickness * 0.5;
-        auto Snap = filterFrame(
-            Frame,
-            [&](const libmd::AtomIdentifier& id, auto _1, const auto& pos)
-            {
-                UNUSED(_1);
-                return !(id.Name == params.Anchor.Name ||
-                         id.Name == params.AtomX.Name ||
-                         id.Name == params.AtomXY.Name) &&
-                    std::fabs(pos[2]) <= HalfThickness;
-            });
-        PreparedFrame Result(std::move(Snap));
-        Result.addExtra(params.Anchor, Frame.vec(params.Anchor));
-        Result.addExtra(params.AtomX, Frame.vec(params.AtomX));
-        Result.addExtra(params.AtomXY, Frame.vec(params.AtomXY));
-        // for(size_t ih = 1; ih <= 14; ih++)
-        // {
-        //     std::stringstream Formatter;
-        //     Formatter << "1+H" << ih;
-        //     const auto Name = Formatter.str();
-        //     if(Frame.hasAtom(Name))
-        //     {
-        //         Result.addExtra(Name, Frame.vec(Name));
-        //     }
-        // }
+                return;
+            }
+            Eigen::Vector3f Pos = frame.vec(i);
+            if(!(Pbc.dist(Center, Pos) < basis.Params.Distance))
+            {
+                return;
+            }
+            Pbc.wrapVec(WrapBase, Pos);
+            Pos += ShiftBy;
+            const Eigen::Vector3f Aligned = Rot * Pos;
+            if(std::fabs(Aligned[2]) <= HalfThickness)
+            {
+                result.addAtom(Atom, Aligned[0], Aligned[1]);
+            }
+        });
+    }
 
+    template <class FrameType>
+    PreparedFrame prepareFrame(const CompiledBasis& basis, const FrameType& frame)
+    {
+        PreparedFrame Result;
+        prepareFrame(basis, frame, Result);
         return Result;
     }
 
@@ -283,7 +301,7 @@ namespace sdf
     inline typename DistChargeTraits::ValueType Distribution2<DistChargeTraits> ::
     deltaFromAtom(const libmd::AtomIdentifier& atom, const RuntimeConfig& config)
     {
-        return config.AtomProperties.at(atom.Name).Charge;
+        return config.AtomProperties.at(atom.name()).Charge;
     }
 
     template <>
@@ -292,15 +310,98 @@ namespace sdf
     {
         UNUSED(_);
         typename DistDetailedCountTraits::ValueType Delta;
-        Delta[atom.Name] = 1;
+        Delta[atom.name()] = 1;
         return Delta;
     }
 
+    // With config.Follow, “on_update” is called with the
+    // distribution so far every config.FollowInterval seconds, while
+    // no frame is being worked on.
     template <class DistTraits>
-    inline Distribution2<DistTraits> run(const RuntimeConfig& config)
+    inline Distribution2<DistTraits> run(
+        const RuntimeConfig& config,
+        const std::function<void(const Distribution2<DistTraits>&)>& on_update = nullptr)
     {
+        // Polling interval and timeout when following.
+        const auto Poll = std::chrono::duration<double>(
+            std::min(1.0, std::max(config.FollowInterval, 0.01)));
+        const auto Timeout = std::chrono::duration<double>(config.FollowTimeout);
+        auto LastFrameTime = std::chrono::steady_clock::now();
+        auto TimedOut = [&]()
+        {
+            return config.FollowTimeout > 0.0 &&
+                std::chrono::steady_clock::now() - LastFrameTime >= Timeout;
+        };
+
+        if(config.Follow)
+        {
+            if(config.XtcFiles.size() != 1)
+            {
+                throw std::runtime_error("Only a single trajectory file can be followed");
+            }
+            if(!config.EnvCacheFile.empty())
+            {
+                throw std::runtime_error(
+                    "The environments of a followed trajectory cannot be cached");
+            }
+            // Opening the trajectory needs its first frame.
+            if(!libmd::FrameCache::isCache(config.XtcFiles[0]))
+            {
+                libmd::XtcFile Probe;
+                Probe.open(config.XtcFiles[0].c_str(), config.XtcIoMode, config.Prefetch);
+                if(!Probe.seekable())
+                {
+                    throw std::runtime_error(
+                        "Compressed or piped trajectories cannot be followed");
+                }
+                while(!Probe.frameComplete())
+                {
+                    if(TimedOut())
+                    {
+                        throw std::runtime_error("No frame in " + config.XtcFiles[0]);
+                    }
+                    std::this_thread::sleep_for(Poll);
+                    Probe.refresh();
+                }
+            }
+        }
+
         libmd::Trajectory t;
-        t.open(config.XtcFile, config.GroFile);
+        t.open(config.XtcFiles.at(0), config.GroFile, config.XtcIoMode, config.Prefetch);
+
+        // This also makes sure the atoms specified in the input
+        // exist.
+        std::vector<CompiledBasis> Bases;
+        for(const auto& param: config.Params)
+        {
+            Bases.emplace_back(param, t);
+        }
+
+        if(config.MaxAtoms > 0)
+        {
+            size_t Limit = config.MaxAtoms;
+            for(const auto& Basis: Bases)
+            {
+                Limit = std::max({Limit, Basis.Anchor + 1, Basis.AtomX + 1,
+                                  Basis.AtomXY + 1});
+            }
+            t.limitAtoms(Limit);
+        }
+
+        if(config.Prefilter)
+        {
+            // Everything prepareFrame() keeps is within Distance of
+            // the center, or one of the basis atoms.
+            libmd::AtomPrefilter Filter;
+            for(const auto& Basis: Bases)
+            {
+                Filter.addAtom(Basis.Anchor);
+                Filter.addAtom(Basis.AtomX);
+                Filter.addAtom(Basis.AtomXY);
+                Filter.addSphere(Basis.Center, Basis.Params.Distance);
+            }
+            t.prefilter(Filter);
+        }
 
         Distribution2<DistTraits> Result;
         if(config.AbsoluteHistRange)
@@ -322,99 +423,444 @@ namespace sdf
 
         t.nextFrame();
         {
-            auto FirstFrame = prepareFrame(config.Params[0], t);
+            auto FirstFrame = prepareFrame(Bases[0], t);
             auto AnchorName = config.Params[0].Anchor.toStr();
-            auto Anchor = FirstFrame.extraAtoms().at(config.Params[0].Anchor);
+            auto Anchor = FirstFrame.extraAtom(Bases[0].Anchor);
             auto AtomXName = config.Params[0].AtomX.toStr();
-            auto AtomX = FirstFrame.extraAtoms().at(config.Params[0].AtomX);
+            auto AtomX = FirstFrame.extraAtom(Bases[0].AtomX);
             auto AtomXYName = config.Params[0].AtomXY.toStr();
-            auto AtomXY = FirstFrame.extraAtoms().at(config.Params[0].AtomXY);
+            auto AtomXY = FirstFrame.extraAtom(Bases[0].AtomXY);
 
             Result.addSpecial(AnchorName, {Anchor[0], Anchor[1]});
             Result.addSpecial(AtomXName, {AtomX[0], AtomX[1]});
             Result.addSpecial(AtomXYName, {AtomXY[0], AtomXY[1]});
         }
 
-        // Make sure the atoms specified in the input exist.
-        for(const auto& param: config.Params)
+        // With an environment cache made by a run like this one, the
+        // trajectory is not read past the first frame.
+        EnvCache Envs;
+        std::string EnvKey;
+        const bool Recording = !config.EnvCacheFile.empty();
+        if(Recording)
         {
-            if(!t.hasAtom(param.AtomX))
+            EnvKey = EnvCache::key(config);
+            if(Envs.load(config.EnvCacheFile, EnvKey))
             {
-                throw std::runtime_error(std::string("Unknown atom: ") +
-                                         param.AtomX.toStr());
-            }
-            if(!t.hasAtom(param.AtomXY))
-            {
-                throw std::runtime_error(std::string("Unknown atom: ") +
-                                         param.AtomXY.toStr());
-            }
-            if(!t.hasAtom(param.Anchor))
-            {
-                throw std::runtime_error(std::string("Unknown atom: ") +
-                                         param.Anchor.toStr());
+                for(size_t Frame = 0; Frame < Envs.frameCount(); Frame++)
+                {
+                    for(size_t Param = 0; Param < Envs.paramCount(); Param++)
+                    {
+                        for(auto Atom = Envs.begin(Frame, Param);
+                            Atom != Envs.end(Frame, Param); Atom++)
+                        {
+                            try
+                            {
+                                Result.delta(Atom->X, Atom->Y,
+                                             Distribution2<DistTraits>::
+                                             deltaFromAtom(t.atomId(Atom->Index), config));
+                            }
+                            catch(const std::out_of_range&)
+                            {
+                            }
+                        }
+                    }
+                }
+                if(config.Progress)
+                {
+                    std::cerr << "Replayed " << Envs.frameCount() << " frames from "
+                              << config.EnvCacheFile << std::endl;
+                }
+                t.close();
+                Result.FrameCount = Envs.frameCount();
+                return Result;
             }
+            Envs.reset(config.Params.size());
         }
 
-        t.close();
-        t.clear();
-        t.open(config.XtcFile, config.GroFile);
-
+        libmd::FrameSelection Selection = config.Frames;
+        const size_t ThreadCount = std::max<size_t>(config.ThreadCount, 1);
         std::mutex HistLock;
-        std::mutex FrameLock;
+        std::atomic<size_t> FrameCount(0);
+        std::atomic<uint64_t> BytesRead(0);
         std::vector<std::thread> Threads;
+        // The first exception thrown by a thread, e.g. at a truncated
+        // frame. The other threads stop at their next frame, and it
+        // is rethrown once they have all finished.
+        std::exception_ptr Error;
+        std::mutex ErrorLock;
+        std::atomic<bool> Failed(false);
+        auto Fail = [&]()
+        {
+            std::lock_guard<std::mutex> Guard(ErrorLock);
+            if(!Error)
+            {
+                Error = std::current_exception();
+            }
+            Failed = true;
+        };
+        const auto StartTime = std::chrono::steady_clock::now();
 
-        for(size_t i = 0; i < config.ThreadCount; i++)
+        auto Accumulate = [&](const auto& frame, FrameWorkspace& work)
         {
-            Threads.emplace_back(std::thread([&]()
+            std::vector<std::vector<EnvCache::Atom>> Environments;
+            work.Prepared.resize(Bases.size());
+            const auto& Topo = frame.topology();
+            for(size_t i = 0; i < Bases.size(); i++)
             {
-                while(true)
+                auto& Frame = work.Prepared[i];
+                prepareFrame(Bases[i], frame, Frame);
+                if(Recording)
                 {
-                    FrameLock.lock();
-                    if(!t.nextFrame())
+                    Environments.push_back(Frame.atoms());
+                }
+                HistLock.lock();
+                for(const auto& Atom: Frame.atoms())
+                {
+                    try
+                    {
+                        Result.delta(Atom.X, Atom.Y,
+                                     Distribution2<DistTraits>::
+                                     deltaFromAtom(Topo.atom(Atom.Index), config));
+                    }
+                    catch(const std::out_of_range&)
                     {
-                        FrameLock.unlock();
-                        break;
                     }
-                    const auto Frame = t.snapshot();
-                    FrameLock.unlock();
+                }
+                HistLock.unlock();
+            }
+            if(Recording)
+            {
+                std::lock_guard<std::mutex> Guard(HistLock);
+                Envs.addFrame(Environments);
+            }
+            if(config.Progress)
+            {
+                std::cerr << "." << std::flush;
+            }
+        };
 
-                    for(const auto& Params: config.Params)
+        if((config.XtcFiles.size() == 1 && !t.seekable()) || config.Follow)
+        {
+            // Compressed or piped input can only be read front to back,
+            // by one reader, and so can a trajectory that is still
+            // being written. The threads take turns reading a frame
+            // from it, and work on a snapshot of the frame while the
+            // others read.
+            std::mutex FrameLock;
+            // t already holds the first frame.
+            bool Pending = true;
+            bool Done = false;
+            bool HaveOrigin = !Selection.needsOrigin();
+            size_t FrameNumber = 0;
+            // Threads working on a snapshot. With FrameLock held and
+            // none of these, Result and FrameCount agree.
+            std::atomic<size_t> Busy(0);
+            auto LastUpdate = std::chrono::steady_clock::now();
+            size_t UpdatedFrames = 0;
+            // Call on_update() if it is time, and there is something
+            // new. FrameLock must be held.
+            auto Update = [&]()
+            {
+                if(!on_update || std::chrono::steady_clock::now() - LastUpdate <
+                   std::chrono::duration<double>(config.FollowInterval))
+                {
+                    return;
+                }
+                while(Busy > 0 && !Failed)
+                {
+                    std::this_thread::yield();
+                }
+                LastUpdate = std::chrono::steady_clock::now();
+                if(FrameCount == UpdatedFrames)
+                {
+                    return;
+                }
+                UpdatedFrames = FrameCount;
+                Result.FrameCount = FrameCount;
+                on_update(Result);
+            };
+
+            // What each thread does. An exception ends the thread
+            // through Fail().
+            auto TakeTurns = [&]()
+            {
+                FrameWorkspace Work;
+                while(true)
+                {
+                    bool Taken = false;
                     {
-                        auto Frame = prepareFrame(Params, t);
-                        HistLock.lock();
-                        const auto Shot = Frame.snapshot();
-                        for(size_t AtomIdx = 0; AtomIdx < Shot.size(); AtomIdx++)
+                        std::lock_guard<std::mutex> Guard(FrameLock);
+                        while(!Done && !Taken)
                         {
-                            const auto& Vec = Shot.vec(AtomIdx);
-                            const auto& Atom = Shot.atomId(AtomIdx);
-                            try
+                            if(Failed)
                             {
-                                Result.delta(Vec[0], Vec[1],
-                                             Distribution2<DistTraits>::
-                                             deltaFromAtom(Atom, config));
+                                Done = true;
+                                break;
+                            }
+                            if(config.Follow)
+                            {
+                                Update();
+                                // Wait for the next frame to be
+                                // written.
+                                if(!Pending && !t.frameComplete())
+                                {
+                                    if(TimedOut())
+                                    {
+                                        Done = true;
+                                        break;
+                                    }
+                                    std::this_thread::sleep_for(Poll);
+                                    t.refresh();
+                                    continue;
+                                }
+                                LastFrameTime = std::chrono::steady_clock::now();
                             }
-                            catch(std::out_of_range)
+                            const bool Decoded = Pending;
+                            Pending = false;
+                            if(!Decoded && t.eof())
                             {
+                                Done = true;
+                                break;
                             }
+                            const float Time = Decoded ? t.meta().Time :
+                                t.peekMeta().Time;
+                            if(Time > Selection.endTime())
+                            {
+                                Done = true;
+                                break;
+                            }
+                            // Without an index, the first selected
+                            // frame is only known once it is seen.
+                            if(!HaveOrigin && Time >= Selection.beginTime())
+                            {
+                                Selection.origin(FrameNumber, Time);
+                                HaveOrigin = true;
+                            }
+                            if(!HaveOrigin || !Selection.selects(FrameNumber++, Time))
+                            {
+                                if(!Decoded)
+                                {
+                                    t.skipFrame();
+                                }
+                                continue;
+                            }
+                            if(!Decoded)
+                            {
+                                t.nextFrame();
+                            }
+                            t.snapshot(Work.Frame);
+                            Taken = true;
+                            Busy++;
                         }
-                        HistLock.unlock();
                     }
-                    if(config.Progress)
+                    if(!Taken)
                     {
-                        std::cerr << "." << std::flush;
+                        return;
                     }
+                    Accumulate(Work.Frame, Work);
+                    FrameCount++;
+                    Busy--;
                 }
-            }));
+            };
+            for(size_t i = 0; i < ThreadCount; i++)
+            {
+                Threads.emplace_back(std::thread([&]()
+                {
+                    try
+                    {
+                        TakeTurns();
+                    }
+                    catch(...)
+                    {
+                        Fail();
+                    }
+                }));
+            }
+            // The threads use the locals of this block.
+            for(auto& Thread: Threads)
+            {
+                Thread.join();
+            }
+            if(Error)
+            {
+                std::rethrow_exception(Error);
+            }
+            BytesRead = t.tell();
         }
-
-        for(auto& Thread: Threads)
+        else
         {
-            Thread.join();
+            // Each trajectory file is split into byte ranges, so that
+            // there are at least as many ranges as threads, and each
+            // thread decodes the ranges it takes with its own reader.
+            // This way decoding is as parallel as the rest. A frame
+            // belongs to the range in which it begins, and a reader
+            // finds the first frame of its range by looking for a
+            // frame header. With more files than threads, each file is
+            // one range.
+            //
+            // Frames that are not selected are skipped by their
+            // headers, without decoding. Frame selection applies to
+            // each file on its own.
+            const size_t FileCount = config.XtcFiles.size();
+            const size_t Pieces = std::max<size_t>(1, ThreadCount / FileCount);
+
+            // Set the origin of “selection” from the index of the file
+            // of “reader”. Return false if nothing is selected from it.
+            auto FindOrigin = [](libmd::Trajectory& reader,
+                                 libmd::FrameSelection& selection)
+            {
+                const auto& Index = reader.frameIndex();
+                const size_t First = Index.findTime(selection.beginTime());
+                if(First >= Index.size())
+                {
+                    return false;
+                }
+                selection.origin(First, Index[First].Time);
+                return true;
+            };
+
+            // When several ranges of a file need its index, build it
+            // here once, instead of in all of them at the same time.
+            std::vector<libmd::FrameSelection> FileSelections(FileCount, Selection);
+            std::vector<char> FileSelected(FileCount, true);
+            std::vector<char> FileHasOrigin(FileCount, false);
+            if(Selection.needsOrigin() && Pieces > 1)
+            {
+                for(size_t File = 0; File < FileCount; File++)
+                {
+                    libmd::Trajectory Reader;
+                    Reader.open(config.XtcFiles[File], t, config.XtcIoMode);
+                    if(Reader.seekable())
+                    {
+                        FileSelected[File] = FindOrigin(Reader, FileSelections[File]);
+                        FileHasOrigin[File] = true;
+                    }
+                }
+            }
+
+            std::atomic<size_t> NextRange(0);
+            // What each thread does, as with TakeTurns.
+            auto ReadRanges = [&]()
+            {
+                FrameWorkspace Work;
+                for(size_t Range = NextRange++; Range < FileCount * Pieces && !Failed;
+                    Range = NextRange++)
+                {
+                    const size_t File = Range / Pieces;
+                    const size_t Piece = Range % Pieces;
+                    if(!FileSelected[File])
+                    {
+                        continue;
+                    }
+                    libmd::Trajectory Reader;
+                    Reader.open(config.XtcFiles[File], t, config.XtcIoMode);
+                    libmd::FrameSelection Selection = FileSelections[File];
+                    bool HaveOrigin = !Selection.needsOrigin() || FileHasOrigin[File];
+
+                    uint64_t RangeEnd = std::numeric_limits<uint64_t>::max();
+                    if(Reader.seekable())
+                    {
+                        const uint64_t FileSize = Reader.fileSize();
+                        const uint64_t RangeBegin = FileSize / Pieces * Piece;
+                        RangeEnd = (Piece + 1 == Pieces) ? FileSize :
+                            FileSize / Pieces * (Piece + 1);
+                        if(!Reader.syncToFrame(RangeBegin))
+                        {
+                            continue;
+                        }
+                        if(!HaveOrigin)
+                        {
+                            if(!FindOrigin(Reader, Selection))
+                            {
+                                continue;
+                            }
+                            HaveOrigin = true;
+                        }
+                    }
+                    else if(Piece > 0)
+                    {
+                        // Compressed or piped input is read whole
+                        // by the first range.
+                        continue;
+                    }
+                    const uint64_t ReadBegin = Reader.tell();
+
+                    size_t FrameNumber = Selection.needsOrigin() && Reader.seekable() ?
+                        Reader.frameIndex().findOffset(Reader.tell()) : 0;
+                    while(Reader.tell() < RangeEnd && !Reader.eof() && !Failed)
+                    {
+                        if(!Selection.all())
+                        {
+                            const auto Meta = Reader.peekMeta();
+                            // Time only goes forward.
+                            if(Meta.Time > Selection.endTime())
+                            {
+                                break;
+                            }
+                            // Without an index, the first selected
+                            // frame is only known once it is seen.
+                            if(!HaveOrigin && Meta.Time >= Selection.beginTime())
+                            {
+                                Selection.origin(FrameNumber, Meta.Time);
+                                HaveOrigin = true;
+                            }
+                            if(!HaveOrigin ||
+                               !Selection.selects(FrameNumber++, Meta.Time))
+                            {
+                                Reader.skipFrame();
+                                continue;
+                            }
+                        }
+                        Reader.nextFrame();
+                        Accumulate(Reader, Work);
+                    }
+                    FrameCount += Reader.countFrames();
+                    BytesRead += Reader.tell() - ReadBegin;
+                    Reader.close();
+                }
+            };
+            for(size_t i = 0; i < ThreadCount; i++)
+            {
+                Threads.emplace_back(std::thread([&]()
+                {
+                    try
+                    {
+                        ReadRanges();
+                    }
+                    catch(...)
+                    {
+                        Fail();
+                    }
+                }));
+            }
+            for(auto& Thread: Threads)
+            {
+                Thread.join();
+            }
+            if(Error)
+            {
+                std::rethrow_exception(Error);
+            }
         }
 
-        if(config.Progress) { std::cerr << std::endl; }
+
+        if(config.Progress)
+        {
+            const std::chrono::duration<double> Elapsed =
+                std::chrono::steady_clock::now() - StartTime;
+            const double MBytes = BytesRead / 1e6;
+            std::cerr << std::endl << "Read " << std::fixed << std::setprecision(1)
+                      << MBytes << " MB in " << std::setprecision(2)
+                      << Elapsed.count() << " s ("  << std::setprecision(1)
+                      << MBytes / Elapsed.count() << " MB/s)" << std::endl;
+        }
+        if(Recording && !Envs.save(config.EnvCacheFile, EnvKey))
+        {
+            std::cerr << "Warning: failed to write " << config.EnvCacheFile
+                      << std::endl;
+        }
         t.close();
-        Result.FrameCount = t.countFrames();
+        Result.FrameCount = FrameCount;
         return Result;
     }
 
@@ -0,0 +1,227 @@
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+#include "selection.h"
+
+namespace libmd
+{
+    namespace
+    {
+        bool parseInt(const std::string& text, int& value)
+        {
+            if(text.empty())
+            {
+                return false;
+            }
+            size_t End;
+            long Value;
+            try
+            {
+                Value = std::stol(text, &End);
+            }
+            catch(const std::logic_error&)
+            {
+                // Not a number, or too large for a long.
+                return false;
+            }
+            if(End != text.size() || Value < std::numeric_limits<int>::min() ||
+               Value > std::numeric_limits<int>::max())
+            {
+                return false;
+            }
+            value = static_cast<int>(Value);
+            return true;
+        }
+
+        // “a” or “a-b”.
+        bool parseRange(const std::string& text, std::pair<int, int>& range)
+        {
+            const size_t Dash = text.find('-', 1);
+            if(Dash == std::string::npos)
+            {
+                return parseInt(text, range.first) && parseInt(text, range.second);
+            }
+            return parseInt(text.substr(0, Dash), range.first) &&
+                parseInt(text.substr(Dash + 1), range.second) &&
+                range.first <= range.second;
+        }
+    } // namespace
+
+    size_t AtomSet :: count() const
+    {
+        size_t Count = 0;
+        for(uint64_t Word: Bits)
+        {
+            Count += __builtin_popcountll(Word);
+        }
+        return Count;
+    }
+
+    AtomSet& AtomSet :: operator|=(const AtomSet& rhs)
+    {
+        if(rhs.Size > Size)
+        {
+            Bits.resize(rhs.Bits.size(), 0);
+            Size = rhs.Size;
+        }
+        for(size_t i = 0; i < rhs.Bits.size(); i++)
+        {
+            Bits[i] |= rhs.Bits[i];
+        }
+        return *this;
+    }
+
+    AtomSelection AtomSelection :: parse(const std::string& text)
+    {
+        std::vector<std::string> Words;
+        {
+            std::istringstream Splitter(text);
+            std::string Word;
+            while(Splitter >> Word)
+            {
+                Words.push_back(Word);
+            }
+        }
+        auto Invalid = [&]()
+        {
+            return std::runtime_error("Invalid atom selection: " + text);
+        };
+
+        AtomSelection Result;
+        size_t i = 0;
+        while(true)
+        {
+            if(i >= Words.size())
+            {
+                throw Invalid();
+            }
+            const std::string& Keyword = Words[i++];
+            if(Keyword.find('+') != std::string::npos)
+            {
+                const AtomIdentifier Atom(Keyword);
+                Clause Res;
+                Res.Type = Clause::RES_ID;
+                Res.Ranges.emplace_back(Atom.Res, Atom.Res);
+                Clause Name;
+                Name.Type = Clause::NAME;
+                Name.Names.push_back(Atom.NameId);
+                Result.Clauses.push_back(std::move(Res));
+                Result.Clauses.push_back(std::move(Name));
+            }
+            else
+            {
+                Clause Current;
+                if(Keyword == "resname")
+                {
+                    Current.Type = Clause::RES_NAME;
+                }
+                else if(Keyword == "name")
+                {
+                    Current.Type = Clause::NAME;
+                }
+                else if(Keyword == "resid")
+                {
+                    Current.Type = Clause::RES_ID;
+                }
+                else
+                {
+                    throw Invalid();
+                }
+                for(; i < Words.size() && Words[i] != "and"; i++)
+                {
+                    if(Current.Type == Clause::RES_ID)
+                    {
+                        std::pair<int, int> Range;
+                        if(!parseRange(Words[i], Range))
+                        {
+                            throw Invalid();
+                        }
+                        Current.Ranges.push_back(Range);
+                    }
+                    else
+                    {
+                        Current.Names.push_back(NameTable::intern(Words[i]));
+                    }
+                }
+                if(Current.Names.empty() && Current.Ranges.empty())
+                {
+                    throw Invalid();
+                }
+                Result.Clauses.push_back(std::move(Current));
+            }
+
+            if(i == Words.size())
+            {
+                return Result;
+            }
+            if(Words[i++] != "and")
+            {
+                throw Invalid();
+            }
+        }
+    }
+
+    bool AtomSelection :: matches(const AtomIdentifier& atom, uint32_t res_name) const
+    {
+        for(const auto& Current: Clauses)
+        {
+            bool Match = false;
+            switch(Current.Type)
+            {
+            case Clause::RES_NAME:
+                Match = std::find(std::begin(Current.Names), std::end(Current.Names),
+                                  res_name) != std::end(Current.Names);
+                break;
+            case Clause::NAME:
+                Match = std::find(std::begin(Current.Names), std::end(Current.Names),
+                                  atom.NameId) != std::end(Current.Names);
+                break;
+            case Clause::RES_ID:
+                Match = std::any_of(std::begin(Current.Ranges), std::end(Current.Ranges),
+                                    [&](const std::pair<int, int>& range)
+                                    {
+                                        return atom.Res >= range.first &&
+                                            atom.Res <= range.second;
+                                    });
+                break;
+            }
+            if(!Match)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    AtomSet AtomSelection :: resolve(const Topology& topo) const
+    {
+        AtomSet Result(topo.size());
+        for(size_t i = 0; i < topo.size(); i++)
+        {
+            if(matches(topo.atom(i), topo.resName(i)))
+            {
+                Result.insert(i);
+            }
+        }
+        return Result;
+    }
+
+} // namespace libmd
@@ -0,0 +1,96 @@
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef SDF_SELECTION_H
+#define SDF_SELECTION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "topology.h"
+
+namespace libmd
+{
+    // A set of atoms of a topology, by index, one bit per atom.
+    class AtomSet
+    {
+    public:
+        AtomSet() = default;
+        explicit AtomSet(size_t size) : Bits((size + 63) / 64, 0), Size(size) {}
+
+        // The number of atoms there could be in the set.
+        size_t size() const { return Size; }
+        // The number of atoms in the set.
+        size_t count() const;
+
+        void insert(size_t atom)
+        {
+            Bits[atom >> 6] |= uint64_t(1) << (atom & 63);
+        }
+        bool contains(size_t atom) const
+        {
+            return atom < Size && ((Bits[atom >> 6] >> (atom & 63)) & 1) != 0;
+        }
+
+        AtomSet& operator|=(const AtomSet& rhs);
+
+    private:
+        std::vector<uint64_t> Bits;
+        size_t Size = 0;
+    };
+
+    // Atoms picked by what they are, rather than one by one. A
+    // selection is one or more clauses joined by “and”, and an atom is
+    // selected if it matches all of them. The clauses are
+    //
+    //   resname PCBM SOL    residue name is one of these
+    //   name H10 H11        atom name is one of these
+    //   resid 17 20-25      residue number is one of these, or in one
+    //                       of these ranges (inclusive)
+    //   17+H10              the atom of this residue number and name,
+    //                       as in the rest of the input
+    //
+    // so for example “resname SOL and name OW” selects the oxygens of
+    // the water.
+    class AtomSelection
+    {
+    public:
+        // Throws std::runtime_error if “text” is not a selection.
+        static AtomSelection parse(const std::string& text);
+
+        bool matches(const AtomIdentifier& atom, uint32_t res_name) const;
+        // The atoms of “topo” that are selected.
+        AtomSet resolve(const Topology& topo) const;
+
+    private:
+        struct Clause
+        {
+            enum Kind { RES_NAME, NAME, RES_ID } Type;
+            // NameTable ids, for RES_NAME and NAME.
+            std::vector<uint32_t> Names;
+            // Inclusive ranges of residue numbers, for RES_ID.
+            std::vector<std::pair<int, int>> Ranges;
+        };
+
+        std::vector<Clause> Clauses;
+    };
+
+} // namespace libmd
+
+#endif
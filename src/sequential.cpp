@@ -0,0 +1,580 @@
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "sequential.h"
+
+namespace libmd
+{
+    namespace
+    {
+        constexpr size_t BLOCK_SIZE = 1 << 20;
+        // How many blocks the producer may get ahead of the reader.
+        constexpr size_t MAX_BLOCKS = 4;
+
+        enum Format { RAW, GZIP, ZSTD };
+
+        Format detect(const unsigned char* magic, size_t size)
+        {
+            if(size >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+            {
+                return GZIP;
+            }
+            if(size >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+               magic[2] == 0x2f && magic[3] == 0xfd)
+            {
+                return ZSTD;
+            }
+            return RAW;
+        }
+
+        std::runtime_error systemError(const std::string& what)
+        {
+            return std::runtime_error(what + ": " + std::strerror(errno));
+        }
+
+        // Reads a file descriptor, and optionally owns the process
+        // writing to it.
+        class FdSource : public ByteSource
+        {
+        public:
+            FdSource(int fd, bool owned, const std::atomic<bool>& stopping,
+                     pid_t child = -1, const std::string& child_name = "")
+                    : Fd(fd), Owned(owned), Stopping(stopping), Child(child),
+                      ChildName(child_name) {}
+
+            ~FdSource() override
+            {
+                if(Owned)
+                {
+                    ::close(Fd);
+                }
+                if(Child > 0)
+                {
+                    kill(Child, SIGTERM);
+                    waitpid(Child, nullptr, 0);
+                }
+            }
+
+            size_t read(unsigned char* buffer, size_t size) override
+            {
+                if(!Pending.empty())
+                {
+                    const size_t Count = std::min(size, Pending.size());
+                    std::copy(Pending.begin(), Pending.begin() + Count, buffer);
+                    Pending.erase(Pending.begin(), Pending.begin() + Count);
+                    return Count;
+                }
+                while(true)
+                {
+                    // Wake up now and then, so that a reader that is
+                    // closed while waiting on a quiet pipe can stop.
+                    pollfd Poll = { Fd, POLLIN, 0 };
+                    const int Ready = poll(&Poll, 1, 100);
+                    if(Ready < 0 && errno != EINTR)
+                    {
+                        throw systemError("poll");
+                    }
+                    if(Ready <= 0)
+                    {
+                        if(Stopping)
+                        {
+                            return 0;
+                        }
+                        continue;
+                    }
+                    const ssize_t Count = ::read(Fd, buffer, size);
+                    if(Count < 0)
+                    {
+                        if(errno == EINTR || errno == EAGAIN)
+                        {
+                            continue;
+                        }
+                        throw systemError("read");
+                    }
+                    if(Count == 0)
+                    {
+                        checkChild();
+                    }
+                    return Count;
+                }
+            }
+
+            // Read up to size bytes, stopping short only at the end.
+            size_t readFully(unsigned char* buffer, size_t size)
+            {
+                size_t Got = 0;
+                while(Got < size)
+                {
+                    const size_t Count = read(buffer + Got, size - Got);
+                    if(Count == 0)
+                    {
+                        break;
+                    }
+                    Got += Count;
+                }
+                return Got;
+            }
+
+            // The next read() returns these bytes first.
+            void unread(const unsigned char* data, size_t size)
+            {
+                Pending.insert(Pending.begin(), data, data + size);
+            }
+
+        private:
+            void checkChild()
+            {
+                if(Child <= 0)
+                {
+                    return;
+                }
+                int Status;
+                waitpid(Child, &Status, 0);
+                Child = -1;
+                if(!WIFEXITED(Status) || WEXITSTATUS(Status) != 0)
+                {
+                    throw std::runtime_error(ChildName + " failed");
+                }
+            }
+
+            int Fd;
+            bool Owned;
+            const std::atomic<bool>& Stopping;
+            pid_t Child;
+            std::string ChildName;
+            std::vector<unsigned char> Pending;
+        };
+
+#ifdef HAVE_ZLIB
+        class GzipSource : public ByteSource
+        {
+        public:
+            explicit GzipSource(std::unique_ptr<FdSource> in)
+                    : In(std::move(in)), InBuffer(BLOCK_SIZE)
+            {
+                std::memset(&Stream, 0, sizeof(Stream));
+                // 32 means to accept both gzip and zlib headers.
+                if(inflateInit2(&Stream, 15 + 32) != Z_OK)
+                {
+                    throw std::runtime_error("failed to initialize zlib");
+                }
+            }
+
+            ~GzipSource() override { inflateEnd(&Stream); }
+
+            size_t read(unsigned char* buffer, size_t size) override
+            {
+                Stream.next_out = buffer;
+                Stream.avail_out = size;
+                while(Stream.avail_out == size)
+                {
+                    if(Stream.avail_in == 0 && !InputDone)
+                    {
+                        const size_t Count = In->read(InBuffer.data(), InBuffer.size());
+                        InputDone = Count == 0;
+                        Stream.next_in = InBuffer.data();
+                        Stream.avail_in = Count;
+                    }
+                    if(Stream.avail_in == 0 && InputDone)
+                    {
+                        if(!AtMemberEnd)
+                        {
+                            throw std::runtime_error("truncated gzip input");
+                        }
+                        break;
+                    }
+
+                    const int Result = inflate(&Stream, Z_NO_FLUSH);
+                    if(Result == Z_STREAM_END)
+                    {
+                        // There may be more gzip members after this.
+                        AtMemberEnd = true;
+                        inflateReset(&Stream);
+                    }
+                    else if(Result == Z_OK)
+                    {
+                        AtMemberEnd = false;
+                    }
+                    else if(Result != Z_BUF_ERROR)
+                    {
+                        throw std::runtime_error(std::string("gzip: ") +
+                                                 (Stream.msg ? Stream.msg : "error"));
+                    }
+                }
+                return size - Stream.avail_out;
+            }
+
+        private:
+            std::unique_ptr<FdSource> In;
+            std::vector<unsigned char> InBuffer;
+            z_stream Stream;
+            bool InputDone = false;
+            bool AtMemberEnd = false;
+        };
+#endif
+
+#ifdef HAVE_ZSTD
+        class ZstdSource : public ByteSource
+        {
+        public:
+            explicit ZstdSource(std::unique_ptr<FdSource> in)
+                    : In(std::move(in)), InBuffer(ZSTD_DStreamInSize()),
+                      Stream(ZSTD_createDStream())
+            {
+                if(Stream == nullptr)
+                {
+                    throw std::runtime_error("failed to initialize zstd");
+                }
+                ZSTD_initDStream(Stream);
+                Input = { InBuffer.data(), 0, 0 };
+            }
+
+            ~ZstdSource() override { ZSTD_freeDStream(Stream); }
+
+            size_t read(unsigned char* buffer, size_t size) override
+            {
+                ZSTD_outBuffer Output = { buffer, size, 0 };
+                while(Output.pos == 0)
+                {
+                    if(Input.pos == Input.size)
+                    {
+                        const size_t Count = In->read(InBuffer.data(), InBuffer.size());
+                        if(Count == 0)
+                        {
+                            if(!AtFrameEnd)
+                            {
+                                throw std::runtime_error("truncated zstd input");
+                            }
+                            break;
+                        }
+                        Input = { InBuffer.data(), Count, 0 };
+                    }
+                    const size_t Result = ZSTD_decompressStream(Stream, &Output, &Input);
+                    if(ZSTD_isError(Result))
+                    {
+                        throw std::runtime_error(std::string("zstd: ") +
+                                                 ZSTD_getErrorName(Result));
+                    }
+                    AtFrameEnd = Result == 0;
+                }
+                return Output.pos;
+            }
+
+        private:
+            std::unique_ptr<FdSource> In;
+            std::vector<unsigned char> InBuffer;
+            ZSTD_DStream* Stream;
+            ZSTD_inBuffer Input;
+            bool AtFrameEnd = true;
+        };
+#endif
+
+#if !defined(HAVE_ZLIB) || !defined(HAVE_ZSTD)
+        // Decompress path with an external program, for when sdf is
+        // built without the library for it.
+        std::unique_ptr<ByteSource> spawn(const char* program, const std::string& path,
+                                          const std::atomic<bool>& stopping)
+        {
+            struct stat Info;
+            if(path == "-" || stat(path.c_str(), &Info) != 0 || !S_ISREG(Info.st_mode))
+            {
+                throw std::runtime_error(
+                    std::string("compressed input from a pipe needs a build with the ") +
+                    program + " library");
+            }
+            int Pipe[2];
+            if(pipe(Pipe) != 0)
+            {
+                throw systemError("pipe");
+            }
+            const pid_t Child = fork();
+            if(Child < 0)
+            {
+                throw systemError("fork");
+            }
+            if(Child == 0)
+            {
+                dup2(Pipe[1], STDOUT_FILENO);
+                ::close(Pipe[0]);
+                ::close(Pipe[1]);
+                execlp(program, program, "-dc", "--", path.c_str(), nullptr);
+                _exit(127);
+            }
+            ::close(Pipe[1]);
+            return std::unique_ptr<ByteSource>(new FdSource(
+                Pipe[0], true, stopping, Child, std::string(program) + " -dc"));
+        }
+#endif
+
+        std::unique_ptr<ByteSource> openSource(const std::string& path,
+                                               const std::atomic<bool>& stopping)
+        {
+            const bool Stdin = path == "-";
+            const int Fd = Stdin ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY);
+            if(Fd < 0)
+            {
+                throw systemError("failed to open " + path);
+            }
+            std::unique_ptr<FdSource> In(new FdSource(Fd, !Stdin, stopping));
+            unsigned char Magic[4];
+            const size_t MagicSize = In->readFully(Magic, sizeof(Magic));
+            In->unread(Magic, MagicSize);
+
+            switch(detect(Magic, MagicSize))
+            {
+            case GZIP:
+#ifdef HAVE_ZLIB
+                return std::unique_ptr<ByteSource>(new GzipSource(std::move(In)));
+#else
+                return spawn("gzip", path, stopping);
+#endif
+            case ZSTD:
+#ifdef HAVE_ZSTD
+                return std::unique_ptr<ByteSource>(new ZstdSource(std::move(In)));
+#else
+                return spawn("zstd", path, stopping);
+#endif
+            default:
+                return std::unique_ptr<ByteSource>(std::move(In));
+            }
+        }
+
+    } // namespace
+
+    constexpr size_t SequentialReader::KEEP_BEHIND;
+
+    bool SequentialReader :: needed(const std::string& path)
+    {
+        if(path == "-")
+        {
+            return true;
+        }
+        struct stat Info;
+        if(stat(path.c_str(), &Info) != 0)
+        {
+            return false;
+        }
+        if(!S_ISREG(Info.st_mode))
+        {
+            return true;
+        }
+        const int Fd = ::open(path.c_str(), O_RDONLY);
+        if(Fd < 0)
+        {
+            return false;
+        }
+        unsigned char Magic[4];
+        const ssize_t Size = pread(Fd, Magic, sizeof(Magic), 0);
+        ::close(Fd);
+        return Size > 0 && detect(Magic, Size) != RAW;
+    }
+
+    void SequentialReader :: open(const std::string& path)
+    {
+        close();
+        Stopping = false;
+        Producer = std::thread(&SequentialReader::produce, this, path);
+    }
+
+    void SequentialReader :: close()
+    {
+        if(Producer.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> Guard(Lock);
+                Stopping = true;
+            }
+            Changed.notify_all();
+            Producer.join();
+        }
+        Full.clear();
+        Free.clear();
+        Finished = false;
+        Error = nullptr;
+        Window.clear();
+        Filled = 0;
+        WindowBegin = 0;
+        Pos = 0;
+        Ended = false;
+    }
+
+    void SequentialReader :: produce(const std::string& path)
+    {
+        try
+        {
+            auto Source = openSource(path, Stopping);
+            while(true)
+            {
+                Block B;
+                {
+                    std::unique_lock<std::mutex> Guard(Lock);
+                    Changed.wait(Guard, [this]
+                    {
+                        return Stopping || Full.size() < MAX_BLOCKS;
+                    });
+                    if(Stopping)
+                    {
+                        break;
+                    }
+                    if(!Free.empty())
+                    {
+                        B = std::move(Free.back());
+                        Free.pop_back();
+                    }
+                }
+                if(!B.Data)
+                {
+                    B.Data.reset(new unsigned char[BLOCK_SIZE]);
+                }
+                B.Size = Source->read(B.Data.get(), BLOCK_SIZE);
+                if(B.Size == 0)
+                {
+                    break;
+                }
+                {
+                    std::lock_guard<std::mutex> Guard(Lock);
+                    Full.push_back(std::move(B));
+                }
+                Changed.notify_all();
+            }
+        }
+        catch(...)
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            Error = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            Finished = true;
+        }
+        Changed.notify_all();
+    }
+
+    bool SequentialReader :: fill(size_t n)
+    {
+        while(WindowBegin + Filled < Pos + n)
+        {
+            if(Ended)
+            {
+                return false;
+            }
+            Block B;
+            {
+                std::unique_lock<std::mutex> Guard(Lock);
+                Changed.wait(Guard, [this] { return Finished || !Full.empty(); });
+                if(Full.empty())
+                {
+                    if(Error)
+                    {
+                        std::rethrow_exception(Error);
+                    }
+                    Ended = true;
+                    return false;
+                }
+                B = std::move(Full.front());
+                Full.pop_front();
+            }
+            Changed.notify_all();
+
+            // Drop what is no longer needed, except for a little
+            // before the read position.
+            const uint64_t WindowEnd = WindowBegin + Filled;
+            const uint64_t KeepFrom = std::max<uint64_t>(
+                WindowBegin, std::min(Pos, WindowEnd) -
+                std::min<uint64_t>(std::min(Pos, WindowEnd), KEEP_BEHIND));
+            const size_t Drop = KeepFrom - WindowBegin;
+            if(Drop > 0)
+            {
+                std::memmove(Window.data(), Window.data() + Drop, Filled - Drop);
+                Filled -= Drop;
+                WindowBegin += Drop;
+            }
+            if(Window.size() < Filled + B.Size)
+            {
+                Window.resize(std::max(Window.size() * 2, Filled + B.Size));
+            }
+            std::memcpy(Window.data() + Filled, B.Data.get(), B.Size);
+            Filled += B.Size;
+
+            std::lock_guard<std::mutex> Guard(Lock);
+            Free.push_back(std::move(B));
+        }
+        return true;
+    }
+
+    bool SequentialReader :: read(void* dest, size_t n)
+    {
+        if(!fill(n))
+        {
+            return false;
+        }
+        std::memcpy(dest, Window.data() + (Pos - WindowBegin), n);
+        Pos += n;
+        return true;
+    }
+
+    const unsigned char* SequentialReader :: view(size_t n)
+    {
+        if(!fill(n))
+        {
+            return nullptr;
+        }
+        const unsigned char* Result = Window.data() + (Pos - WindowBegin);
+        Pos += n;
+        return Result;
+    }
+
+    void SequentialReader :: seek(uint64_t pos)
+    {
+        if(pos < WindowBegin)
+        {
+            throw std::runtime_error(
+                "cannot go back this far in compressed or piped input");
+        }
+        Pos = pos;
+    }
+
+    bool SequentialReader :: eof()
+    {
+        return !fill(1);
+    }
+
+    uint64_t SequentialReader :: size() const
+    {
+        return Ended ? WindowBegin + Filled : std::numeric_limits<uint64_t>::max();
+    }
+
+} // namespace libmd
@@ -0,0 +1,127 @@
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef SDF_SEQUENTIAL_H
+#define SDF_SEQUENTIAL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace libmd
+{
+    // Where a SequentialReader gets its bytes from.
+    class ByteSource
+    {
+    public:
+        virtual ~ByteSource() = default;
+        // Read up to “size” bytes into buffer. Return 0 at the end.
+        // Throws std::runtime_error on errors.
+        virtual size_t read(unsigned char* buffer, size_t size) = 0;
+    };
+
+    // Reads input that can only be read front to back: gzip or zstd
+    // compressed files, standard input (given as “-”), and pipes.
+    // Compressed input is recognized by its magic number, and is
+    // decompressed on a thread of its own, a few blocks ahead of the
+    // reader.
+    //
+    // A little of what has been read is kept, so that a reader can go
+    // back a short way, for example to read a frame header again
+    // after peeking at it. Seeking forward reads and drops the bytes
+    // in between.
+    class SequentialReader
+    {
+    public:
+        // How far back seek() is always allowed to go.
+        static constexpr size_t KEEP_BEHIND = 1 << 16;
+
+        SequentialReader() = default;
+        ~SequentialReader() { close(); }
+
+        SequentialReader(const SequentialReader&) = delete;
+        SequentialReader& operator=(const SequentialReader&) = delete;
+
+        // Whether path has to be read with this class, rather than
+        // with random access.
+        static bool needed(const std::string& path);
+
+        // Throws std::runtime_error if path cannot be opened.
+        void open(const std::string& path);
+        void close();
+        bool isOpen() const { return Producer.joinable(); }
+
+        // Copy the next n bytes to dest. Return false if there are not
+        // n bytes left.
+        bool read(void* dest, size_t n);
+        // Return a pointer to the next n bytes and move past them, or
+        // nullptr if there are not n bytes left. The pointer is valid
+        // until the next call.
+        const unsigned char* view(size_t n);
+        // Going further back than KEEP_BEHIND bytes from the furthest
+        // position read throws std::runtime_error. Going past the end
+        // is allowed, like with an std::ifstream.
+        void seek(uint64_t pos);
+        uint64_t tell() const { return Pos; }
+        bool eof();
+        // The total size of the input, if the end has been reached.
+        // Otherwise the largest uint64_t.
+        uint64_t size() const;
+        // Whether the input reaches the current position, which it
+        // may not after seeking forward.
+        bool inBounds() { return fill(0); }
+
+    private:
+        struct Block
+        {
+            std::unique_ptr<unsigned char[]> Data;
+            size_t Size;
+        };
+
+        // Make [Pos, Pos + n) available in Window. Return false if the
+        // input ends first.
+        bool fill(size_t n);
+        void produce(const std::string& path);
+
+        // Decoded bytes [WindowBegin, WindowBegin + Filled).
+        std::vector<unsigned char> Window;
+        size_t Filled = 0;
+        uint64_t WindowBegin = 0;
+        uint64_t Pos = 0;
+        bool Ended = false;
+
+        // Blocks handed from the producer thread to the reader.
+        std::thread Producer;
+        std::mutex Lock;
+        std::condition_variable Changed;
+        std::deque<Block> Full;
+        std::vector<Block> Free;
+        bool Finished = false;
+        std::atomic<bool> Stopping{false};
+        std::exception_ptr Error;
+    };
+
+} // namespace libmd
+
+#endif
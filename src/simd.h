@@ -0,0 +1,154 @@
+// -*- mode: c++; -*-
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef SDF_SIMD_H
+#define SDF_SIMD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Whole-array kernels. Which instruction set is used is decided at
+// compile time (see -march=native in CMakeLists.txt); every kernel
+// finishes the tail, or everything without SIMD, with plain scalar
+// code that gives the same result.
+
+namespace libmd
+{
+    // Reverse the byte order of each of the n 32-bit words at data.
+    inline void swapBytes32(void* data, size_t n)
+    {
+        unsigned char* Bytes = static_cast<unsigned char*>(data);
+        size_t i = 0;
+#if defined(__AVX2__)
+        const __m256i Shuffle = _mm256_setr_epi8(
+            3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+            3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        for(; i + 8 <= n; i += 8)
+        {
+            __m256i* Ptr = reinterpret_cast<__m256i*>(Bytes + i * 4);
+            _mm256_storeu_si256(Ptr, _mm256_shuffle_epi8(_mm256_loadu_si256(Ptr),
+                                                         Shuffle));
+        }
+#elif defined(__SSSE3__)
+        const __m128i Shuffle = _mm_setr_epi8(
+            3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        for(; i + 4 <= n; i += 4)
+        {
+            __m128i* Ptr = reinterpret_cast<__m128i*>(Bytes + i * 4);
+            _mm_storeu_si128(Ptr, _mm_shuffle_epi8(_mm_loadu_si128(Ptr), Shuffle));
+        }
+#elif defined(__ARM_NEON)
+        for(; i + 4 <= n; i += 4)
+        {
+            vst1q_u8(Bytes + i * 4, vrev32q_u8(vld1q_u8(Bytes + i * 4)));
+        }
+#endif
+        for(; i < n; i++)
+        {
+            uint32_t Word;
+            std::memcpy(&Word, Bytes + i * 4, sizeof(Word));
+            Word = __builtin_bswap32(Word);
+            std::memcpy(Bytes + i * 4, &Word, sizeof(Word));
+        }
+    }
+
+    // out[i] = in[i] * scale, for the n values at in.
+    inline void dequantize(const int32_t* in, size_t n, float scale, float* out)
+    {
+        size_t i = 0;
+#if defined(__AVX2__)
+        const __m256 Scale = _mm256_set1_ps(scale);
+        for(; i + 8 <= n; i += 8)
+        {
+            const __m256i Ints = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(in + i));
+            _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(Ints), Scale));
+        }
+#elif defined(__SSE2__)
+        const __m128 Scale = _mm_set1_ps(scale);
+        for(; i + 4 <= n; i += 4)
+        {
+            const __m128i Ints = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(in + i));
+            _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(Ints), Scale));
+        }
+#elif defined(__ARM_NEON)
+        for(; i + 4 <= n; i += 4)
+        {
+            vst1q_f32(out + i, vmulq_n_f32(vcvtq_f32_s32(vld1q_s32(in + i)), scale));
+        }
+#endif
+        for(; i < n; i++)
+        {
+            out[i] = in[i] * scale;
+        }
+    }
+
+    // x[i] = in[i*3] * scale, y[i] = in[i*3+1] * scale and z[i] =
+    // in[i*3+2] * scale, for the n xyz triples at in. This is
+    // dequantize() into separate arrays.
+    inline void dequantizePlanar(const int32_t* in, size_t n, float scale,
+                                 float* x, float* y, float* z)
+    {
+        size_t i = 0;
+#if defined(__AVX2__)
+        // 8 triples are 3 registers, whose lanes hold x, y and z in a
+        // fixed pattern. Blending picks the lanes of each coordinate,
+        // and a permutation puts them in order.
+        const __m256 Scale = _mm256_set1_ps(scale);
+        const __m256i OrderX = _mm256_setr_epi32(0, 3, 6, 1, 4, 7, 2, 5);
+        const __m256i OrderY = _mm256_setr_epi32(1, 4, 7, 2, 5, 0, 3, 6);
+        const __m256i OrderZ = _mm256_setr_epi32(2, 5, 0, 3, 6, 1, 4, 7);
+        for(; i + 8 <= n; i += 8)
+        {
+            const __m256i* Ptr = reinterpret_cast<const __m256i*>(in + i * 3);
+            const __m256i A = _mm256_loadu_si256(Ptr);
+            const __m256i B = _mm256_loadu_si256(Ptr + 1);
+            const __m256i C = _mm256_loadu_si256(Ptr + 2);
+            const __m256i X = _mm256_blend_epi32(_mm256_blend_epi32(A, B, 0x92), C, 0x24);
+            const __m256i Y = _mm256_blend_epi32(_mm256_blend_epi32(A, B, 0x24), C, 0x49);
+            const __m256i Z = _mm256_blend_epi32(_mm256_blend_epi32(A, B, 0x49), C, 0x92);
+            _mm256_storeu_ps(x + i, _mm256_mul_ps(_mm256_cvtepi32_ps(
+                _mm256_permutevar8x32_epi32(X, OrderX)), Scale));
+            _mm256_storeu_ps(y + i, _mm256_mul_ps(_mm256_cvtepi32_ps(
+                _mm256_permutevar8x32_epi32(Y, OrderY)), Scale));
+            _mm256_storeu_ps(z + i, _mm256_mul_ps(_mm256_cvtepi32_ps(
+                _mm256_permutevar8x32_epi32(Z, OrderZ)), Scale));
+        }
+#endif
+        for(; i < n; i++)
+        {
+            x[i] = in[i * 3] * scale;
+            y[i] = in[i * 3 + 1] * scale;
+            z[i] = in[i * 3 + 2] * scale;
+        }
+    }
+
+} // namespace libmd
+
+#endif
@@ -0,0 +1,437 @@
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+#include <unistd.h>
+
+#include "mappedfile.h"
+#include "topology.h"
+#include "xtcindex.h"
+
+namespace libmd
+{
+    namespace
+    {
+        constexpr char TOPOLOGY_MAGIC[8] = {'S', 'D', 'F', 'T', 'O', 'P', '0', '2'};
+
+        struct TopologyHeader
+        {
+            char Magic[8];
+            uint64_t SourceSize;
+            int64_t SourceMTime;
+            uint64_t AtomCount;
+            // The distinct atom and residue names are stored once,
+            // each followed by a NUL.
+            uint64_t NameBytes;
+        };
+
+        struct TopologyAtom
+        {
+            int32_t Res;
+            // Indices of the atom and residue names among the
+            // distinct names.
+            uint32_t Name;
+            uint32_t ResName;
+        };
+
+        // The names of a NameTable are kept in chunks, which never
+        // move once allocated.
+        constexpr size_t NAME_CHUNK_BITS = 12;
+        constexpr size_t NAME_CHUNK_SIZE = size_t(1) << NAME_CHUNK_BITS;
+        constexpr size_t NAME_CHUNK_COUNT = 4096;
+
+        struct Names
+        {
+            std::mutex Lock;
+            std::unordered_map<std::string, uint32_t> Ids;
+            std::unique_ptr<std::string[]> Chunks[NAME_CHUNK_COUNT];
+        };
+
+        Names& names()
+        {
+            static Names Table;
+            return Table;
+        }
+
+        // Each thread parses at least this much of a GRO file.
+        constexpr size_t MIN_BYTES_PER_THREAD = 4 << 20;
+
+        bool isBlank(char c)
+        {
+            return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+        }
+
+        // The beginning of the line after the one “p” is in.
+        const char* nextLine(const char* p, const char* end)
+        {
+            const void* Newline = std::memchr(p, '\n', end - p);
+            return Newline == nullptr ? end :
+                static_cast<const char*>(Newline) + 1;
+        }
+
+        // Atom and residue names of a GRO file have at most 5
+        // characters, so one fits in an integer. This maps those
+        // integers to name ids, so that each thread only goes to the
+        // NameTable once per name.
+        using NameCache = std::unordered_map<uint64_t, uint32_t>;
+
+        // The id of the name in [begin, end), without the blanks
+        // around it.
+        uint32_t parseName(const char* begin, const char* end, NameCache& names)
+        {
+            while(begin < end && isBlank(*begin))
+            {
+                begin++;
+            }
+            while(end > begin && isBlank(end[-1]))
+            {
+                end--;
+            }
+            uint64_t Key = end - begin;
+            for(const char* c = begin; c < end; c++)
+            {
+                Key = (Key << 8) | static_cast<unsigned char>(*c);
+            }
+            auto Found = names.find(Key);
+            if(Found == std::end(names))
+            {
+                Found = names.emplace(Key, NameTable::intern(
+                                          std::string(begin, end))).first;
+            }
+            return Found->second;
+        }
+
+        // Parse the atom line [begin, end) into atoms[i] and
+        // res_names[i]. The residue number is in columns 1-5, the
+        // residue name in columns 6-10, and the atom name in columns
+        // 11-15.
+        void parseAtom(const char* begin, const char* end, NameCache& names,
+                       std::vector<AtomIdentifier>& atoms,
+                       std::vector<uint32_t>& res_names, size_t i)
+        {
+            const size_t Length = end - begin;
+            const char* p = begin;
+            const char* ResEnd = begin + std::min<size_t>(Length, 5);
+            while(p < ResEnd && isBlank(*p))
+            {
+                p++;
+            }
+            const bool Negative = p < ResEnd && *p == '-';
+            if(p < ResEnd && (*p == '-' || *p == '+'))
+            {
+                p++;
+            }
+            int Res = 0;
+            for(; p < ResEnd && *p >= '0' && *p <= '9'; p++)
+            {
+                Res = Res * 10 + (*p - '0');
+            }
+
+            const char* NameBegin = begin + std::min<size_t>(Length, 10);
+            const char* NameEnd = begin + std::min<size_t>(Length, 15);
+            res_names[i] = parseName(ResEnd, NameBegin, names);
+            atoms[i] = AtomIdentifier(Negative ? -Res : Res,
+                                      parseName(NameBegin, NameEnd, names));
+        }
+
+        Topology parseGro(const char* data, size_t size,
+                                             const std::string& path)
+        {
+            const char* End = data + size;
+            // The 1st line is a title, and the 2nd is the number of
+            // atoms.
+            const char* CountLine = nextLine(data, End);
+            const char* AtomsBegin = nextLine(CountLine, End);
+            const size_t Count = std::strtoull(
+                std::string(CountLine, AtomsBegin).c_str(), nullptr, 10);
+            std::vector<AtomIdentifier> Atoms(Count);
+            std::vector<uint32_t> ResNames(Count);
+
+            // Split the rest into ranges of whole lines. The box line
+            // and anything after it are parsed as well, but dropped.
+            const size_t Bytes = End - AtomsBegin;
+            const size_t ThreadCount = std::max<size_t>(1, std::min<size_t>(
+                std::thread::hardware_concurrency(), Bytes / MIN_BYTES_PER_THREAD));
+            std::vector<const char*> Bounds(ThreadCount + 1, End);
+            Bounds[0] = AtomsBegin;
+            for(size_t i = 1; i < ThreadCount; i++)
+            {
+                Bounds[i] = std::max(Bounds[i-1],
+                                     nextLine(AtomsBegin + Bytes / ThreadCount * i - 1, End));
+            }
+
+            // Where each range begins in the list of atoms.
+            std::vector<size_t> Firsts(ThreadCount + 1, 0);
+            for(size_t i = 0; i < ThreadCount; i++)
+            {
+                size_t Lines = std::count(Bounds[i], Bounds[i+1], '\n');
+                if(i + 1 == ThreadCount && Bounds[i+1] > Bounds[i] &&
+                   Bounds[i+1][-1] != '\n')
+                {
+                    // The last line has no newline.
+                    Lines++;
+                }
+                Firsts[i+1] = Firsts[i] + Lines;
+            }
+            if(Firsts.back() < Count)
+            {
+                throw std::runtime_error("Truncated GRO file: " + path);
+            }
+
+            auto Parse = [&](size_t range)
+            {
+                NameCache Names;
+                size_t Index = Firsts[range];
+                for(const char* Line = Bounds[range];
+                    Line < Bounds[range+1] && Index < Count; Index++)
+                {
+                    const char* Next = nextLine(Line, Bounds[range+1]);
+                    parseAtom(Line, Next, Names, Atoms, ResNames, Index);
+                    Line = Next;
+                }
+            };
+            std::vector<std::thread> Threads;
+            for(size_t i = 1; i < ThreadCount; i++)
+            {
+                Threads.emplace_back(Parse, i);
+            }
+            Parse(0);
+            for(auto& Thread: Threads)
+            {
+                Thread.join();
+            }
+            return Topology(std::move(Atoms), std::move(ResNames));
+        }
+
+        bool loadCache(const std::string& path, const FileFingerprint& expected,
+                       Topology& topo)
+        {
+            std::ifstream File(path, std::ios::binary);
+            if(!File)
+            {
+                return false;
+            }
+            TopologyHeader Header;
+            if(!File.read(reinterpret_cast<char*>(&Header), sizeof(Header)) ||
+               std::memcmp(Header.Magic, TOPOLOGY_MAGIC, sizeof(TOPOLOGY_MAGIC)) != 0 ||
+               Header.SourceSize != expected.Size ||
+               Header.SourceMTime != expected.MTime)
+            {
+                return false;
+            }
+
+            std::string NameData(Header.NameBytes, '\0');
+            std::vector<TopologyAtom> Stored(Header.AtomCount);
+            if(!File.read(&NameData[0], NameData.size()) ||
+               !File.read(reinterpret_cast<char*>(Stored.data()),
+                          sizeof(TopologyAtom) * Stored.size()))
+            {
+                return false;
+            }
+            std::vector<uint32_t> NameIds;
+            for(size_t Begin = 0; Begin < NameData.size();)
+            {
+                const size_t End = NameData.find('\0', Begin);
+                if(End == std::string::npos)
+                {
+                    return false;
+                }
+                NameIds.push_back(NameTable::intern(NameData.substr(Begin, End - Begin)));
+                Begin = End + 1;
+            }
+
+            std::vector<AtomIdentifier> Atoms;
+            std::vector<uint32_t> ResNames;
+            Atoms.reserve(Stored.size());
+            ResNames.reserve(Stored.size());
+            for(const auto& Atom: Stored)
+            {
+                if(Atom.Name >= NameIds.size() || Atom.ResName >= NameIds.size())
+                {
+                    return false;
+                }
+                Atoms.emplace_back(Atom.Res, NameIds[Atom.Name]);
+                ResNames.push_back(NameIds[Atom.ResName]);
+            }
+            topo = Topology(std::move(Atoms), std::move(ResNames));
+            return true;
+        }
+
+        bool saveCache(const std::string& path, const FileFingerprint& source,
+                       const Topology& topo)
+        {
+            // From NameTable ids to the ids in the file.
+            std::unordered_map<uint32_t, uint32_t> NameIndex;
+            std::string NameData;
+            auto Index = [&](uint32_t id)
+            {
+                auto Found = NameIndex.find(id);
+                if(Found == std::end(NameIndex))
+                {
+                    Found = NameIndex.emplace(id, NameIndex.size()).first;
+                    NameData += NameTable::name(id);
+                    NameData += '\0';
+                }
+                return Found->second;
+            };
+            std::vector<TopologyAtom> Stored;
+            Stored.reserve(topo.size());
+            for(size_t i = 0; i < topo.size(); i++)
+            {
+                const uint32_t Name = Index(topo.atom(i).NameId);
+                Stored.push_back({topo.atom(i).Res, Name, Index(topo.resName(i))});
+            }
+
+            TopologyHeader Header;
+            std::memcpy(Header.Magic, TOPOLOGY_MAGIC, sizeof(TOPOLOGY_MAGIC));
+            Header.SourceSize = source.Size;
+            Header.SourceMTime = source.MTime;
+            Header.AtomCount = Stored.size();
+            Header.NameBytes = NameData.size();
+
+            const std::string TmpPath = path + ".tmp." + std::to_string(getpid());
+            {
+                std::ofstream File(TmpPath, std::ios::binary | std::ios::trunc);
+                if(!File)
+                {
+                    return false;
+                }
+                File.write(reinterpret_cast<const char*>(&Header), sizeof(Header));
+                File.write(NameData.data(), NameData.size());
+                File.write(reinterpret_cast<const char*>(Stored.data()),
+                           sizeof(TopologyAtom) * Stored.size());
+                if(!File)
+                {
+                    File.close();
+                    std::remove(TmpPath.c_str());
+                    return false;
+                }
+            }
+            if(std::rename(TmpPath.c_str(), path.c_str()) != 0)
+            {
+                std::remove(TmpPath.c_str());
+                return false;
+            }
+            return true;
+        }
+    } // namespace
+
+    uint32_t NameTable :: intern(const std::string& name)
+    {
+        auto& Table = names();
+        std::lock_guard<std::mutex> Guard(Table.Lock);
+        auto Found = Table.Ids.find(name);
+        if(Found != std::end(Table.Ids))
+        {
+            return Found->second;
+        }
+        const size_t Id = Table.Ids.size();
+        if(Id >= NAME_CHUNK_SIZE * NAME_CHUNK_COUNT)
+        {
+            throw std::runtime_error("Too many distinct atom names");
+        }
+        auto& Chunk = Table.Chunks[Id >> NAME_CHUNK_BITS];
+        if(!Chunk)
+        {
+            Chunk.reset(new std::string[NAME_CHUNK_SIZE]);
+        }
+        Chunk[Id & (NAME_CHUNK_SIZE - 1)] = name;
+        Table.Ids.emplace(name, Id);
+        return Id;
+    }
+
+    const std::string& NameTable :: name(uint32_t id)
+    {
+        return names().Chunks[id >> NAME_CHUNK_BITS][id & (NAME_CHUNK_SIZE - 1)];
+    }
+
+    AtomIdentifier :: AtomIdentifier(const std::string& s)
+    {
+        auto SepPos = s.find("+");
+        Res = std::atoi(s.substr(0, SepPos).c_str());
+        NameId = NameTable::intern(s.substr(SepPos + 1, s.size() - SepPos - 1));
+    }
+
+    AtomIdentifier :: AtomIdentifier(const char s[])
+    {
+        size_t i;
+        size_t SepPos = 0;
+        for(i = 0; s[i] != '\0'; i++)
+        {
+            if(s[i] == '+')
+            {
+                Res = std::atoi(std::string(s, i).c_str());
+                SepPos = i;
+            }
+        }
+        NameId = NameTable::intern(std::string(s + SepPos + 1, i - SepPos - 1));
+    }
+
+    Topology :: Topology(std::vector<AtomIdentifier> atoms,
+                         std::vector<uint32_t> res_names)
+            : Atoms(std::move(atoms)), ResNames(std::move(res_names))
+    {
+        Index.reserve(Atoms.size());
+        for(size_t i = 0; i < Atoms.size(); i++)
+        {
+            Index[Atoms[i]] = i;
+        }
+    }
+
+    Topology readGro(const std::string& path)
+    {
+        MappedFile Map;
+        if(Map.open(path))
+        {
+            return parseGro(reinterpret_cast<const char*>(Map.data()), Map.size(), path);
+        }
+        // Not a regular file, or empty.
+        std::ifstream File(path, std::ios::binary);
+        if(!File)
+        {
+            throw std::runtime_error("Failed to open " + path);
+        }
+        const std::string Data((std::istreambuf_iterator<char>(File)),
+                               std::istreambuf_iterator<char>());
+        return parseGro(Data.data(), Data.size(), path);
+    }
+
+    Topology loadTopology(const std::string& gro_path)
+    {
+        const auto Source = FileFingerprint::of(gro_path);
+        const std::string CachePath = topologyCachePath(gro_path);
+        Topology Topo;
+        if(loadCache(CachePath, Source, Topo))
+        {
+            return Topo;
+        }
+        Topo = readGro(gro_path);
+        saveCache(CachePath, Source, Topo);
+        return Topo;
+    }
+
+} // namespace libmd
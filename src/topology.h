@@ -0,0 +1,176 @@
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef SDF_TOPOLOGY_H
+#define SDF_TOPOLOGY_H
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace libmd
+{
+    // Every atom or residue name the program sees is stored here
+    // once, and known by its index. This way a name is an integer,
+    // which is cheap to keep, hash and compare. Names are never
+    // removed.
+    //
+    // intern() can be called from any thread. name() does not lock:
+    // an id can only come from intern(), and the string it refers to
+    // never moves.
+    class NameTable
+    {
+    public:
+        // The id of “name”, which is added if it is new.
+        static uint32_t intern(const std::string& name);
+        static const std::string& name(uint32_t id);
+    };
+
+    struct AtomIdentifier
+    {
+        AtomIdentifier() = default;
+        AtomIdentifier(int s1, const std::string& s2)
+                : Res(s1), NameId(NameTable::intern(s2)) {}
+        AtomIdentifier(int res, uint32_t name_id)
+                : Res(res), NameId(name_id) {}
+        AtomIdentifier(const std::string& s);
+        AtomIdentifier(const char s[]);
+
+        AtomIdentifier(const AtomIdentifier&) = default;
+        AtomIdentifier& operator=(const AtomIdentifier&) = default;
+
+        bool operator==(const AtomIdentifier& rhs) const
+        {
+            return Res == rhs.Res && NameId == rhs.NameId;
+        }
+
+        const std::string& name() const { return NameTable::name(NameId); }
+
+        std::string toStr() const
+        {
+            return std::to_string(Res) + "+" + name();
+        }
+
+        int Res;
+        // See NameTable.
+        uint32_t NameId;
+    };
+
+    inline std::ostream& operator<< (std::ostream& stream, const AtomIdentifier& id)
+    {
+        stream << id.toStr();
+        return stream;
+    }
+}
+
+// Hash for AtomIdentifier
+namespace std
+{
+    template<> struct hash<libmd::AtomIdentifier>
+    {
+        typedef libmd::AtomIdentifier argument_type;
+        typedef std::size_t result_type;
+        result_type operator()(argument_type const& s) const noexcept
+        {
+            // Both integers through the finalizer of SplitMix64, so
+            // that every bit of them affects every bit of the hash.
+            uint64_t x = (static_cast<uint64_t>(static_cast<uint32_t>(s.Res)) << 32) |
+                s.NameId;
+            x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+            return static_cast<result_type>(x ^ (x >> 31));
+        }
+    };
+}
+
+namespace libmd
+{
+    // The atoms of a structure, in order, and where each of them is
+    // by name. A topology does not change once it is made. A
+    // trajectory makes one when it is opened, and everything that
+    // refers to its atoms, such as snapshots, shares that one through
+    // a TopologyPtr, and only keeps atom indices. It is too big to be
+    // copied by accident, so it can only be moved.
+    class Topology
+    {
+    public:
+        Topology() = default;
+        // “res_names” has the residue name of each atom, as a
+        // NameTable id.
+        Topology(std::vector<AtomIdentifier> atoms, std::vector<uint32_t> res_names);
+
+        Topology(const Topology&) = delete;
+        Topology& operator=(const Topology&) = delete;
+        Topology(Topology&&) = default;
+        Topology& operator=(Topology&&) = default;
+
+        size_t size() const { return Atoms.size(); }
+        const AtomIdentifier& atom(size_t i) const { return Atoms[i]; }
+        // As a NameTable id.
+        uint32_t resName(size_t i) const { return ResNames[i]; }
+
+        // The index of “atom”, or size() if there is no such atom.
+        size_t find(const AtomIdentifier& atom) const
+        {
+            auto Found = Index.find(atom);
+            return Found == std::end(Index) ? size() : Found->second;
+        }
+        // The same, but throws std::out_of_range if there is no such
+        // atom.
+        size_t index(const AtomIdentifier& atom) const { return Index.at(atom); }
+
+        bool operator==(const Topology& rhs) const
+        {
+            return Atoms == rhs.Atoms && ResNames == rhs.ResNames;
+        }
+
+    private:
+        std::vector<AtomIdentifier> Atoms;
+        std::vector<uint32_t> ResNames;
+        std::unordered_map<AtomIdentifier, size_t> Index;
+    };
+
+    using TopologyPtr = std::shared_ptr<const Topology>;
+
+    // The atoms of a GRO file, in order. Format spec:
+    // http://manual.gromacs.org/current/reference-manual/file-formats.html#gro.
+    //
+    // Only the fixed columns of the residue number, the residue name
+    // and the atom name are looked at. The file is memory mapped, and
+    // a large one is parsed by several threads, each taking a range of
+    // lines. Throws std::runtime_error if the file cannot be read, or
+    // has fewer atoms than it says.
+    Topology readGro(const std::string& path);
+
+    // The binary topology cache of a GRO file.
+    inline std::string topologyCachePath(const std::string& gro_path)
+    {
+        return gro_path + ".sdftop";
+    }
+
+    // The same as readGro(), but from the topology cache next to the
+    // GRO file if it is up to date, which is much faster. Otherwise
+    // the GRO file is read, and the cache is written for next time.
+    // Like the frame index, not being able to write it is not an
+    // error.
+    Topology loadTopology(const std::string& gro_path);
+
+} // namespace libmd
+
+#endif
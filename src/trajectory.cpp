@@ -14,91 +14,39 @@
 // along with this program. If not, see
 // <https://www.gnu.org/licenses/>.
 
-#include <fstream>
 #include <array>
 #include <sstream>
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
 
 #include "trajectory.h"
 
 namespace libmd
 {
-    namespace
+    bool FrameSelection :: selects(size_t frame, float time) const
     {
-        // Extract names from .gro file. Format spec:
-        // http://manual.gromacs.org/current/reference-manual/file-formats.html#gro.
-        std::vector<AtomIdentifier> extractAtomIds(std::ifstream& file)
+        if(time < beginTime() || time > endTime() || frame < FirstFrame)
         {
-            std::array<char, 1024> Buffer;
-            // Skip 1st line
-            file.getline(Buffer.data(), Buffer.size());
-
-            // 2nd line is number of atoms
-            file.getline(Buffer.data(), Buffer.size());
-            size_t Count = 0;
-            {
-                std::stringstream Reader(Buffer.data());
-                Reader >> Count;
-            }
-
-            std::vector<AtomIdentifier> Result;
-            for(size_t i = 0; i < Count; i++)
-            {
-                file.getline(Buffer.data(), Buffer.size());
-                // The name starts at column 11, and is 5 chars long.
-                const std::string Res(Buffer.data() + 0, Buffer.data() + 5);
-                const std::string Name(Buffer.data() + 10, Buffer.data() + 15);
-
-                AtomIdentifier Id(std::atoi(Res.c_str()), strip(Name));
-                Result.emplace_back(std::move(Id));
-            }
-
-            return Result;
+            return false;
         }
-
-    } // namespace
-
-    AtomIdentifier :: AtomIdentifier(const std::string& s)
-    {
-        auto SepPos = s.find("+");
-        Res = std::atoi(s.substr(0, SepPos).c_str());
-        Name = s.substr(SepPos + 1, s.size() - SepPos - 1);
-    }
-
-    AtomIdentifier :: AtomIdentifier(const char s[])
-    {
-        size_t i;
-        size_t SepPos = 0;
-        for(i = 0; s[i] != '\0'; i++)
+        if((frame - FirstFrame) % Stride != 0)
         {
-            if(s[i] == '+')
-            {
-                Res = std::atoi(std::string(s, i).c_str());
-                SepPos = i;
-            }
+            return false;
         }
-        Name = std::string(s + SepPos + 1, i - SepPos - 1);
-    }
-
-    TrajectorySnapshot :: TrajectorySnapshot(const TrajectorySnapshot& from)
-            : AtomNames(from.AtomNames),
-              AtomNamesReverse(from.AtomNamesReverse),
-              Meta(from.Meta),
-              Data(from.Data)
-    {
-        Vecs.clear();
-        for(size_t i = 0; i < AtomNames.size(); i++)
+        if(Dt > 0.0f)
         {
-            Vecs.emplace_back(&(Data[i*3]));
+            // Times in the file are not exact, so allow a little slack.
+            const double Offset = double(time) - double(FirstTime);
+            const double Error = Offset - std::round(Offset / Dt) * Dt;
+            const double Tolerance = std::max(1e-3 * Dt, 1e-6 * std::abs(time));
+            return std::abs(Error) <= Tolerance;
         }
-    }
-
-    TrajectorySnapshot& TrajectorySnapshot :: operator=(TrajectorySnapshot from)
-    {
-        swap(*this, from);
-        return *this;
+        return true;
     }
 
     std::string TrajectorySnapshot :: debugString() const
@@ -108,7 +56,7 @@ namespace libmd
         {
             std::array<char, 128> Buffer;
             std::sprintf(Buffer.data(), "%5s %5.3f %5.3f %5.3f\n",
-                         AtomNames[i].toStr().c_str(),
+                         atomId(i).toStr().c_str(),
                          vec(i)[0], vec(i)[1], vec(i)[2]);
             Formatter << Buffer.data();
         }
@@ -116,58 +64,168 @@ namespace libmd
     }
 
     void Trajectory :: open(const std::string& xtc_path,
-                            const std::string& gro_path)
+                            const std::string& gro_path,
+                            XtcFile::IoMode mode,
+                            const PrefetchOptions& prefetch)
     {
-        f.open(xtc_path.c_str());
+        Prefetch = prefetch;
+        Topo = std::make_shared<const Topology>(loadTopology(gro_path));
+        openXtc(xtc_path, mode);
+    }
 
-        std::ifstream GroFile(gro_path);
-        AtomNames = extractAtomIds(GroFile);
+    void Trajectory :: open(const std::string& xtc_path,
+                            const Trajectory& like, XtcFile::IoMode mode)
+    {
+        Topo = like.Topo;
+        AtomLimit = like.AtomLimit;
+        Prefilter = like.Prefilter;
+        Prefetch = like.Prefetch;
+        openXtc(xtc_path, mode);
+    }
 
-        Meta = f.readFrameMeta();
-        if(static_cast<size_t>(Meta.AtomCount) != AtomNames.size())
+    void Trajectory :: openXtc(const std::string& xtc_path,
+                               XtcFile::IoMode mode)
+    {
+        CacheFrame = 0;
+        if(FrameCache::isCache(xtc_path))
         {
-            throw std::runtime_error(
-                "number of atoms does not align between XTC and GRO");
+            f.close();
+            Cache.open(xtc_path);
+            if(Cache.frameCount() == 0)
+            {
+                throw std::runtime_error("Empty frame cache: " + xtc_path);
+            }
+            Meta = Cache.meta(0);
         }
-
-        for(size_t i = 0; i < AtomNames.size(); i++)
+        else
         {
-            AtomNamesReverse[AtomNames[i]] = i;
+            Cache.close();
+            f.open(xtc_path.c_str(), mode, Prefetch);
+            Meta = f.readFrameMeta();
         }
-
-        GroFile.close();
-        Data.resize(Meta.AtomCount * 3); // 3D vector
-        for(size_t i = 0; i < AtomNames.size(); i++)
+        if(static_cast<size_t>(Meta.AtomCount) != Topo->size())
         {
-            Vecs.emplace_back(&(Data[i*3]));
+            throw std::runtime_error(
+                "number of atoms does not align between XTC and GRO");
         }
+
         FrameCount = 0;
+        limitAtoms(AtomLimit);
+    }
+
+    void Trajectory :: limitAtoms(size_t n)
+    {
+        AtomLimit = n;
+        const size_t Count = std::min(n, Topo->size());
+        Coords.resize(Count);
+        Meta.AtomCount = Count;
     }
 
     bool Trajectory :: nextFrame()
     {
-        if(f.eof())
+        if(eof())
         {
             return false;
         }
 
-        f.readFrame(Data.data());
+        if(Cache.isOpen())
+        {
+            // Nothing to decode, so nothing is prefiltered either.
+            Meta = Cache.meta(CacheFrame);
+            Cache.copy(CacheFrame, Coords.size(), Coords.layout());
+            CacheFrame++;
+            if(!Prefilter.empty() && Candidates.size() != Coords.size())
+            {
+                Candidates.resize(Coords.size());
+                std::iota(Candidates.begin(), Candidates.end(), 0);
+            }
+        }
+        else if(Prefilter.empty())
+        {
+            Meta = f.readFrame(Coords.layout(), Coords.size());
+        }
+        else
+        {
+            Meta = f.readFrame(Coords.layout(), Prefilter, Candidates, Coords.size());
+        }
+        Meta.AtomCount = Coords.size();
         FrameCount++;
         return true;
     }
 
+    void Trajectory :: prefilter(const AtomPrefilter& filter)
+    {
+        Prefilter = filter;
+        Candidates.clear();
+    }
+
+    bool Trajectory :: skipFrame()
+    {
+        if(eof())
+        {
+            return false;
+        }
+        if(Cache.isOpen())
+        {
+            CacheFrame++;
+        }
+        else
+        {
+            f.skipFrame();
+        }
+        return true;
+    }
+
+    void Trajectory :: seekFrame(size_t n)
+    {
+        if(!Cache.isOpen())
+        {
+            f.seekFrame(n);
+            return;
+        }
+        if(n >= Cache.frameCount())
+        {
+            throw std::out_of_range("Frame index out of range");
+        }
+        CacheFrame = n;
+    }
+
+    bool Trajectory :: syncToFrame(uint64_t offset)
+    {
+        if(!Cache.isOpen())
+        {
+            return f.syncToFrame(offset, Topo->size());
+        }
+        CacheFrame = Cache.frameAt(offset);
+        return CacheFrame < Cache.frameCount();
+    }
+
+    void Trajectory :: rewind()
+    {
+        if(Cache.isOpen())
+        {
+            CacheFrame = 0;
+        }
+        else
+        {
+            f.rewind();
+        }
+        FrameCount = 0;
+    }
+
     void Trajectory :: close()
     {
         if(f.isOpen()) { f.close(); }
+        Cache.close();
     }
 
     void Trajectory :: clear()
     {
-        AtomNames.clear();
-        AtomNamesReverse.clear();
-        Data.clear();
-        Vecs.clear();
+        Topo = std::make_shared<const Topology>();
+        Coords = Coordinates();
         FrameCount = 0;
+        Prefilter = AtomPrefilter();
+        Candidates.clear();
     }
 
     std::string Trajectory :: debugString() const
@@ -177,7 +235,7 @@ namespace libmd
         {
             std::array<char, 128> Buffer;
             std::sprintf(Buffer.data(), "%5s %5.3f %5.3f %5.3f\n",
-                         AtomNames[i].toStr().c_str(),
+                         Topo->atom(i).toStr().c_str(),
                          vec(i)[0], vec(i)[1], vec(i)[2]);
             Formatter << Buffer.data();
         }
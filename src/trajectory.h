@@ -21,124 +21,157 @@
 #include <string>
 #include <unordered_map>
 #include <vector>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <memory>
 #include <stdexcept>
 
 #include <Eigen/Dense>
 
+#include "coords.h"
+#include "framecache.h"
+#include "topology.h"
 #include "xtcio.h"
 #include "utils.h"
 
 namespace libmd
 {
-    struct AtomIdentifier
+    // Which frames of a trajectory to use, in the spirit of the -b,
+    // -e, -skip and -dt options of GROMACS. Times are in the unit of
+    // the XTC file.
+    struct FrameSelection
     {
-        AtomIdentifier() = default;
-        AtomIdentifier(int s1, const std::string& s2)
-                : Res(s1), Name(s2) {}
-        AtomIdentifier(const std::string& s);
-        AtomIdentifier(const char s[]);
-
-        AtomIdentifier(const AtomIdentifier&) = default;
-        AtomIdentifier& operator=(const AtomIdentifier&) = default;
-
-        bool operator==(const AtomIdentifier& rhs) const
+        float Begin = -std::numeric_limits<float>::infinity();
+        float End = std::numeric_limits<float>::infinity();
+        // Use every Stride-th frame from the first one not before
+        // Begin.
+        size_t Stride = 1;
+        // If positive, only use frames whose time after that of the
+        // first frame not before Begin is a multiple of Dt.
+        float Dt = 0.0f;
+
+        // Times in an XTC file are single precision, and a time given
+        // as 0.1 may well be stored as 0.099999994, so the limits get
+        // a little slack.
+        float beginTime() const { return Begin - slack(Begin); }
+        float endTime() const { return End + slack(End); }
+
+        bool all() const
         {
-            return Res == rhs.Res && Name == rhs.Name;
+            return !needsOrigin() && Begin == -std::numeric_limits<float>::infinity()
+                && End == std::numeric_limits<float>::infinity();
         }
 
-        std::string toStr() const
+        // Stride and Dt count from the first selected frame, which
+        // has to be found in the frame index, and given to origin().
+        bool needsOrigin() const { return Stride > 1 || Dt > 0.0f; }
+        void origin(size_t frame, float time)
         {
-            return std::to_string(Res) + "+" + Name;
+            FirstFrame = frame;
+            FirstTime = time;
         }
 
-        int Res;
-        std::string Name;
-    };
+        // Whether to use the frame-th frame (0-based, in the whole
+        // file) at time “time”.
+        bool selects(size_t frame, float time) const;
 
-    inline std::ostream& operator<< (std::ostream& stream, const AtomIdentifier& id)
-    {
-        stream << id.toStr();
-        return stream;
-    }
-}
+    private:
+        static float slack(float t) { return 1e-6f * std::max(std::abs(t), 1.0f); }
 
-// Hash for AtomIdentifier
-namespace std
-{
-    template<> struct hash<libmd::AtomIdentifier>
-    {
-        typedef libmd::AtomIdentifier argument_type;
-        typedef std::size_t result_type;
-        result_type operator()(argument_type const& s) const noexcept
-        {
-            result_type const h1 ( std::hash<int>{}(s.Res) );
-            result_type const h2 ( std::hash<std::string>{}(s.Name) );
-            return h1 ^ (h2 << 1); // or use boost::hash_combine (see Discussion)
-        }
+        size_t FirstFrame = 0;
+        float FirstTime = 0.0f;
     };
-}
 
-namespace libmd
-{
-    // A snapshot of a frame of a trajectory. This is only
-    // constructable by using filterFrame(), or copying.
+    // A snapshot of a frame of a trajectory. It is filled by
+    // filterFrame(). A snapshot that is filled again and again keeps
+    // its buffers, so that once they fit the frames, filling it does
+    // not allocate.
     //
     // Has the same interface with Trajectory, minus the file-related
-    // part.
+    // part. A snapshot is a view of the frame it is taken from: it
+    // has the coordinates of its own atoms, and their indices in the
+    // topology, which it shares with that frame. Names are looked up
+    // through the topology, so taking a snapshot never copies them.
     class TrajectorySnapshot
     {
     public:
-        TrajectorySnapshot() = delete;
-        TrajectorySnapshot(const TrajectorySnapshot& from);
-        TrajectorySnapshot& operator=(TrajectorySnapshot from);
-
-        V3Map& vec(const AtomIdentifier& atom_name)
+        // An empty snapshot, of no topology, to be filled by
+        // filterFrame().
+        TrajectorySnapshot() = default;
+        TrajectorySnapshot(const TrajectorySnapshot& from) = default;
+        TrajectorySnapshot(TrajectorySnapshot&& from) = default;
+        TrajectorySnapshot& operator=(const TrajectorySnapshot& from) = default;
+        TrajectorySnapshot& operator=(TrajectorySnapshot&& from) = default;
+
+        // The coordinates are a view into coords(), which is
+        // structure-of-arrays. Throws std::out_of_range if the atom
+        // is not in the snapshot.
+        V3Map vec(const AtomIdentifier& atom_name)
         {
-            // It is dangerous to use AtomNamesReverse[atom_name]
-            // here. Because if atom_name does not exist, it would
-            // create a new element in the map and initilize it with
-            // 0!!! And this would return the 0th vector!!!
-            return Vecs[AtomNamesReverse.at(atom_name)];
+            return Coords.vec(position(atom_name));
         }
 
-        const V3Map& vec(const AtomIdentifier& atom_name) const
+        const V3Map vec(const AtomIdentifier& atom_name) const
         {
-            return Vecs[AtomNamesReverse.at(atom_name)];
+            return Coords.vec(position(atom_name));
         }
 
-        V3Map& vec(size_t i)
+        V3Map vec(size_t i)
         {
-            return Vecs[i];
+            return Coords.vec(i);
         }
 
-        const V3Map& vec(size_t i) const
+        const V3Map vec(size_t i) const
         {
-            return Vecs[i];
+            return Coords.vec(i);
         }
 
         const AtomIdentifier& atomId(size_t i) const
         {
-            return AtomNames[i];
+            return Topo->atom(Indices[i]);
         }
 
-        const XtcFile::FrameMeta& meta() const { return Meta; }
-        bool hasAtom(const AtomIdentifier& name)
+        // The index in the topology of the ith atom. These are in
+        // ascending order.
+        size_t atomIndex(size_t i) const { return Indices[i]; }
+        // The index of the atom that is atom “atom” of the topology,
+        // or size() if it is not in the snapshot.
+        size_t find(size_t atom) const
         {
-            return AtomNamesReverse.find(name) != std::end(AtomNamesReverse);
+            auto Found = std::lower_bound(std::begin(Indices), std::end(Indices), atom);
+            if(Found == std::end(Indices) || *Found != atom)
+            {
+                return size();
+            }
+            return Found - std::begin(Indices);
         }
 
-        size_t size() const { return Vecs.size(); }
-
-        const std::vector<float>& data() const
+        const XtcFile::FrameMeta& meta() const { return Meta; }
+        bool hasAtom(const AtomIdentifier& name) const
         {
-            return Data;
+            const size_t Atom = Topo->find(name);
+            return Atom < Topo->size() && find(Atom) < size();
         }
 
-        const std::vector<V3Map>& vecs() const
+        size_t size() const { return Coords.size(); }
+
+        // All the atoms of the trajectory this is taken from, not
+        // only those in the snapshot.
+        const Topology& topology() const { return *Topo; }
+
+        // Call f(i) for the index i of every atom.
+        template <class F> void forEachAtom(F f) const
         {
-            return Vecs;
+            for(size_t i = 0; i < Coords.size(); i++)
+            {
+                f(i);
+            }
         }
 
+        Coordinates& coords() { return Coords; }
+        const Coordinates& coords() const { return Coords; }
+
         std::string debugString() const;
 
         friend void swap(TrajectorySnapshot& a, TrajectorySnapshot& b) // nothrow
@@ -148,25 +181,32 @@ namespace libmd
 
             // by swapping the members of two objects,
             // the two objects are effectively swapped
-            swap(a.AtomNames, b.AtomNames);
-            swap(a.AtomNamesReverse, b.AtomNamesReverse);
+            swap(a.Topo, b.Topo);
+            swap(a.Indices, b.Indices);
             swap(a.Meta, b.Meta);
-            swap(a.Data, b.Data);
-            swap(a.Vecs, b.Vecs);
+            swap(a.Coords, b.Coords);
         }
 
     private:
-        TrajectorySnapshot(size_t size)
-                : AtomNames(size), Data(size*3) {}
+        // The position in the snapshot of atom “atom_name”.
+        size_t position(const AtomIdentifier& atom_name) const
+        {
+            const size_t i = find(Topo->index(atom_name));
+            if(i == size())
+            {
+                throw std::out_of_range("Atom not in snapshot: " + atom_name.toStr());
+            }
+            return i;
+        }
 
-        std::vector<AtomIdentifier> AtomNames;
-        std::unordered_map<AtomIdentifier, size_t> AtomNamesReverse;
-        XtcFile::FrameMeta Meta;
-        std::vector<float> Data;
-        std::vector<V3Map> Vecs;
+        TopologyPtr Topo;
+        std::vector<uint32_t> Indices;
+        XtcFile::FrameMeta Meta = {};
+        Coordinates Coords;
 
         template <class FrameType, class FilterFunc> friend
-        TrajectorySnapshot filterFrame(const FrameType& frame, FilterFunc func);
+        void filterFrame(const FrameType& frame, FilterFunc func,
+                         TrajectorySnapshot& result);
     };
 
     // This wraps a XtcFile class and provides high level access
@@ -174,98 +214,198 @@ namespace libmd
     // of this and the snapshot type.
     //
     // This class does not care about boxes and boundary conditions.
+    //
+    // The trajectory can also be a FrameCache, which is recognized by
+    // its content, and read without decoding.
     class Trajectory
     {
     public:
-        void open(const std::string& xtc_path, const std::string& gro_path);
+        void open(const std::string& xtc_path, const std::string& gro_path,
+                  XtcFile::IoMode mode = XtcFile::STREAM,
+                  const PrefetchOptions& prefetch = PrefetchOptions());
+        // Open another reader of xtc_path with the same atoms and
+        // prefetch options as “like”, without reading the GRO file
+        // again.
+        void open(const std::string& xtc_path, const Trajectory& like,
+                  XtcFile::IoMode mode = XtcFile::STREAM);
         // Return false if EOF is reached.
         bool nextFrame();
-        // The number of times nextFrame() is called.
-        size_t countFrames() { return FrameCount; }
-
-        V3Map& vec(const AtomIdentifier& atom_name)
+        // Move past the next frame without decoding it. This does not
+        // change the current frame, or countFrames(). Return false if
+        // EOF is reached.
+        bool skipFrame();
+        // The header of the next frame, without moving past it.
+        XtcFile::FrameMeta peekMeta()
         {
-            // It is dangerous to use AtomNamesReverse[atom_name]
-            // here. Because if atom_name does not exist, it would
-            // create a new element in the map and initilize it with
-            // 0!!! And this would return the 0th vector!!!
-            return Vecs[AtomNamesReverse.at(atom_name)];
+            return Cache.isOpen() ? Cache.meta(CacheFrame) : f.readFrameMeta();
         }
-
-        const V3Map& vec(const AtomIdentifier& atom_name) const
+        bool eof()
         {
-            return Vecs[AtomNamesReverse.at(atom_name)];
+            return Cache.isOpen() ? CacheFrame >= Cache.frameCount() : f.eof();
         }
-
-        V3Map& vec(size_t i)
+        // See XtcFile::frameComplete() and XtcFile::refresh(). These
+        // are for following a trajectory that is still being written.
+        bool frameComplete() { return Cache.isOpen() ? !eof() : f.frameComplete(); }
+        void refresh()
         {
-            return Vecs[i];
+            if(!Cache.isOpen())
+            {
+                f.refresh();
+            }
         }
-
-        const V3Map& vec(size_t i) const
+        // See XtcFile::index(). Not to be confused with index(name).
+        const XtcIndex& frameIndex()
+        {
+            return Cache.isOpen() ? Cache.index() : f.index();
+        }
+        // See XtcFile::seekable().
+        bool seekable() const { return Cache.isOpen() || f.seekable(); }
+
+        // Only decode the first n atoms of each frame. The rest of
+        // the atoms are still known by name, but have no coordinates:
+        // size() and meta().AtomCount become n, and hasAtom() is false
+        // for them. This takes effect from the next frame, and is
+        // carried over to readers opened “like” this one.
+        void limitAtoms(size_t n);
+        size_t atomLimit() const { return AtomLimit; }
+
+        // Only decode the atoms of each frame that pass “filter” (see
+        // AtomPrefilter). The coordinates of the other atoms are
+        // stale, so they are left out of forEachAtom(), and therefore
+        // out of filterFrame() and snapshot(). Like limitAtoms(), this
+        // takes effect from the next frame, and is carried over to
+        // readers opened “like” this one.
+        void prefilter(const AtomPrefilter& filter);
+
+        // Call f(i) for the index i of every atom with coordinates in
+        // the current frame.
+        template <class F> void forEachAtom(F f) const
+        {
+            if(!Prefilter.empty())
+            {
+                for(uint32_t i: Candidates)
+                {
+                    f(i);
+                }
+                return;
+            }
+            for(size_t i = 0; i < Coords.size(); i++)
+            {
+                f(i);
+            }
+        }
+        // The number of times nextFrame() is called.
+        size_t countFrames() { return FrameCount; }
+        // Go back to the first frame, as if the trajectory was just
+        // opened. This resets countFrames().
+        void rewind();
+        // Make the nth frame (0-based) the one to be read by the next
+        // nextFrame(). This uses the frame index of the XTC file.
+        void seekFrame(size_t n);
+        // Make the first frame that begins at or after byte offset
+        // “offset” the next one to read. Return false if there is no
+        // such frame. See XtcFile::syncToFrame().
+        bool syncToFrame(uint64_t offset);
+        // Byte offset of the next frame to read.
+        uint64_t tell()
         {
-            return Vecs[i];
+            return Cache.isOpen() ? Cache.offset(CacheFrame) : f.tell();
         }
+        uint64_t fileSize() { return Cache.isOpen() ? Cache.size() : f.fileSize(); }
 
-        const AtomIdentifier& atomId(size_t i) const
+        // Throws std::out_of_range if there is no such atom.
+        V3Map vec(const AtomIdentifier& atom_name)
         {
-            return AtomNames[i];
+            return Coords.vec(Topo->index(atom_name));
         }
 
-        const XtcFile::FrameMeta& meta() const { return Meta; }
+        const V3Map vec(const AtomIdentifier& atom_name) const
+        {
+            return Coords.vec(Topo->index(atom_name));
+        }
 
-        const std::unordered_map<AtomIdentifier, size_t>& atoms() const
+        V3Map vec(size_t i)
         {
-            return AtomNamesReverse;
+            return Coords.vec(i);
         }
 
-        bool hasAtom(const AtomIdentifier& name)
+        const V3Map vec(size_t i) const
         {
-            return AtomNamesReverse.find(name) != std::end(AtomNamesReverse);
+            return Coords.vec(i);
         }
 
-        size_t index(const AtomIdentifier& name)
+        const AtomIdentifier& atomId(size_t i) const
         {
-            return AtomNamesReverse.at(name);
+            return Topo->atom(i);
         }
 
-        size_t size() const { return Vecs.size(); }
+        // See TrajectorySnapshot::atomIndex() and find(). The atoms of
+        // a trajectory are those of its topology.
+        size_t atomIndex(size_t i) const { return i; }
+        size_t find(size_t atom) const { return std::min(atom, Coords.size()); }
+
+        // All the atoms of the structure, including those limitAtoms()
+        // leaves out. This is made once by open(), and shared with
+        // the snapshots of the trajectory, and with readers opened
+        // “like” it.
+        const Topology& topology() const { return *Topo; }
 
-        const std::vector<float>& data() const
+        const XtcFile::FrameMeta& meta() const { return Meta; }
+
+        bool hasAtom(const AtomIdentifier& name) const
         {
-            return Data;
+            return Topo->find(name) < Coords.size();
         }
 
-        const std::vector<V3Map>& vecs() const
+        size_t index(const AtomIdentifier& name) const
         {
-            return Vecs;
+            return Topo->index(name);
         }
 
+        size_t size() const { return Coords.size(); }
+
+        Coordinates& coords() { return Coords; }
+        const Coordinates& coords() const { return Coords; }
+
         void close();
         void clear();
         std::string debugString() const;
 
         TrajectorySnapshot snapshot() const
         {
-            return filterFrame(*this, [](auto& _1, auto& _2, auto& _3)
-                               { UNUSED(_1);UNUSED(_2);UNUSED(_3); return true;});
+            TrajectorySnapshot Snap;
+            snapshot(Snap);
+            return Snap;
+        }
+        // The same, into “into”, reusing its buffers.
+        void snapshot(TrajectorySnapshot& into) const
+        {
+            filterFrame(*this, [](auto& _1, auto& _2, auto& _3)
+                        { UNUSED(_1);UNUSED(_2);UNUSED(_3); return true;}, into);
         }
 
     private:
-        std::vector<AtomIdentifier> AtomNames;
-        std::unordered_map<AtomIdentifier, size_t> AtomNamesReverse;
+        void openXtc(const std::string& xtc_path, XtcFile::IoMode mode);
+
+        TopologyPtr Topo = std::make_shared<const Topology>();
         XtcFile f;
+        // Used instead of f if the trajectory is a FrameCache.
+        FrameCache Cache;
+        // The next frame to read from Cache.
+        size_t CacheFrame = 0;
         XtcFile::FrameMeta Meta;
 
-        // Just a somewhat unrelated FYI: the memory layout of an
-        // array of N Eigen Vector3f’s is not nessesarily the same as
-        // an array of 3N floats, because of alignment.
-        std::vector<float> Data;
-        std::vector<V3Map> Vecs;
+        Coordinates Coords;
         size_t FrameCount;
+        size_t AtomLimit = std::numeric_limits<size_t>::max();
+        AtomPrefilter Prefilter;
+        PrefetchOptions Prefetch;
+        // Atoms that survived Prefilter in the current frame.
+        std::vector<uint32_t> Candidates;
 
         template <class FrameType, class FilterFunc> friend
-        TrajectorySnapshot filterFrame(const FrameType& frame, FilterFunc func);
+        void filterFrame(const FrameType& frame, FilterFunc func,
+                         TrajectorySnapshot& result);
     };
 
     // Filter the atoms by “func”. The argument “func” is a callable
@@ -277,51 +417,57 @@ namespace libmd
     //
     //   bool func(const AtomIdentifier&, size_t, const V3Map&)
     //
-    // This does not change meta(), but it does change size().
+    // This does not change meta(), but it does change size(). Only the
+    // coordinates of the atoms that survive are copied.
+    //
+    // The snapshot is put in “result”, which must not be “frame”.
+    // Whatever “result” had is replaced, but its buffers are reused.
     template <class FrameType, class FilterFunc>
-    TrajectorySnapshot filterFrame(const FrameType& frame, FilterFunc func)
+    void filterFrame(const FrameType& frame, FilterFunc func,
+                     TrajectorySnapshot& result)
     {
         static_assert(std::is_same<FrameType, Trajectory>::value ||
                       std::is_same<FrameType, TrajectorySnapshot>::value,
                       "FrameType can only be either Trajectory or "
                       "TrajectorySnapshot");
 
-        std::vector<size_t> Passed;
-        for(size_t i = 0; i < frame.Vecs.size(); i++)
+        auto& Snap = result;
+        Snap.Topo = frame.Topo;
+        // The surviving atoms, by their index in “frame” for now.
+        auto& Passed = Snap.Indices;
+        Passed.clear();
+        frame.forEachAtom([&](size_t i)
         {
-            if(func(frame.AtomNames[i], i, frame.Vecs[i]))
+            if(func(frame.atomId(i), i, frame.vec(i)))
             {
                 Passed.push_back(i);
             }
-        }
-        TrajectorySnapshot Snap(Passed.size());
+        });
         Snap.Meta = frame.Meta;
         Snap.Meta.AtomCount = Passed.size();
+        Snap.Coords.resize(Passed.size());
+
+        const float* X = frame.Coords.x();
+        const float* Y = frame.Coords.y();
+        const float* Z = frame.Coords.z();
+        float* SnapX = Snap.Coords.x();
+        float* SnapY = Snap.Coords.y();
+        float* SnapZ = Snap.Coords.z();
         for(size_t i = 0; i < Passed.size(); i++)
         {
-            Snap.AtomNames[i] = frame.AtomNames[Passed[i]];
-        }
-
-        for(size_t i = 0; i < Passed.size(); i++)
-        {
-            const size_t NewIdx = Passed[i];
-            Snap.Data[i*3] = frame.Data[NewIdx*3];
-            Snap.Data[i*3+1] = frame.Data[NewIdx*3+1];
-            Snap.Data[i*3+2] = frame.Data[NewIdx*3+2];
-        }
-        // Rebuild AtomNamesReverse and Vecs.
-        Snap.AtomNamesReverse.clear();
-        for(size_t i = 0; i < Snap.AtomNames.size(); i++)
-        {
-            Snap.AtomNamesReverse[Snap.AtomNames[i]] = i;
-        }
-
-        Snap.Vecs.clear();
-        for(size_t i = 0; i < Snap.AtomNames.size(); i++)
-        {
-            Snap.Vecs.emplace_back(&(Snap.Data[i*3]));
+            SnapX[i] = X[Passed[i]];
+            SnapY[i] = Y[Passed[i]];
+            SnapZ[i] = Z[Passed[i]];
+            Passed[i] = frame.atomIndex(Passed[i]);
         }
+    }
 
+    // The same, into a new snapshot.
+    template <class FrameType, class FilterFunc>
+    TrajectorySnapshot filterFrame(const FrameType& frame, FilterFunc func)
+    {
+        TrajectorySnapshot Snap;
+        filterFrame(frame, func, Snap);
         return Snap;
     }
 
@@ -14,6 +14,8 @@
 // along with this program. If not, see
 // <https://www.gnu.org/licenses/>.
 
+#include <glob.h>
+
 #include "utils.h"
 
 namespace libmd
@@ -31,4 +33,20 @@ namespace libmd
 
         return str.substr(StrBegin, StrRange);
     }
+
+    std::vector<std::string> expandPath(const std::string& pattern)
+    {
+        glob_t Matches;
+        // glob() sorts the matches, so numbered parts come in order.
+        if(glob(pattern.c_str(), GLOB_NOCHECK, nullptr, &Matches) != 0)
+        {
+            // There may be some matches from before the error.
+            globfree(&Matches);
+            return { pattern };
+        }
+        std::vector<std::string> Result(Matches.gl_pathv,
+                                        Matches.gl_pathv + Matches.gl_pathc);
+        globfree(&Matches);
+        return Result;
+    }
 }
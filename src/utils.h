@@ -18,18 +18,100 @@
 #ifndef SDF_UTILS_H
 #define SDF_UTILS_H
 
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
 #include <Eigen/Dense>
 
 #define UNUSED(x) (void)(x)
 
 namespace libmd
 {
-    using V3Map = Eigen::Map<Eigen::Vector3f>;
-    using VecRefType = Eigen::Ref<Eigen::Vector3f>;
+    // The coordinates of an atom, where x, y and z are “stride()”
+    // floats apart (see Coordinates).
+    using V3Map = Eigen::Map<Eigen::Vector3f, 0, Eigen::InnerStride<>>;
+    using VecRefType = Eigen::Ref<const Eigen::Vector3f, 0, Eigen::InnerStride<>>;
+
+    // An allocator for std::vector whose memory is aligned to 64
+    // bytes, which is a cache line, and the widest SIMD register.
+    //
+    // The memory comes from operator new like any other, so that
+    // allocations can be counted (see test/alloccount.h). It is over
+    // allocated and aligned by hand, and the pointer to free is kept
+    // right before the aligned block.
+    template <typename T>
+    struct AlignedAllocator
+    {
+        using value_type = T;
+        static const size_t ALIGNMENT = 64;
+
+        AlignedAllocator() = default;
+        template <typename U> AlignedAllocator(const AlignedAllocator<U>&) {}
+
+        T* allocate(size_t n)
+        {
+            void* Raw = ::operator new(n * sizeof(T) + ALIGNMENT);
+            // operator new aligns to at least alignof(max_align_t), so
+            // there is always room for the pointer.
+            const uintptr_t Aligned =
+                (reinterpret_cast<uintptr_t>(Raw) + ALIGNMENT) & ~uintptr_t(ALIGNMENT - 1);
+            reinterpret_cast<void**>(Aligned)[-1] = Raw;
+            return reinterpret_cast<T*>(Aligned);
+        }
+        void deallocate(T* ptr, size_t)
+        {
+            ::operator delete(reinterpret_cast<void**>(ptr)[-1]);
+        }
+
+        template <typename U> bool operator==(const AlignedAllocator<U>&) const
+        {
+            return true;
+        }
+        template <typename U> bool operator!=(const AlignedAllocator<U>&) const
+        {
+            return false;
+        }
+    };
+
+    // Scratch space that is reused from frame to frame. It only ever
+    // grows, so once it has seen the largest frame it never allocates
+    // again. The number of times it grew is counted, so that this can
+    // be checked.
+    template <typename T>
+    class ScratchBuffer
+    {
+    public:
+        // Return room for at least n elements. The content is
+        // unspecified.
+        T* get(size_t n)
+        {
+            if(n > Data.size())
+            {
+                Data.resize(n);
+                Growths++;
+            }
+            return Data.data();
+        }
+
+        size_t capacity() const { return Data.size(); }
+        size_t growths() const { return Growths; }
+
+    private:
+        std::vector<T> Data;
+        size_t Growths = 0;
+    };
 
     // Equivalent of Python’s str.strip().
     std::string strip(const std::string& str,
                       const std::string& whitespace = " \t\n");
+
+    // The paths matching a shell wildcard pattern, sorted. A pattern
+    // without matches is returned as it is, so that opening it gives
+    // a sensible error.
+    std::vector<std::string> expandPath(const std::string& pattern);
 }
 
 #endif
@@ -0,0 +1,140 @@
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "xtcindex.h"
+
+namespace libmd
+{
+    namespace
+    {
+        constexpr char INDEX_MAGIC[8] = {'S', 'D', 'F', 'X', 'I', 'D', 'X', '1'};
+
+        struct IndexHeader
+        {
+            char Magic[8];
+            uint64_t EntrySize;
+            uint64_t SourceSize;
+            int64_t SourceMTime;
+            uint64_t Count;
+        };
+    } // namespace
+
+    FileFingerprint FileFingerprint :: of(const std::string& path)
+    {
+        struct stat Info;
+        if(stat(path.c_str(), &Info) != 0)
+        {
+            throw std::runtime_error("Failed to stat " + path);
+        }
+        FileFingerprint Result;
+        Result.Size = static_cast<uint64_t>(Info.st_size);
+        Result.MTime = static_cast<int64_t>(Info.st_mtime);
+        return Result;
+    }
+
+    bool XtcIndex :: load(const std::string& path,
+                          const FileFingerprint& expected)
+    {
+        std::ifstream File(path, std::ios::binary);
+        if(!File)
+        {
+            return false;
+        }
+
+        IndexHeader Header;
+        if(!File.read(reinterpret_cast<char*>(&Header), sizeof(Header)))
+        {
+            return false;
+        }
+        if(std::memcmp(Header.Magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 ||
+           Header.EntrySize != sizeof(Entry) ||
+           Header.SourceSize != expected.Size ||
+           Header.SourceMTime != expected.MTime)
+        {
+            return false;
+        }
+
+        std::vector<Entry> Loaded(Header.Count);
+        if(!File.read(reinterpret_cast<char*>(Loaded.data()),
+                      sizeof(Entry) * Header.Count))
+        {
+            return false;
+        }
+        Entries = std::move(Loaded);
+        Source = expected;
+        return true;
+    }
+
+    bool XtcIndex :: save(const std::string& path) const
+    {
+        IndexHeader Header;
+        std::memcpy(Header.Magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+        Header.EntrySize = sizeof(Entry);
+        Header.SourceSize = Source.Size;
+        Header.SourceMTime = Source.MTime;
+        Header.Count = Entries.size();
+
+        const std::string TmpPath = path + ".tmp." + std::to_string(getpid());
+        {
+            std::ofstream File(TmpPath, std::ios::binary | std::ios::trunc);
+            if(!File)
+            {
+                return false;
+            }
+            File.write(reinterpret_cast<const char*>(&Header), sizeof(Header));
+            File.write(reinterpret_cast<const char*>(Entries.data()),
+                       sizeof(Entry) * Entries.size());
+            if(!File)
+            {
+                File.close();
+                std::remove(TmpPath.c_str());
+                return false;
+            }
+        }
+        if(std::rename(TmpPath.c_str(), path.c_str()) != 0)
+        {
+            std::remove(TmpPath.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    size_t XtcIndex :: findTime(float t) const
+    {
+        auto Found = std::lower_bound(
+            std::begin(Entries), std::end(Entries), t,
+            [](const Entry& e, float time) { return e.Time < time; });
+        return Found - std::begin(Entries);
+    }
+
+    size_t XtcIndex :: findOffset(uint64_t offset) const
+    {
+        auto Found = std::lower_bound(
+            std::begin(Entries), std::end(Entries), offset,
+            [](const Entry& e, uint64_t pos) { return e.Offset < pos; });
+        return Found - std::begin(Entries);
+    }
+
+} // namespace libmd
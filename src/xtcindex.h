@@ -0,0 +1,100 @@
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef SDF_XTCINDEX_H
+#define SDF_XTCINDEX_H
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace libmd
+{
+    // Identifies a particular version of a file on disk. If either
+    // the size or the modification time changes, anything derived
+    // from the file is considered stale.
+    struct FileFingerprint
+    {
+        uint64_t Size = 0;
+        int64_t MTime = 0;
+
+        // Throws if the file cannot be stat’ed.
+        static FileFingerprint of(const std::string& path);
+
+        bool operator==(const FileFingerprint& rhs) const
+        {
+            return Size == rhs.Size && MTime == rhs.MTime;
+        }
+        bool operator!=(const FileFingerprint& rhs) const
+        {
+            return !(*this == rhs);
+        }
+    };
+
+    // The byte offset and header of every frame in an XTC file. This
+    // is what makes random access into a trajectory possible. It is
+    // persisted in a sidecar file next to the trajectory, so that the
+    // sequential scan is only paid once.
+    //
+    // The sidecar is a private cache, so it is written in native byte
+    // order.
+    class XtcIndex
+    {
+    public:
+        struct Entry
+        {
+            uint64_t Offset;
+            int32_t Step;
+            float Time;
+            std::array<std::array<float, 3>, 3> BoxDim;
+        };
+
+        static std::string sidecarPath(const std::string& xtc_path)
+        {
+            return xtc_path + ".sdfidx";
+        }
+
+        // Return false if the file does not exist, is malformed, or
+        // was built from a different version of the trajectory.
+        bool load(const std::string& path, const FileFingerprint& expected);
+        // Return false if the file cannot be written. The write is
+        // atomic, so a concurrent reader never sees a partial index.
+        bool save(const std::string& path) const;
+
+        void clear() { Entries.clear(); }
+        void add(const Entry& e) { Entries.push_back(e); }
+        size_t size() const { return Entries.size(); }
+        bool empty() const { return Entries.empty(); }
+        const Entry& operator[](size_t i) const { return Entries[i]; }
+
+        // Index of the first frame whose time is not less than t.
+        // This assumes time increases monotonically along the
+        // trajectory. Return size() if there is no such frame.
+        size_t findTime(float t) const;
+        // Index of the first frame that begins at or after byte
+        // offset “offset”. Return size() if there is no such frame.
+        size_t findOffset(uint64_t offset) const;
+
+        FileFingerprint Source;
+
+    private:
+        std::vector<Entry> Entries;
+    };
+
+} // namespace libmd
+
+#endif
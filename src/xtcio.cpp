@@ -14,10 +14,16 @@
 // along with this program. If not, see
 // <https://www.gnu.org/licenses/>.
 
+#include <algorithm>
+#include <limits>
+#include <numeric>
 #include <exception>
+#include <stdexcept>
 #include <vector>
 #include <sstream>
 
+#include "bitreader.h"
+#include "simd.h"
 #include "xtcio.h"
 
 namespace libmd
@@ -94,96 +100,34 @@ namespace libmd
 
         }
 
-        // Shamelessly copied from
-        // https://github.com/wesbarnett/libxdrfile/blob/master/src/xdrfile.c.
-        //
-/*
- * decodebits - decode number from buf using specified number of bits
- *
- * extract the number of bits from the array buf and construct an integer
- * from it. Return that value.
- *
- */
-
-        static int32_t decodebits(int32_t buf[], int32_t num_of_bits)
-        {
-            int32_t cnt, num;
-            uint32_t lastbits, lastbyte;
-            unsigned char * cbuf;
-            int32_t mask = (1 << num_of_bits) -1;
-            cbuf = ((unsigned char *)buf) + 3 * sizeof(*buf);
-            cnt = buf[0];
-            lastbits = (uint32_t) buf[1];
-            lastbyte = (uint32_t) buf[2];
-
-            num = 0;
-            while (num_of_bits >= 8)
-            {
-                lastbyte = ( lastbyte << 8 ) | cbuf[cnt++];
-                num |=  (lastbyte >> lastbits) << (num_of_bits - 8);
-                num_of_bits -=8;
-            }
-            if (num_of_bits > 0)
+        constexpr int32_t magicints[] =
             {
-                if (lastbits < static_cast<uint32_t>(num_of_bits))
-                {
-                    lastbits += 8;
-                    lastbyte = (lastbyte << 8) | cbuf[cnt++];
-                }
-                lastbits -= num_of_bits;
-                num |= (lastbyte >> lastbits) & ((1 << num_of_bits) -1);
-            }
-            num &= mask;
-            buf[0] = cnt;
-            buf[1] = lastbits;
-            buf[2] = lastbyte;
-            return num;
-        }
+                0, 0, 0, 0, 0, 0, 0, 0, 0, 8, 10, 12, 16, 20, 25, 32, 40, 50, 64,
+                80, 101, 128, 161, 203, 256, 322, 406, 512, 645, 812, 1024, 1290,
+                1625, 2048, 2580, 3250, 4096, 5060, 6501, 8192, 10321, 13003,
+                16384, 20642, 26007, 32768, 41285, 52015, 65536,82570, 104031,
+                131072, 165140, 208063, 262144, 330280, 416127, 524287, 660561,
+                832255, 1048576, 1321122, 1664510, 2097152, 2642245, 3329021,
+                4194304, 5284491, 6658042, 8388607, 10568983, 13316085, 16777216
+            };
 
-        // Shamelessly copied from
-        // https://github.com/wesbarnett/libxdrfile/blob/master/src/xdrfile.c.
-        //
-/*
- * decodeints - decode 'small' integers from the buf array
- *
- * this routine is the inverse from encodeints() and decodes the small integers
- * written to buf by calculating the remainder and doing divisions with
- * the given sizes[]. You need to specify the total number of bits to be
- * used from buf in num_of_bits.
- *
- */
+        constexpr int32_t FIRSTIDX = 9;
+        constexpr int32_t LASTIDX = sizeof(magicints) / sizeof(*magicints);
 
-        static void decodeints(int32_t buf[], int32_t num_of_ints, int32_t num_of_bits,
-                   uint32_t sizes[], int32_t nums[])
+        // The divisors of the run-length encoded small integers, for
+        // each value of smallidx.
+        const std::array<Divisor, LASTIDX>& smallDivisors()
         {
-            int32_t bytes[32];
-            int32_t i, j, num_of_bytes, p, num;
-
-            bytes[1] = bytes[2] = bytes[3] = 0;
-            num_of_bytes = 0;
-            while (num_of_bits > 8)
-            {
-                int32_t x = decodebits(buf, 8);
-                bytes[num_of_bytes++] = x;
-                num_of_bits -= 8;
-            }
-            if (num_of_bits > 0)
+            static const std::array<Divisor, LASTIDX> Table = []()
             {
-                bytes[num_of_bytes++] = decodebits(buf, num_of_bits);
-            }
-            for (i = num_of_ints-1; i > 0; i--)
-            {
-                num = 0;
-                for (j = num_of_bytes-1; j >=0; j--)
+                std::array<Divisor, LASTIDX> Result;
+                for(int32_t i = 0; i < LASTIDX; i++)
                 {
-                    num = (num << 8) | bytes[j];
-                    p = num / sizes[i];
-                    bytes[j] = p;
-                    num = num - p * sizes[i];
+                    Result[i] = Divisor(magicints[i]);
                 }
-                nums[i] = num;
-            }
-            nums[0] = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (bytes[3] << 24);
+                return Result;
+            }();
+            return Table;
         }
     } // namespace
 
@@ -193,69 +137,78 @@ namespace libmd
     /* Compressed coordinate routines - modified from the original
      * implementation by Frans v. Hoesel to make them threadsafe.
      */
+    //
+    // Modified to read the bit stream with a BitReader, and to unpack
+    // the integer triples with 64-bit arithmetic whenever they fit.
+    // The result is identical to that of the original. Also modified
+    // to write the coordinates in any CoordLayout.
     int32_t XtcFile :: xdrfile_decompress_coord_float(
-        float* ptr, int* size, float* precision)
+        const CoordLayout& out, int* size, float* precision, int32_t max_atoms,
+        const BoxDimType& box, const AtomPrefilter* filter,
+        std::vector<uint32_t>* kept)
     {
-        if(ptr == nullptr)
+        if(out.X == nullptr)
             return -1;
 
-        constexpr int32_t magicints[] =
-            {
-                0, 0, 0, 0, 0, 0, 0, 0, 0, 8, 10, 12, 16, 20, 25, 32, 40, 50, 64,
-                80, 101, 128, 161, 203, 256, 322, 406, 512, 645, 812, 1024, 1290,
-                1625, 2048, 2580, 3250, 4096, 5060, 6501, 8192, 10321, 13003,
-                16384, 20642, 26007, 32768, 41285, 52015, 65536,82570, 104031,
-                131072, 165140, 208063, 262144, 330280, 416127, 524287, 660561,
-                832255, 1048576, 1321122, 1664510, 2097152, 2642245, 3329021,
-                4194304, 5284491, 6658042, 8388607, 10568983, 13316085, 16777216
-            };
-
-        constexpr int32_t FIRSTIDX = 9;
-
         /* note that magicints[FIRSTIDX-1] == 0 */
-        // constexpr int32_t LASTIDX = (sizeof(magicints) / sizeof(*magicints));
 
-        int32_t minint[3], maxint[3], *lip;
+        int32_t minint[3], maxint[3];
         int32_t smallidx;
-        uint32_t sizeint[3], sizesmall[3], bitsizeint[3], size3;
-        int32_t k, *buf1, lsize, flag;
+        uint32_t sizeint[3], bitsizeint[3];
+        size_t size3;
+        int32_t k, lsize, flag;
         int32_t smallnum, smaller, i, is_smaller, run;
-        float *lfp, inv_precision;
-        int32_t tmp, *thiscoord,  prevcoord[3];
+        int32_t *lip;
+        float inv_precision;
+        int32_t tmp, thiscoord[3], prevcoord[3];
         uint32_t bitsize;
 
         bitsizeint[0] = 0;
         bitsizeint[1] = 0;
         bitsizeint[2] = 0;
 
-        read(&lsize);
-        if (*size < lsize)
+        if(!read(&lsize))
+        {
+            return -1;
+        }
+        if (lsize < 0 || *size < lsize)
         {
             fprintf(stderr, "Requested to decompress %d coords, file contains %d\n",
                     *size, lsize);
             return -1;
         }
         *size = lsize;
-        size3 = *size * 3;
-
-        std::vector<int> Buf1Body(size3, 0);
-        buf1 = Buf1Body.data();
-        // buf2 = (int *)malloc(sizeof(int)*buf2size);
-        std::array<int, 3> Buf2Header;
+        // Not in original xdrfile.c: no overflow for very large
+        // systems.
+        size3 = static_cast<size_t>(*size) * 3;
+        // Not in original xdrfile.c: only the first max_atoms atoms
+        // are wanted, and out only has room for them.
+        const int32_t Wanted = std::min(lsize, std::max(max_atoms, 0));
 
             /* Dont bother with compression for three atoms or less */
             if(*size<=9)
             {
-                read(ptr, size3);
+                float Raw[9 * 3];
+                if(!read(Raw, size3))
+                {
+                    return -1;
+                }
+                for(int32_t Atom = 0; Atom < Wanted; Atom++)
+                {
+                    out.set(Atom, Raw[Atom * 3], Raw[Atom * 3 + 1], Raw[Atom * 3 + 2]);
+                }
+                if(kept != nullptr)
+                {
+                    kept->resize(Wanted);
+                    std::iota(kept->begin(), kept->end(), 0);
+                }
                 /* return number of coords, not floats */
-                return size3 / 3;
+                return Wanted;
             }
 
         /* Compression-time if we got here. Read precision first */
         read(precision);
 
-        /* Buf2Header[0-2] are special and do not contain actual data */
-        Buf2Header[0] = Buf2Header[1] = Buf2Header[2] = 0;
         read(minint, 3);
         read(maxint, 3);
 
@@ -275,52 +228,62 @@ namespace libmd
         {
             bitsize = sizeofints(3, sizeint);
         }
+        const Divisor LargeDivisors[3] = {
+            Divisor(sizeint[0]), Divisor(sizeint[1]), Divisor(sizeint[2]) };
+        const auto& SmallDivisors = smallDivisors();
 
         read(&smallidx);
+        if(smallidx < FIRSTIDX || smallidx >= LASTIDX)
+        {
+            return -1;
+        }
 
-        tmp = smallidx+8;
         tmp = smallidx-1;
         tmp = (FIRSTIDX>tmp) ? FIRSTIDX : tmp;
         smaller = magicints[tmp] / 2;
         smallnum = magicints[smallidx] / 2;
-        sizesmall[0] = sizesmall[1] = sizesmall[2] = magicints[smallidx] ;
-
-        /* Buf2Header[0] holds the length in bytes */
 
-        read(Buf2Header.data());
-        // Not in original xdrfile.c: Pad to 4 bytes...?
-        if(Buf2Header[0] % 4 != 0)
+        /* The length of the payload in bytes */
+        uint64_t ByteCount;
+        if(!readByteCount(&ByteCount) ||
+           ByteCount > std::numeric_limits<size_t>::max() - 3)
         {
-            Buf2Header[0] = (Buf2Header[0] / 4 + 1) * 4;
+            return -1;
         }
+        // Not in original xdrfile.c: Pad to 4 bytes...?
+        ByteCount = (ByteCount + 3) / 4 * 4;
 
-        std::vector<int> Buf2Body(Buf2Header[0]/sizeof(int32_t) + 3 + 1, 0);
-        int* buf2 = Buf2Body.data();
-
-        File.read(reinterpret_cast<char*>(&(buf2[3])),
-                  static_cast<uint32_t>(Buf2Header[0]));
-        // if (xdrfile_read_opaque((char *)&(buf2[3]),(unsigned int)buf2[0],xfp) == 0)
-        //     return 0;
-        // buf2[0] = buf2[1] = buf2[2] = 0;
+        const unsigned char* Payload = viewBytes(ByteCount);
+        if(Payload == nullptr)
+        {
+            return -1;
+        }
+        BitReader buf2(Payload, ByteCount);
 
-        lfp = ptr;
+        // Decode to integers first, and turn them into floats in one
+        // pass at the end, which vectorizes.
+        int32_t* const Ints = IntBuffer.get(size3);
+        lip = Ints;
         inv_precision = 1.0 / * precision;
         run = 0;
         i = 0;
-        lip = buf1;
-        while ( i < lsize )
+        // The payload has already been moved past, so stopping early
+        // leaves the file at the next frame.
+        while ( i < Wanted )
         {
-            thiscoord = (int32_t *)(lip) + i * 3;
-
             if (bitsize == 0)
             {
-                thiscoord[0] = decodebits(buf2, bitsizeint[0]);
-                thiscoord[1] = decodebits(buf2, bitsizeint[1]);
-                thiscoord[2] = decodebits(buf2, bitsizeint[2]);
+                thiscoord[0] = buf2.read(bitsizeint[0]);
+                thiscoord[1] = buf2.read(bitsizeint[1]);
+                thiscoord[2] = buf2.read(bitsizeint[2]);
+            }
+            else if (bitsize <= 64)
+            {
+                decodeInts3(buf2, bitsize, LargeDivisors, thiscoord);
             }
             else
             {
-                decodeints(buf2, 3, bitsize, sizeint, thiscoord);
+                decodeIntsGeneric(buf2, 3, bitsize, sizeint, thiscoord);
             }
             i++;
             thiscoord[0] += minint[0];
@@ -331,21 +294,37 @@ namespace libmd
             prevcoord[1] = thiscoord[1];
             prevcoord[2] = thiscoord[2];
 
-            flag = decodebits(buf2, 1);
+            flag = buf2.read(1);
             is_smaller = 0;
             if (flag == 1)
             {
-                run = decodebits(buf2, 5);
+                run = buf2.read(5);
                 is_smaller = run % 3;
                 run -= is_smaller;
                 is_smaller--;
             }
             if (run > 0)
             {
-                thiscoord += 3;
+                if (i + run / 3 > lsize)
+                {
+                    return -1;
+                }
+                const Divisor& SmallDivisor = SmallDivisors[smallidx];
+                const uint32_t SmallSize[3] = {
+                    SmallDivisor.value(), SmallDivisor.value(), SmallDivisor.value() };
+                // The first atom of a run is swapped with the one
+                // before it, so the one before it is written after
+                // the first of the run is decoded.
                 for (k = 0; k < run; k+=3)
                 {
-                    decodeints(buf2, 3, smallidx, sizesmall, thiscoord);
+                    if (smallidx <= 64)
+                    {
+                        decodeSmallInts3(buf2, smallidx, SmallDivisor, thiscoord);
+                    }
+                    else
+                    {
+                        decodeIntsGeneric(buf2, 3, smallidx, SmallSize, thiscoord);
+                    }
                     i++;
                     thiscoord[0] += prevcoord[0] - smallnum;
                     thiscoord[1] += prevcoord[1] - smallnum;
@@ -360,26 +339,30 @@ namespace libmd
                         prevcoord[1] = tmp;
                         tmp = thiscoord[2]; thiscoord[2] = prevcoord[2];
                         prevcoord[2] = tmp;
-                        *lfp++ = prevcoord[0] * inv_precision;
-                        *lfp++ = prevcoord[1] * inv_precision;
-                        *lfp++ = prevcoord[2] * inv_precision;
+                        *lip++ = prevcoord[0];
+                        *lip++ = prevcoord[1];
+                        *lip++ = prevcoord[2];
                     } else {
                         prevcoord[0] = thiscoord[0];
                         prevcoord[1] = thiscoord[1];
                         prevcoord[2] = thiscoord[2];
                     }
-                    *lfp++ = thiscoord[0] * inv_precision;
-                    *lfp++ = thiscoord[1] * inv_precision;
-                    *lfp++ = thiscoord[2] * inv_precision;
+                    *lip++ = thiscoord[0];
+                    *lip++ = thiscoord[1];
+                    *lip++ = thiscoord[2];
                 }
             }
             else
             {
-                *lfp++ = thiscoord[0] * inv_precision;
-                *lfp++ = thiscoord[1] * inv_precision;
-                *lfp++ = thiscoord[2] * inv_precision;
+                *lip++ = thiscoord[0];
+                *lip++ = thiscoord[1];
+                *lip++ = thiscoord[2];
             }
             smallidx += is_smaller;
+            if (smallidx < FIRSTIDX || smallidx >= LASTIDX)
+            {
+                return -1;
+            }
             if (is_smaller < 0)
             {
                 smallnum = smaller;
@@ -398,33 +381,252 @@ namespace libmd
                 smaller = smallnum;
                 smallnum = magicints[smallidx] / 2;
             }
-            sizesmall[0] = sizesmall[1] = sizesmall[2] = magicints[smallidx] ;
         }
-        return *size;
+        if(filter == nullptr)
+        {
+            if(out.Step == 1)
+            {
+                dequantizePlanar(Ints, Wanted, inv_precision, out.X, out.Y, out.Z);
+            }
+            else if(out.Step == 3 && out.Y == out.X + 1 && out.Z == out.X + 2)
+            {
+                dequantize(Ints, static_cast<size_t>(Wanted) * 3, inv_precision, out.X);
+            }
+            else
+            {
+                for(int32_t Atom = 0; Atom < Wanted; Atom++)
+                {
+                    out.set(Atom, Ints[Atom * 3] * inv_precision,
+                            Ints[Atom * 3 + 1] * inv_precision,
+                            Ints[Atom * 3 + 2] * inv_precision);
+                }
+            }
+        }
+        else
+        {
+            filter->apply(Ints, Wanted, *precision, inv_precision, box, out, *kept);
+        }
+        return Wanted;
+    }
+
+    void XtcFile :: open(const char* filename, IoMode mode,
+                         const PrefetchOptions& prefetch)
+    {
+        close();
+        Path = filename;
+        RequestedMode = mode;
+        Prefetch = prefetch;
+        Index.clear();
+        IndexReady = false;
+
+        // Compressed files and pipes can only be read one way,
+        // whatever the mode.
+        if(SequentialReader::needed(Path))
+        {
+            Seq.open(Path);
+            return;
+        }
+        if(mode == MMAP && Map.open(Path))
+        {
+            Map.adviseSequential();
+            MapPos = 0;
+            MapPrefetched = 0;
+            return;
+        }
+        if(mode == ASYNC && Async.open(Path, prefetch))
+        {
+            return;
+        }
+        File.open(filename, std::ios::binary);
+    }
+
+    void XtcFile :: close()
+    {
+        Map.close();
+        Async.close();
+        Seq.close();
+        if(File.is_open())
+        {
+            File.close();
+        }
+        File.clear();
     }
 
-    void XtcFile :: open(const char* filename)
+    void XtcFile :: rewind()
     {
-        File.open(filename);
+        seek(0);
     }
 
     bool XtcFile :: eof()
     {
+        if(Map.isOpen())
+        {
+            return MapPos >= Map.size();
+        }
+        if(Async.isOpen())
+        {
+            return Async.eof();
+        }
+        if(Seq.isOpen())
+        {
+            return Seq.eof();
+        }
         return File.peek() == std::char_traits<char>::eof();
     }
 
+    bool XtcFile :: frameComplete()
+    {
+        if(Seq.isOpen())
+        {
+            return !Seq.eof();
+        }
+        // Magic, atom count, step, time, the box, and the atom count
+        // again.
+        constexpr uint64_t HEADER_SIZE = 14 * sizeof(int32_t);
+        const uint64_t Pos = tell();
+        const uint64_t FileEnd = fileSize();
+        if(Pos + HEADER_SIZE > FileEnd)
+        {
+            return false;
+        }
+        const auto Meta = readFrameMetaAndStay();
+        const bool Complete = skipFrameBody(Meta.AtomCount) && tell() <= FileEnd;
+        seek(Pos);
+        return Complete;
+    }
+
+    void XtcFile :: refresh()
+    {
+        if(Seq.isOpen())
+        {
+            return;
+        }
+        const uint64_t Pos = tell();
+        const std::string Reopened = Path;
+        open(Reopened.c_str(), RequestedMode, Prefetch);
+        seek(Pos);
+    }
+
+    const unsigned char* XtcFile :: viewBytes(size_t n)
+    {
+        if(Map.isOpen())
+        {
+            if(MapPos + n > Map.size())
+            {
+                return nullptr;
+            }
+            // Keep the kernel reading a few frames ahead of us.
+            if(MapPos + n > MapPrefetched)
+            {
+                const uint64_t Window = std::max<uint64_t>(n * 4, 1 << 24);
+                Map.willNeed(MapPos, Window);
+                MapPrefetched = MapPos + Window;
+            }
+            const unsigned char* Result = Map.data() + MapPos;
+            MapPos += n;
+            return Result;
+        }
+        if(Async.isOpen())
+        {
+            // Only payloads that straddle two reads are copied.
+            const unsigned char* Result = Async.view(n);
+            if(Result != nullptr)
+            {
+                return Result;
+            }
+            unsigned char* Buffer = ReadBuffer.get(n);
+            return Async.read(Buffer, n) ? Buffer : nullptr;
+        }
+        if(Seq.isOpen())
+        {
+            return Seq.view(n);
+        }
+
+        unsigned char* Buffer = ReadBuffer.get(n);
+        if(!File.read(reinterpret_cast<char*>(Buffer), n))
+        {
+            return nullptr;
+        }
+        return Buffer;
+    }
+
+    uint64_t XtcFile :: tell()
+    {
+        if(Map.isOpen())
+        {
+            return MapPos;
+        }
+        if(Async.isOpen())
+        {
+            return Async.tell();
+        }
+        if(Seq.isOpen())
+        {
+            return Seq.tell();
+        }
+        // tellg() reports -1 once the end of the file has been hit, so
+        // ask with a clear state and put the state back afterwards.
+        const auto State = File.rdstate();
+        File.clear();
+        const auto Pos = File.tellg();
+        File.setstate(State);
+        return Pos;
+    }
+
+    void XtcFile :: seek(uint64_t pos)
+    {
+        if(Map.isOpen())
+        {
+            MapPos = pos;
+            return;
+        }
+        if(Async.isOpen())
+        {
+            Async.seek(pos);
+            return;
+        }
+        if(Seq.isOpen())
+        {
+            Seq.seek(pos);
+            return;
+        }
+        File.clear();
+        File.seekg(pos);
+    }
+
+    void XtcFile :: skipBytes(uint64_t n)
+    {
+        if(Map.isOpen())
+        {
+            MapPos += n;
+            return;
+        }
+        if(Async.isOpen())
+        {
+            Async.seek(Async.tell() + n);
+            return;
+        }
+        if(Seq.isOpen())
+        {
+            Seq.seek(Seq.tell() + n);
+            return;
+        }
+        File.seekg(n, std::ios::cur);
+    }
+
     XtcFile::FrameMeta XtcFile :: readFrameMetaAndStay()
     {
         int32_t magic;
-        auto Pos = File.tellg();
+        auto Pos = tell();
         read(&magic);
-        if(magic != MAGIC)
+        if(magic != MAGIC && magic != MAGIC_LARGE)
         {
             std::stringstream Formatter;
             Formatter << "incorrect magic: " << std::hex
                       << "0x" << magic << "@0x" << Pos;
             throw std::runtime_error(Formatter.str());
         }
+        FrameMagic = magic;
 
         XtcFile::FrameMeta Meta;
         read(&Meta.AtomCount);
@@ -440,21 +642,305 @@ namespace libmd
         return Meta;
     }
 
+    bool XtcFile :: readByteCount(uint64_t* count)
+    {
+        if(FrameMagic != MAGIC_LARGE)
+        {
+            uint32_t Count;
+            if(!read(&Count))
+            {
+                return false;
+            }
+            *count = Count;
+            return true;
+        }
+        // An XDR hyper, high word first.
+        uint32_t Words[2];
+        if(!read(Words, 2))
+        {
+            return false;
+        }
+        *count = (static_cast<uint64_t>(Words[0]) << 32) | Words[1];
+        // Nothing is that large, and this keeps padding from wrapping
+        // around.
+        return *count < (uint64_t(1) << 62);
+    }
+
     XtcFile::FrameMeta XtcFile :: readFrameMeta()
     {
-        auto FrameBegin = File.tellg();
+        auto FrameBegin = tell();
+        auto Meta = readFrameMetaAndStay();
+        seek(FrameBegin);
+        return Meta;
+    }
+
+    bool XtcFile :: skipFrameBody(int32_t atom_count)
+    {
+        int32_t Size;
+        // A corrupt header would otherwise give a body size that
+        // wraps around, and a seek to anywhere.
+        if(!read(&Size) || Size < 0 || Size != atom_count)
+        {
+            return false;
+        }
+
+        uint64_t BodySize;
+        if(Size <= 9)
+        {
+            // Uncompressed
+            BodySize = static_cast<uint64_t>(Size) * 3 * sizeof(float);
+        }
+        else
+        {
+            // Precision, minint[3], maxint[3], and smallidx.
+            skipBytes(8 * sizeof(int32_t));
+            uint64_t ByteCount;
+            if(!readByteCount(&ByteCount))
+            {
+                return false;
+            }
+            // The payload is padded to 4 bytes.
+            BodySize = (ByteCount + 3) / 4 * 4;
+        }
+        skipBytes(BodySize);
+        if(Map.isOpen())
+        {
+            return MapPos <= Map.size();
+        }
+        if(Async.isOpen())
+        {
+            return Async.tell() <= Async.size();
+        }
+        if(Seq.isOpen())
+        {
+            return Seq.inBounds();
+        }
+        return static_cast<bool>(File);
+    }
+
+    void XtcFile :: buildIndex()
+    {
+        // Magic, atom count, step, time, and the box.
+        constexpr uint64_t HEADER_SIZE = 13 * sizeof(int32_t);
+
+        Index.clear();
+        Index.Source = FileFingerprint::of(Path);
+        const auto Saved = tell();
+        rewind();
+
+        uint64_t Pos = 0;
+        while(Pos + HEADER_SIZE <= Index.Source.Size)
+        {
+            const auto Meta = readFrameMetaAndStay();
+            // A truncated last frame is not indexed.
+            if(!skipFrameBody(Meta.AtomCount) || tell() > Index.Source.Size)
+            {
+                break;
+            }
+
+            XtcIndex::Entry Entry;
+            Entry.Offset = Pos;
+            Entry.Step = Meta.Step;
+            Entry.Time = Meta.Time;
+            Entry.BoxDim = Meta.BoxDim;
+            Index.add(Entry);
+            Pos = tell();
+        }
+
+        seek(Saved);
+    }
+
+    const XtcIndex& XtcFile :: index()
+    {
+        if(IndexReady)
+        {
+            return Index;
+        }
+        if(!seekable())
+        {
+            throw std::runtime_error(
+                "frames cannot be indexed in compressed or piped input");
+        }
+
+        const std::string Sidecar = XtcIndex::sidecarPath(Path);
+        if(!Index.load(Sidecar, FileFingerprint::of(Path)))
+        {
+            buildIndex();
+            // Not being able to cache the index is not an error. It
+            // just needs to be rebuilt next time.
+            Index.save(Sidecar);
+        }
+        IndexReady = true;
+        return Index;
+    }
+
+    void XtcFile :: seekFrame(size_t n)
+    {
+        const auto& Frames = index();
+        if(n >= Frames.size())
+        {
+            throw std::out_of_range("Frame index out of range");
+        }
+        seek(Frames[n].Offset);
+    }
+
+    size_t XtcFile :: seekTime(float t)
+    {
+        const size_t Frame = index().findTime(t);
+        seekFrame(Frame);
+        return Frame;
+    }
+
+    uint64_t XtcFile :: fileSize()
+    {
+        if(Map.isOpen())
+        {
+            return Map.size();
+        }
+        if(Async.isOpen())
+        {
+            return Async.size();
+        }
+        if(Seq.isOpen())
+        {
+            return Seq.size();
+        }
+        return FileFingerprint::of(Path).Size;
+    }
+
+    bool XtcFile :: isFrameAt(uint64_t pos, int32_t atom_count)
+    {
+        seek(pos);
+        std::array<int32_t, 13> Header;
+        int32_t Size;
+        if(!read(Header.data(), Header.size()) ||
+           (Header[0] != MAGIC && Header[0] != MAGIC_LARGE) ||
+           Header[1] != atom_count || !read(&Size) || Size != atom_count)
+        {
+            return false;
+        }
+        FrameMagic = Header[0];
+        // The atom count is read again in skipFrameBody().
+        seek(pos + sizeof(Header));
+        if(!skipFrameBody(atom_count))
+        {
+            return false;
+        }
+
+        const uint64_t FrameEnd = tell();
+        const uint64_t FileEnd = fileSize();
+        if(FrameEnd >= FileEnd)
+        {
+            // A truncated frame is not a frame.
+            return FrameEnd == FileEnd;
+        }
+        int32_t Next[2];
+        return read(Next, 2) && (Next[0] == MAGIC || Next[0] == MAGIC_LARGE) &&
+            Next[1] == atom_count;
+    }
+
+    bool XtcFile :: syncToFrame(uint64_t from, int32_t atom_count)
+    {
+        // Everything in an XTC file is 4 bytes, and the payload is
+        // padded, so frames always begin at a multiple of 4.
+        constexpr size_t CHUNK_SIZE = 1 << 16;
+        std::array<int32_t, 2> Pattern = { MAGIC, atom_count };
+        std::array<int32_t, 2> PatternLarge = { MAGIC_LARGE, atom_count };
+        if(Endian::NATIVE == Endian::LITTLE)
+        {
+            swapBytes32(Pattern.data(), Pattern.size());
+            swapBytes32(PatternLarge.data(), PatternLarge.size());
+        }
+
+        const uint64_t FileEnd = fileSize();
+        uint64_t ChunkBegin = (from + 3) / 4 * 4;
+        while(ChunkBegin + sizeof(Pattern) <= FileEnd)
+        {
+            const size_t ChunkSize = std::min<uint64_t>(CHUNK_SIZE,
+                                                        FileEnd - ChunkBegin);
+            seek(ChunkBegin);
+            const unsigned char* Chunk = viewBytes(ChunkSize);
+            if(Chunk == nullptr)
+            {
+                return false;
+            }
+
+            size_t i = 0;
+            for(; i + sizeof(Pattern) <= ChunkSize; i += 4)
+            {
+                if(std::memcmp(Chunk + i, Pattern.data(), sizeof(Pattern)) != 0 &&
+                   std::memcmp(Chunk + i, PatternLarge.data(), sizeof(Pattern)) != 0)
+                {
+                    continue;
+                }
+                if(isFrameAt(ChunkBegin + i, atom_count))
+                {
+                    seek(ChunkBegin + i);
+                    return true;
+                }
+                // isFrameAt() reads through the same reader, which may
+                // have reused the memory of the chunk (e.g. a prefetch
+                // slot), so view it again.
+                seek(ChunkBegin);
+                Chunk = viewBytes(ChunkSize);
+                if(Chunk == nullptr)
+                {
+                    return false;
+                }
+            }
+            // The next chunk starts at the first position not checked
+            // in this one.
+            ChunkBegin += i;
+        }
+        return false;
+    }
+
+    XtcFile::FrameMeta XtcFile :: skipFrame()
+    {
         auto Meta = readFrameMetaAndStay();
-        File.seekg(FrameBegin);
+        // Seeking past the end of an ifstream does not fail, so check
+        // the position as well.
+        if(!skipFrameBody(Meta.AtomCount) || tell() > fileSize())
+        {
+            std::stringstream Formatter;
+            Formatter << "truncated frame at step " << Meta.Step;
+            throw std::runtime_error(Formatter.str());
+        }
         return Meta;
     }
 
-    XtcFile::FrameMeta XtcFile :: readFrame(float result[])
+    XtcFile::FrameMeta XtcFile :: readFrame(float result[], size_t max_atoms)
+    {
+        return readFrame(CoordLayout::interleaved(result), max_atoms);
+    }
+
+    XtcFile::FrameMeta XtcFile :: readFrame(const CoordLayout& result,
+                                            size_t max_atoms)
     {
         auto Meta = readFrameMetaAndStay();
         float precision;
-        xdrfile_decompress_coord_float(result, &Meta.AtomCount, &precision);
+        const int32_t MaxAtoms = static_cast<int32_t>(
+            std::min<size_t>(max_atoms, std::numeric_limits<int32_t>::max()));
+        xdrfile_decompress_coord_float(result, &Meta.AtomCount, &precision,
+                                       MaxAtoms, Meta.BoxDim, nullptr, nullptr);
 
         return Meta;
     }
 
+    XtcFile::FrameMeta XtcFile :: readFrame(
+        const CoordLayout& result, const AtomPrefilter& filter,
+        std::vector<uint32_t>& kept, size_t max_atoms)
+    {
+        auto Meta = readFrameMetaAndStay();
+        float precision;
+        const int32_t MaxAtoms = static_cast<int32_t>(
+            std::min<size_t>(max_atoms, std::numeric_limits<int32_t>::max()));
+        if(xdrfile_decompress_coord_float(result, &Meta.AtomCount, &precision,
+                                          MaxAtoms, Meta.BoxDim, &filter, &kept) < 0)
+        {
+            kept.clear();
+        }
+        return Meta;
+    }
+
 }
@@ -20,8 +20,20 @@
 #include <iostream>
 #include <fstream>
 #include <array>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <limits>
 
+#include "coords.h"
 #include "endian.h"
+#include "mappedfile.h"
+#include "prefetch.h"
+#include "prefilter.h"
+#include "sequential.h"
+#include "simd.h"
+#include "utils.h"
+#include "xtcindex.h"
 
 namespace libmd
 {
@@ -29,6 +41,10 @@ namespace libmd
     {
     public:
         static const int32_t MAGIC = 1995;
+        // Frames of more than 298261617 atoms, written by GROMACS 2023
+        // and later. The only difference is that the byte count of the
+        // payload has 64 bits.
+        static const int32_t MAGIC_LARGE = 2023;
         using BoxDimType = std::array<std::array<float, 3>, 3>;
 
         struct FrameMeta
@@ -39,44 +55,196 @@ namespace libmd
             BoxDimType BoxDim;
         };
 
-        XtcFile() : End(Endian::current()) {}
+        // How the file is read. MMAP maps the whole file and decodes
+        // straight out of the mapping, which saves a copy and a
+        // syscall per read. STREAM goes through an std::ifstream, and
+        // is what MMAP falls back to if the file cannot be mapped.
+        // ASYNC keeps several large reads in flight ahead of the
+        // decoder (see PrefetchReader), and also falls back to STREAM.
+        //
+        // Whatever the mode, gzip or zstd compressed files, pipes and
+        // standard input (“-”) are read with a SequentialReader.
+        enum IoMode { STREAM, MMAP, ASYNC };
+
+        XtcFile() = default;
         ~XtcFile() = default;
 
         XtcFile(const XtcFile&) = delete;
         XtcFile& operator=(const XtcFile&) = delete;
 
-        void open(const char* filename);
-        bool isOpen() const { return File.is_open(); }
+        // “prefetch” is only used in ASYNC mode.
+        void open(const char* filename, IoMode mode = STREAM,
+                  const PrefetchOptions& prefetch = PrefetchOptions());
+        bool isOpen() const
+        {
+            return Map.isOpen() || Async.isOpen() || Seq.isOpen() || File.is_open();
+        }
+        // False for compressed or piped input, which cannot be indexed
+        // and can only go back a short way (see SequentialReader).
+        bool seekable() const { return !Seq.isOpen(); }
+        // The mode actually in use, which may differ from what was
+        // asked for in open().
+        IoMode ioMode() const
+        {
+            return Map.isOpen() ? MMAP : Async.isOpen() ? ASYNC : STREAM;
+        }
         FrameMeta readFrameMeta();
-        FrameMeta readFrame(float result[]);
+        // Decode the coordinates of the first max_atoms atoms of the
+        // next frame into result, and move to the frame after it.
+        // Decoding stops as soon as those atoms are done, so reading
+        // only the first few atoms of a large system is cheap.
+        FrameMeta readFrame(float result[],
+                            size_t max_atoms = std::numeric_limits<size_t>::max());
+        // The same, with the coordinates laid out as “result” says,
+        // such as in the arrays of a Coordinates.
+        FrameMeta readFrame(const CoordLayout& result,
+                            size_t max_atoms = std::numeric_limits<size_t>::max());
+        // The same, but only the atoms that survive “filter” are
+        // turned into floats, and their indices are put in kept. The
+        // rest of result is left alone. The filter works on the
+        // integers in the file, so rejected atoms cost very little.
+        FrameMeta readFrame(const CoordLayout& result, const AtomPrefilter& filter,
+                            std::vector<uint32_t>& kept,
+                            size_t max_atoms = std::numeric_limits<size_t>::max());
+        // Move past the current frame without decoding its
+        // coordinates, and return its header. This only reads the
+        // header and the payload length, so it runs at the speed of
+        // seeking. Throws std::runtime_error if the frame is
+        // truncated.
+        FrameMeta skipFrame();
         bool eof();
-        void close() { File.close(); }
+        // Whether a whole frame begins at the read position. Unlike
+        // !eof(), this is false for a frame that is still being
+        // written. The read position does not move. Compressed or
+        // piped input cannot be checked ahead, so this is !eof() for
+        // it.
+        bool frameComplete();
+        // Open the file again, keeping the read position, so that
+        // data written to it since it was opened can be read.
+        void refresh();
+        void close();
+        // Go back to the first frame.
+        void rewind();
+
+        // The frame index of this file. On the first call this loads
+        // the sidecar index, or builds it with a header-only scan if
+        // the sidecar is missing or stale, and tries to save it for
+        // next time.
+        const XtcIndex& index();
+        // Position the file at the beginning of the nth frame (0-based).
+        // Throws std::out_of_range if there are not that many frames.
+        void seekFrame(size_t n);
+        // Position the file at the first frame whose time is not less
+        // than t, and return the index of that frame. Throws
+        // std::out_of_range if there is no such frame.
+        size_t seekTime(float t);
+
+        // Position the file at the first frame that begins at or
+        // after byte offset “from”, without using the index. Frame
+        // boundaries are found by looking for the magic number
+        // followed by atom_count, and then checking that the frame
+        // really ends where the next one (or the file) begins. Return
+        // false if there is no such frame.
+        bool syncToFrame(uint64_t from, int32_t atom_count);
+        uint64_t tell();
+        uint64_t fileSize();
+
+        // How many times the scratch buffers of this reader had to
+        // grow. Decoding frames no larger than those already seen
+        // does not change this.
+        size_t scratchAllocations() const
+        {
+            return ReadBuffer.growths() + IntBuffer.growths();
+        }
 
     private:
         std::ifstream File;
-        const Endian::Endian End;
+        MappedFile Map;
+        PrefetchReader Async;
+        SequentialReader Seq;
+        // Read position in Map.
+        uint64_t MapPos = 0;
+        // Map is hinted with MADV_WILLNEED up to here.
+        uint64_t MapPrefetched = 0;
+        // Where payloads go in STREAM mode. One per reader, so
+        // readers in different threads do not share it.
+        ScratchBuffer<unsigned char> ReadBuffer;
+        // Quantized coordinates of the frame being decoded.
+        ScratchBuffer<int32_t> IntBuffer;
+        // The magic number of the last frame header read.
+        int32_t FrameMagic = MAGIC;
+        std::string Path;
+        // What open() was given, for refresh().
+        IoMode RequestedMode = STREAM;
+        PrefetchOptions Prefetch;
+        XtcIndex Index;
+        bool IndexReady = false;
+
+        // The only functions that touch File, Map, Async and Seq directly.
+        bool readBytes(void* dest, size_t n)
+        {
+            if(Map.isOpen())
+            {
+                if(MapPos + n > Map.size())
+                {
+                    return false;
+                }
+                std::memcpy(dest, Map.data() + MapPos, n);
+                MapPos += n;
+                return true;
+            }
+            if(Async.isOpen())
+            {
+                return Async.read(dest, n);
+            }
+            if(Seq.isOpen())
+            {
+                return Seq.read(dest, n);
+            }
+            return static_cast<bool>(File.read(reinterpret_cast<char*>(dest), n));
+        }
+        // Return a pointer to the next n bytes and move past them.
+        // The pointer is valid until the next call. In MMAP mode this
+        // points into the mapping without copying. Return nullptr if
+        // there are not n bytes left.
+        const unsigned char* viewBytes(size_t n);
+        void seek(uint64_t pos);
+        void skipBytes(uint64_t n);
 
         // Return true if good, false if error or EOF
         template<typename T> bool read(T* value, size_t count=1)
         {
-            if(!(File.read(reinterpret_cast<char*>(value), sizeof(T) * count)))
+            if(!readBytes(value, sizeof(T) * count))
             {
                 return false;
             }
 
-            if(End == Endian::LITTLE)
+            if(Endian::NATIVE == Endian::LITTLE)
             {
-                for(size_t i = 0; i < count; i++)
-                {
-                    Endian::swap(*(value + i));
-                }
+                static_assert(sizeof(T) == 4, "XTC only has 4-byte values");
+                swapBytes32(value, count);
             }
             return true;
         }
 
         int32_t xdrfile_decompress_coord_float(
-            float* ptr, int32_t* size, float* precision);
+            const CoordLayout& out, int32_t* size, float* precision, int32_t max_atoms,
+            const BoxDimType& box, const AtomPrefilter* filter,
+            std::vector<uint32_t>* kept);
         FrameMeta readFrameMetaAndStay();
+        // Read the byte count of a compressed payload, which is 32 or
+        // 64 bits depending on FrameMagic.
+        bool readByteCount(uint64_t* count);
+        // Skip the coordinates of the current frame without decoding
+        // them. The file should be positioned right after the frame
+        // header, which says there are atom_count atoms. Return false
+        // if the frame is truncated, or its atom count is negative or
+        // not atom_count.
+        bool skipFrameBody(int32_t atom_count);
+        void buildIndex();
+        // Whether a complete frame of atom_count atoms starts at pos.
+        // This moves the read position.
+        bool isFrameAt(uint64_t pos, int32_t atom_count);
     };
 
 } // namespace libmd
@@ -0,0 +1,67 @@
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include <stdexcept>
+
+#include "xtcscan.h"
+
+namespace libmd
+{
+    XtcSummary scanXtc(XtcFile& f, std::ostream* listing)
+    {
+        XtcSummary Summary;
+        XtcFile::BoxDimType LastBox;
+        while(!f.eof())
+        {
+            const uint64_t Offset = f.tell();
+            XtcFile::FrameMeta Meta;
+            try
+            {
+                Meta = f.skipFrame();
+            }
+            catch(const std::runtime_error&)
+            {
+                Summary.Truncated = true;
+                break;
+            }
+
+            if(Summary.FrameCount == 0)
+            {
+                Summary.AtomCount = Meta.AtomCount;
+                Summary.FirstStep = Meta.Step;
+                Summary.FirstTime = Meta.Time;
+            }
+            else if(Meta.BoxDim != LastBox)
+            {
+                Summary.BoxChanges++;
+            }
+            Summary.LastStep = Meta.Step;
+            Summary.LastTime = Meta.Time;
+            LastBox = Meta.BoxDim;
+
+            if(listing != nullptr)
+            {
+                *listing << Summary.FrameCount << '\t' << Offset << '\t'
+                         << Meta.Step << '\t' << Meta.Time << '\t'
+                         << Meta.BoxDim[0][0] << '\t' << Meta.BoxDim[1][1] << '\t'
+                         << Meta.BoxDim[2][2] << '\n';
+            }
+            Summary.FrameCount++;
+        }
+        return Summary;
+    }
+
+} // namespace libmd
@@ -0,0 +1,54 @@
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef SDF_XTCSCAN_H
+#define SDF_XTCSCAN_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+#include "xtcio.h"
+
+namespace libmd
+{
+    // What can be told about a trajectory from the frame headers
+    // alone.
+    struct XtcSummary
+    {
+        size_t FrameCount = 0;
+        int32_t AtomCount = 0;
+        int32_t FirstStep = 0;
+        int32_t LastStep = 0;
+        float FirstTime = 0.0f;
+        float LastTime = 0.0f;
+        // Number of frames whose box differs from that of the frame
+        // before.
+        size_t BoxChanges = 0;
+        // Whether the scan stopped at a frame that could not be read,
+        // rather than at the end of the file.
+        bool Truncated = false;
+    };
+
+    // Go through the frames of f from the current position to the end
+    // with XtcFile::skipFrame(), without decoding any coordinates. If
+    // listing is not null, write one line per frame to it: frame
+    // number, byte offset, step, time, and the diagonal of the box.
+    XtcSummary scanXtc(XtcFile& f, std::ostream* listing = nullptr);
+
+} // namespace libmd
+
+#endif
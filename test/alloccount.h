@@ -0,0 +1,42 @@
+// -*- mode: c++; -*-
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef SDF_TEST_ALLOCCOUNT_H
+#define SDF_TEST_ALLOCCOUNT_H
+
+#include <cstddef>
+
+// The test binary replaces the global operator new (see
+// alloccount.cpp), and counts the allocations made by each thread.
+namespace TestGlobal
+{
+    size_t allocationCount();
+}
+
+// Counts the heap allocations made by this thread during its
+// lifetime.
+class AllocationCounter
+{
+public:
+    AllocationCounter() : Begin(TestGlobal::allocationCount()) {}
+    size_t count() const { return TestGlobal::allocationCount() - Begin; }
+
+private:
+    const size_t Begin;
+};
+
+#endif
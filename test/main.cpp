@@ -14,5 +14,88 @@
 // along with this program. If not, see
 // <https://www.gnu.org/licenses/>.
 
-#define CATCH_CONFIG_MAIN
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include <glob.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CATCH_CONFIG_RUNNER
 #include <catch2/catch.hpp>
+
+// The tests open the fixtures as “../test/...” from the build
+// directory, and the readers write their sidecars (.sdfidx, .sdftop)
+// next to them. So that a failed run cannot leave stale sidecars in
+// the source tree for later runs to load, the tests run in a scratch
+// directory, next to a copy of the fixtures, which is removed
+// afterwards.
+namespace
+{
+    const char* const FIXTURES[] = { "test.xtc", "test.gro", "test.txt", "test.xml" };
+
+    bool copyFile(const std::string& from, const std::string& to)
+    {
+        std::ifstream In(from, std::ios::binary);
+        std::ofstream Out(to, std::ios::binary);
+        return In && Out && (Out << In.rdbuf());
+    }
+
+    void removeTree(const std::string& root)
+    {
+        glob_t Files;
+        if(glob((root + "/*/*").c_str(), 0, nullptr, &Files) == 0)
+        {
+            for(size_t i = 0; i < Files.gl_pathc; i++)
+            {
+                std::remove(Files.gl_pathv[i]);
+            }
+        }
+        globfree(&Files);
+        rmdir((root + "/test").c_str());
+        rmdir((root + "/build").c_str());
+        rmdir(root.c_str());
+    }
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    const char* TmpDir = std::getenv("TMPDIR");
+    std::string Template = std::string(TmpDir == nullptr ? "/tmp" : TmpDir) +
+        "/sdf-test-XXXXXX";
+    if(mkdtemp(&Template[0]) == nullptr)
+    {
+        std::cerr << "Failed to make a scratch directory" << std::endl;
+        return 1;
+    }
+    const std::string Root = Template;
+    mkdir((Root + "/test").c_str(), 0755);
+    mkdir((Root + "/build").c_str(), 0755);
+    for(const char* Name: FIXTURES)
+    {
+        if(!copyFile(std::string("../test/") + Name, Root + "/test/" + Name))
+        {
+            std::cerr << "Failed to copy the fixture " << Name << std::endl;
+            removeTree(Root);
+            return 1;
+        }
+    }
+
+    Catch::Session Session;
+    int Result = Session.applyCommandLine(argc, argv);
+    if(Result == 0)
+    {
+        if(chdir((Root + "/build").c_str()) != 0)
+        {
+            std::cerr << "Failed to enter " << Root << "/build" << std::endl;
+            removeTree(Root);
+            return 1;
+        }
+        Result = Session.run();
+    }
+    removeTree(Root);
+    return Result;
+}
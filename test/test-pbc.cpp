@@ -14,11 +14,16 @@
 // along with this program. If not, see
 // <https://www.gnu.org/licenses/>.
 
+#include <algorithm>
+#include <vector>
+
 #include <catch2/catch.hpp>
 #include <Eigen/Dense>
 
 #include "testutils.h"
+#include "alloccount.h"
 #include "pbc.h"
+#include "prefilter.h"
 
 using v3 = Eigen::Vector3f;
 
@@ -116,3 +121,76 @@ TEST_CASE("PBC wrap random vec")
         CHECK(Dist <= Pbc.DiagLength * 0.5);
     }
 }
+
+TEST_CASE("Integer prefilter keeps everything within the cutoff")
+{
+    const float Precision = 1000.0f;
+    const float InvPrecision = 1.0 / Precision;
+    for(int Round = 0; Round < 20; Round++)
+    {
+        const libmd::AtomPrefilter::BoxDimType Box = {{
+                {{ randUni(2.0f, 6.0f), 0.0f, 0.0f }},
+                {{ 0.0f, randUni(2.0f, 6.0f), 0.0f }},
+                {{ 0.0f, 0.0f, randUni(2.0f, 6.0f) }} }};
+        const libmd::RectPbc3d Pbc(Box[0][0], Box[1][1], Box[2][2]);
+        const float Cutoff = randUni(0.2f, 1.5f);
+
+        // Some atoms are a few boxes away, as in unwrapped
+        // trajectories.
+        const size_t AtomCount = 2000;
+        std::vector<int32_t> Ints(AtomCount * 3);
+        for(size_t i = 0; i < AtomCount * 3; i++)
+        {
+            Ints[i] = static_cast<int32_t>(
+                std::round(randUni(-2.0f, 3.0f) * Box[i % 3][i % 3] * Precision));
+        }
+
+        libmd::AtomPrefilter Filter;
+        Filter.addSphere(7, Cutoff);
+        Filter.addAtom(1999);
+        std::vector<float> Result(AtomCount * 3, 0.0f);
+        std::vector<uint32_t> Kept;
+        Filter.apply(Ints.data(), AtomCount, Precision, InvPrecision, Box,
+                     libmd::CoordLayout::interleaved(Result.data()), Kept);
+
+        REQUIRE(std::is_sorted(Kept.begin(), Kept.end()));
+        CHECK(std::binary_search(Kept.begin(), Kept.end(), 7u));
+        CHECK(std::binary_search(Kept.begin(), Kept.end(), 1999u));
+        // A cutoff that spans the box in every dimension keeps
+        // everything.
+        if(2.0f * Cutoff < std::min({Box[0][0], Box[1][1], Box[2][2]}))
+        {
+            CHECK(Kept.size() < AtomCount);
+        }
+
+        v3 Center(Ints[21] * InvPrecision, Ints[22] * InvPrecision,
+                  Ints[23] * InvPrecision);
+        for(size_t i = 0; i < AtomCount; i++)
+        {
+            v3 Atom(Ints[i*3] * InvPrecision, Ints[i*3+1] * InvPrecision,
+                          Ints[i*3+2] * InvPrecision);
+            if(Pbc.dist(Center, Atom) < Cutoff)
+            {
+                REQUIRE(std::binary_search(Kept.begin(), Kept.end(), i));
+            }
+        }
+        for(uint32_t i: Kept)
+        {
+            REQUIRE(Result[i*3] == Ints[i*3] * InvPrecision);
+            REQUIRE(Result[i*3+2] == Ints[i*3+2] * InvPrecision);
+        }
+
+        // With many centers, filtering a frame does not allocate once
+        // “kept” has grown.
+        for(uint32_t Center = 100; Center < 110; Center++)
+        {
+            Filter.addSphere(Center, Cutoff);
+        }
+        Filter.apply(Ints.data(), AtomCount, Precision, InvPrecision, Box,
+                     libmd::CoordLayout::interleaved(Result.data()), Kept);
+        AllocationCounter Counter;
+        Filter.apply(Ints.data(), AtomCount, Precision, InvPrecision, Box,
+                     libmd::CoordLayout::interleaved(Result.data()), Kept);
+        CHECK(Counter.count() == 0);
+    }
+}
@@ -14,11 +14,18 @@
 // along with this program. If not, see
 // <https://www.gnu.org/licenses/>.
 
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
 #include <sstream>
 
 #include <catch2/catch.hpp>
 #include <Eigen/Dense>
 
+#include "alloccount.h"
 #include "testutils.h"
 #include "config.h"
 #include "sdf.h"
@@ -57,6 +64,7 @@ TEST_CASE("Rotation")
     }
 }
 
+#ifndef STUPID_UBUNTU
 TEST_CASE("Config reading 1 run")
 {
     std::stringstream ss;
@@ -82,7 +90,7 @@ TEST_CASE("Config reading 1 run")
 "</sdf-run>";
 
     auto Config = sdf::RuntimeConfig::read(ss);
-    CHECK(Config.XtcFile == "test.xtc");
+    CHECK(Config.XtcFiles == std::vector<std::string>{"test.xtc"});
     CHECK(Config.GroFile == "test.gro");
     CHECK(Config.Params.size() == 1);
     CHECK(Config.Params[0].Anchor.toStr() == "18+BCDEF");
@@ -90,11 +98,8 @@ TEST_CASE("Config reading 1 run")
     CHECK(Config.Params[0].AtomXY.toStr() == "17+C65");
     CHECK(Config.Params[0].Distance == 100.0);
     CHECK(Config.Params[0].SliceThickness == 101.0);
-    CHECK(Config.Params[0].OtherAtoms.size() == 2);
-    CHECK(Config.Params[0].OtherAtoms.find("17+H10") !=
-          std::end(Config.Params[0].OtherAtoms));
-    CHECK(Config.Params[0].OtherAtoms.find("17+H11") !=
-          std::end(Config.Params[0].OtherAtoms));
+    CHECK(Config.Params[0].OtherAtoms ==
+          std::vector<std::string>{"17+H10", "17+H11"});
 }
 
 TEST_CASE("Config reading 2 runs")
@@ -103,6 +108,7 @@ TEST_CASE("Config reading 2 runs")
     ss << "<sdf-run>"
 "  <input>"
 "    <trajectory>test.xtc</trajectory>"
+"    <trajectory>../test/test.x?c</trajectory>"
 "    <structure>test.gro</structure>"
 "  </input>"
 "  <config/>"
@@ -133,7 +139,7 @@ TEST_CASE("Config reading 2 runs")
 "</sdf-run>";
 
     auto Config = sdf::RuntimeConfig::read(ss);
-    CHECK(Config.XtcFile == "test.xtc");
+    CHECK(Config.XtcFiles == std::vector<std::string>{"test.xtc", "../test/test.xtc"});
     CHECK(Config.GroFile == "test.gro");
     CHECK(Config.Params.size() == 2);
     CHECK(Config.Params[0].Anchor.toStr() == "18+BCDEF");
@@ -141,23 +147,54 @@ TEST_CASE("Config reading 2 runs")
     CHECK(Config.Params[0].AtomXY.toStr() == "17+C65");
     CHECK(Config.Params[0].Distance == 100.0);
     CHECK(Config.Params[0].SliceThickness == 101.0);
-    CHECK(Config.Params[0].OtherAtoms.size() == 2);
-    CHECK(Config.Params[0].OtherAtoms.find("17+H10") !=
-          std::end(Config.Params[0].OtherAtoms));
-    CHECK(Config.Params[0].OtherAtoms.find("17+H11") !=
-          std::end(Config.Params[0].OtherAtoms));
+    CHECK(Config.Params[0].OtherAtoms ==
+          std::vector<std::string>{"17+H10", "17+H11"});
 
     CHECK(Config.Params[1].Anchor.toStr() == "17+O2");
     CHECK(Config.Params[1].AtomX.toStr() == "18+BCDEF");
     CHECK(Config.Params[1].AtomXY.toStr() == "17+C65");
     CHECK(Config.Params[1].Distance == 99.0);
     CHECK(Config.Params[1].SliceThickness == 98.0);
-    CHECK(Config.Params[1].OtherAtoms.size() == 2);
-    CHECK(Config.Params[1].OtherAtoms.find("17+H12") !=
-          std::end(Config.Params[1].OtherAtoms));
-    CHECK(Config.Params[1].OtherAtoms.find("17+H13") !=
-          std::end(Config.Params[1].OtherAtoms));
+    CHECK(Config.Params[1].OtherAtoms ==
+          std::vector<std::string>{"17+H12", "17+H13"});
 }
+#else  // #ifndef STUPID_UBUNTU
+TEST_CASE("Config reading plain input")
+{
+    std::stringstream ss;
+    ss << "test.xtc\n"
+          "test.gro\n"
+          "+++\n"
+          "18+BCDEF\n"
+          "17+O2\n"
+          "17+C65\n"
+          "100\n"
+          "101\n"
+          "17+H10\n"
+          "exclude 17+H11\n"
+          "+++\n"
+          "17+O2\n"
+          "18+BCDEF\n"
+          "17+C65\n"
+          "99\n"
+          "98\n"
+          "17+H12\n"
+          "exclude resname SOL\n";
+
+    auto Config = sdf::RuntimeConfig::read(ss);
+    CHECK(Config.XtcFiles == std::vector<std::string>{"test.xtc"});
+    CHECK(Config.GroFile == "test.gro");
+    REQUIRE(Config.Params.size() == 2);
+    CHECK(Config.Params[0].Anchor.toStr() == "18+BCDEF");
+    CHECK(Config.Params[0].Distance == 100.0);
+    CHECK(Config.Params[1].SliceThickness == 98.0);
+    // Plain extra lines are read and ignored, as they always were.
+    // Only the lines marked “exclude” leave atoms out; an older sdf
+    // ignores them too.
+    CHECK(Config.Params[0].OtherAtoms == std::vector<std::string>{"17+H11"});
+    CHECK(Config.Params[1].OtherAtoms == std::vector<std::string>{"resname SOL"});
+}
+#endif
 
 TEST_CASE("Distribution grid")
 {
@@ -179,3 +216,421 @@ TEST_CASE("Distribution grid")
     CHECK(Dist.value(0, 1) == 1);
     CHECK(Dist.value(1, 1) == 0);
 }
+
+TEST_CASE("Path expansion")
+{
+    CHECK(libmd::expandPath("../test/test.g?o") ==
+          std::vector<std::string>{"../test/test.gro"});
+    CHECK(libmd::expandPath("../test/test.[gt][rx][ot]") ==
+          std::vector<std::string>{"../test/test.gro", "../test/test.txt"});
+    CHECK(libmd::expandPath("../test/nothing*") ==
+          std::vector<std::string>{"../test/nothing*"});
+}
+
+TEST_CASE("Run over several trajectories")
+{
+    sdf::RuntimeConfig Config;
+    Config.GroFile = "../test/test.gro";
+    Config.XtcFiles = { "../test/test.xtc" };
+    sdf::Parameters Params;
+    Params.Anchor = std::string("18+BCDEF");
+    Params.AtomX = std::string("17+O2");
+    Params.AtomXY = std::string("17+C65");
+    Params.Distance = 100;
+    Params.SliceThickness = 101;
+    Config.Params.push_back(Params);
+    Config.Resolution = 4;
+    Config.HistRange = 2;
+    Config.AbsoluteHistRange = true;
+    Config.ThreadCount = 2;
+
+    for(size_t Stride: {1, 2})
+    {
+        Config.Frames.Stride = Stride;
+        Config.XtcFiles = { "../test/test.xtc" };
+        const auto One = sdf::run<sdf::DistCountTraits>(Config);
+        REQUIRE(One.FrameCount > 0);
+        // More files than threads, so each file is read by one reader.
+        Config.XtcFiles = { "../test/test.xtc", "../test/test.xtc",
+                            "../test/test.xtc" };
+        const auto Three = sdf::run<sdf::DistCountTraits>(Config);
+        CHECK(Three.FrameCount == One.FrameCount * 3);
+        for(size_t i = 0; i < 4; i++)
+        {
+            for(size_t j = 0; j < 4; j++)
+            {
+                CHECK(Three.value(i, j) == One.value(i, j) * 3);
+            }
+        }
+    }
+}
+
+TEST_CASE("Run over a truncated trajectory")
+{
+    // Cut the second frame short, so that skipping it fails.
+    {
+        std::ifstream In("../test/test.xtc", std::ios::binary);
+        std::string Data((std::istreambuf_iterator<char>(In)),
+                         std::istreambuf_iterator<char>());
+        std::ofstream Out("test-truncated-run.xtc", std::ios::binary);
+        Out.write(Data.data(), Data.size() / 2);
+    }
+
+    sdf::RuntimeConfig Config;
+    Config.GroFile = "../test/test.gro";
+    Config.XtcFiles = { "test-truncated-run.xtc" };
+    sdf::Parameters Params;
+    Params.Anchor = std::string("18+BCDEF");
+    Params.AtomX = std::string("17+O2");
+    Params.AtomXY = std::string("17+C65");
+    Params.Distance = 100;
+    Params.SliceThickness = 101;
+    Config.Params.push_back(Params);
+    Config.Resolution = 4;
+    Config.HistRange = 2;
+    Config.AbsoluteHistRange = true;
+    Config.Frames.Stride = 2;
+
+    // The error of a thread comes out of run(), instead of ending the
+    // program. With one thread, the whole file is one range.
+    Config.ThreadCount = 1;
+    CHECK_THROWS_AS(sdf::run<sdf::DistCountTraits>(Config), std::runtime_error);
+
+    // Compressed input is read by the threads in turns.
+    REQUIRE(std::system("gzip -c test-truncated-run.xtc > test-truncated-run.xtc.gz") == 0);
+    Config.XtcFiles = { "test-truncated-run.xtc.gz" };
+    for(size_t Threads: {1, 4})
+    {
+        Config.ThreadCount = Threads;
+        CHECK_THROWS_AS(sdf::run<sdf::DistCountTraits>(Config), std::runtime_error);
+    }
+    std::remove("test-truncated-run.xtc");
+    std::remove("test-truncated-run.xtc.gz");
+    std::remove(libmd::XtcIndex::sidecarPath("test-truncated-run.xtc").c_str());
+}
+
+TEST_CASE("Progress report")
+{
+    sdf::RuntimeConfig Config;
+    Config.GroFile = "../test/test.gro";
+    Config.XtcFiles = { "../test/test.xtc" };
+    sdf::Parameters Params;
+    Params.Anchor = std::string("18+BCDEF");
+    Params.AtomX = std::string("17+O2");
+    Params.AtomXY = std::string("17+C65");
+    Params.Distance = 100;
+    Params.SliceThickness = 101;
+    Config.Params.push_back(Params);
+    Config.Resolution = 4;
+    Config.HistRange = 2;
+    Config.AbsoluteHistRange = true;
+    Config.ThreadCount = 2;
+    Config.Progress = true;
+
+    // Following reads the file front to back by one reader, like
+    // compressed input, and stops soon as nothing is being written.
+    Config.FollowInterval = 0.01;
+    Config.FollowTimeout = 0.1;
+    for(auto Mode: {libmd::XtcFile::STREAM, libmd::XtcFile::MMAP})
+    {
+        for(bool Follow: {false, true})
+        {
+            Config.XtcIoMode = Mode;
+            Config.Follow = Follow;
+            std::stringstream Report;
+            auto* const Saved = std::cerr.rdbuf(Report.rdbuf());
+            sdf::run<sdf::DistCountTraits>(Config);
+            std::cerr.rdbuf(Saved);
+
+            // The count of bytes read does not wrap around at the end
+            // of the file.
+            const std::string Text = Report.str();
+            const auto Pos = Text.find("Read ");
+            REQUIRE(Pos != std::string::npos);
+            CHECK(Text.compare(Pos, 12, "Read 0.0 MB ") == 0);
+        }
+    }
+}
+
+TEST_CASE("Excluded atoms")
+{
+    sdf::RuntimeConfig Config;
+    Config.GroFile = "../test/test.gro";
+    Config.XtcFiles = { "../test/test.xtc" };
+    sdf::Parameters Params;
+    Params.Anchor = std::string("18+BCDEF");
+    Params.AtomX = std::string("17+O2");
+    Params.AtomXY = std::string("17+C65");
+    Params.Distance = 100;
+    Params.SliceThickness = 101;
+    Config.Params.push_back(Params);
+    Config.Resolution = 4;
+    Config.HistRange = 2;
+    Config.AbsoluteHistRange = true;
+
+    const auto All = sdf::run<sdf::DistDetailedCountTraits>(Config);
+    Config.Params[0].OtherAtoms = {"name H10 H11", "resid 17 and name H14"};
+    const auto Some = sdf::run<sdf::DistDetailedCountTraits>(Config);
+    REQUIRE(Some.FrameCount == All.FrameCount);
+    uint64_t Left = 0;
+    for(size_t i = 0; i < 4; i++)
+    {
+        for(size_t j = 0; j < 4; j++)
+        {
+            auto Expected = All.value(i, j);
+            for(const auto& Name: {"H10", "H11", "H14"})
+            {
+                Expected.erase(Name);
+            }
+            CHECK(Some.value(i, j) == Expected);
+            for(const auto& Count: Some.value(i, j))
+            {
+                Left += Count.second;
+            }
+        }
+    }
+    // C64, C66, H12 and H13 in each frame.
+    CHECK(Left == All.FrameCount * 4);
+
+    Config.Params[0].OtherAtoms = {"resid"};
+    CHECK_THROWS_AS(sdf::run<sdf::DistDetailedCountTraits>(Config), std::runtime_error);
+}
+
+TEST_CASE("Prepared frames")
+{
+    sdf::Parameters Params;
+    Params.Anchor = std::string("18+BCDEF");
+    Params.AtomX = std::string("17+O2");
+    Params.AtomXY = std::string("17+C65");
+    Params.Distance = 0.25;
+    Params.SliceThickness = 0.2;
+
+    libmd::Trajectory t;
+    t.open("../test/test.xtc", "../test/test.gro");
+    const sdf::CompiledBasis Basis(Params, t);
+    size_t InSlice = 0;
+    while(t.nextFrame())
+    {
+        const auto Prepared = sdf::prepareFrame(Basis, t);
+        InSlice += Prepared.atoms().size();
+
+        // The same, a step at a time.
+        const auto& BoxDim = t.meta().BoxDim;
+        const libmd::RectPbc3d Pbc(BoxDim[0][0], BoxDim[1][1], BoxDim[2][2]);
+        const v3 Center = t.vec(Basis.Center);
+        auto Near = libmd::filterFrame(
+            t, [&](const libmd::AtomIdentifier&, size_t i, const libmd::V3Map& vec)
+               {
+                   return i == Basis.Anchor || i == Basis.AtomX || i == Basis.AtomXY ||
+                       Pbc.dist(Center, vec) < Params.Distance;
+               });
+        const v3 WrapBase = Near.vec(Params.AtomX);
+        for(size_t i = 0; i < Near.size(); i++)
+        {
+            Pbc.wrapVec(WrapBase, Near.vec(i));
+        }
+        const v3 Origin = Near.vec(Params.Anchor);
+        for(size_t i = 0; i < Near.size(); i++)
+        {
+            Near.vec(i) -= Origin;
+        }
+        const auto Rot = libmd::rotateToAlignX(Near.vec(Params.AtomX),
+                                               Near.vec(Params.AtomXY));
+        for(size_t i = 0; i < Near.size(); i++)
+        {
+            Near.vec(i) = Rot * v3(Near.vec(i));
+        }
+        CHECK(Prepared.extraAtom(Basis.AtomX).isApprox(v3(Near.vec(Params.AtomX))));
+        CHECK(Prepared.extraAtom(Basis.AtomXY).isApprox(v3(Near.vec(Params.AtomXY))));
+        CHECK(Prepared.extraAtom(Basis.Anchor).norm() == Approx(0).margin(1e-6));
+        CHECK(Prepared.extraAtom(Basis.AtomX)[1] == Approx(0).margin(1e-6));
+        CHECK_THROWS_AS(Prepared.extraAtom(0), std::out_of_range);
+
+        std::vector<size_t> Expected;
+        for(size_t i = 0; i < Near.size(); i++)
+        {
+            if(!Basis.Excluded.contains(Near.atomIndex(i)) &&
+               std::fabs(Near.vec(i)[2]) <= Params.SliceThickness * 0.5f)
+            {
+                Expected.push_back(i);
+            }
+        }
+        REQUIRE(Prepared.atoms().size() == Expected.size());
+        for(size_t i = 0; i < Expected.size(); i++)
+        {
+            const auto& Atom = Prepared.atoms()[i];
+            CHECK(Atom.Index == Near.atomIndex(Expected[i]));
+            CHECK(Atom.X == Approx(Near.vec(Expected[i])[0]));
+            CHECK(Atom.Y == Approx(Near.vec(Expected[i])[1]));
+        }
+    }
+    CHECK(InSlice > 0);
+
+    // A frame without a basis atom is an error, not a read out of
+    // bounds.
+    t.rewind();
+    REQUIRE(t.nextFrame());
+    const auto Missing = libmd::filterFrame(
+        t, [&](const libmd::AtomIdentifier&, size_t i, const libmd::V3Map&)
+           {
+               return i != Basis.AtomXY;
+           });
+    CHECK_THROWS_AS(sdf::prepareFrame(Basis, Missing), std::out_of_range);
+    t.limitAtoms(std::min({Basis.Anchor, Basis.AtomX, Basis.AtomXY}));
+    CHECK_THROWS_AS(sdf::prepareFrame(Basis, t), std::out_of_range);
+}
+
+TEST_CASE("Preparing frames does not allocate after warm-up")
+{
+    sdf::Parameters Params;
+    Params.Anchor = std::string("18+BCDEF");
+    Params.AtomX = std::string("17+O2");
+    Params.AtomXY = std::string("17+C65");
+    Params.Distance = 100;
+    Params.SliceThickness = 101;
+
+    for(bool Snapshot: {false, true})
+    {
+        libmd::Trajectory t;
+        t.open("../test/test.xtc", "../test/test.gro");
+        const sdf::CompiledBasis Basis(Params, t);
+        sdf::FrameWorkspace Work;
+        Work.Prepared.resize(1);
+        auto Prepare = [&]()
+        {
+            if(Snapshot)
+            {
+                t.snapshot(Work.Frame);
+                sdf::prepareFrame(Basis, Work.Frame, Work.Prepared[0]);
+            }
+            else
+            {
+                sdf::prepareFrame(Basis, t, Work.Prepared[0]);
+            }
+        };
+        while(t.nextFrame())
+        {
+            Prepare();
+        }
+        const auto Expected = sdf::prepareFrame(Basis, t);
+        t.rewind();
+
+        AllocationCounter Counter;
+        size_t Frames = 0;
+        while(t.nextFrame())
+        {
+            Prepare();
+            Frames++;
+        }
+        const size_t Allocations = Counter.count();
+        CHECK(Frames == 3);
+        CHECK(Allocations == 0);
+
+        // The same as a prepared frame made from scratch. The snapshot
+        // and the trajectory are separate instantiations of
+        // prepareFrame(), which the compiler may contract into fused
+        // multiply-adds differently, so the last bits can differ.
+        const auto& Atoms = Work.Prepared[0].atoms();
+        REQUIRE(Atoms.size() == Expected.atoms().size());
+        for(size_t i = 0; i < Atoms.size(); i++)
+        {
+            CHECK(Atoms[i].Index == Expected.atoms()[i].Index);
+            CHECK(Atoms[i].X == Approx(Expected.atoms()[i].X).margin(1e-5));
+            CHECK(Atoms[i].Y == Approx(Expected.atoms()[i].Y).margin(1e-5));
+        }
+        CHECK((Work.Prepared[0].extraAtom(Basis.AtomX) -
+               Expected.extraAtom(Basis.AtomX)).norm() == Approx(0).margin(1e-5));
+    }
+}
+
+TEST_CASE("Environment cache")
+{
+    sdf::RuntimeConfig Config;
+    Config.GroFile = "../test/test.gro";
+    Config.XtcFiles = { "../test/test.xtc" };
+    sdf::Parameters Params;
+    Params.Anchor = std::string("18+BCDEF");
+    Params.AtomX = std::string("17+O2");
+    Params.AtomXY = std::string("17+C65");
+    Params.Distance = 100;
+    Params.SliceThickness = 101;
+    Config.Params.push_back(Params);
+    Config.Resolution = 4;
+    Config.HistRange = 2;
+    Config.AbsoluteHistRange = true;
+    Config.ThreadCount = 2;
+    Config.Frames.Stride = 2;
+
+    const std::string Path = "test-env-cache.bin";
+    std::remove(Path.c_str());
+    Config.EnvCacheFile = Path;
+    const auto Recorded = sdf::run<sdf::DistCountTraits>(Config);
+
+    sdf::EnvCache Envs;
+    REQUIRE(Envs.load(Path, sdf::EnvCache::key(Config)));
+    CHECK(Envs.frameCount() == Recorded.FrameCount);
+    CHECK(Envs.paramCount() == 1);
+
+    // Only the histogram changes, so this is replayed.
+    Config.Resolution = 3;
+    Config.HistRange = 1.5;
+    const auto Replayed = sdf::run<sdf::DistCountTraits>(Config);
+    Config.EnvCacheFile.clear();
+    const auto Fresh = sdf::run<sdf::DistCountTraits>(Config);
+    CHECK(Replayed.FrameCount == Fresh.FrameCount);
+    for(size_t i = 0; i < 3; i++)
+    {
+        for(size_t j = 0; j < 3; j++)
+        {
+            CHECK(Replayed.value(i, j) == Fresh.value(i, j));
+        }
+    }
+
+    // A different basis does not match.
+    Config.Params[0].Distance = 1;
+    CHECK_FALSE(Envs.load(Path, sdf::EnvCache::key(Config)));
+    std::remove(Path.c_str());
+}
+
+TEST_CASE("Following a trajectory")
+{
+    sdf::RuntimeConfig Config;
+    Config.GroFile = "../test/test.gro";
+    Config.XtcFiles = { "../test/test.xtc" };
+    sdf::Parameters Params;
+    Params.Anchor = std::string("18+BCDEF");
+    Params.AtomX = std::string("17+O2");
+    Params.AtomXY = std::string("17+C65");
+    Params.Distance = 100;
+    Params.SliceThickness = 101;
+    Config.Params.push_back(Params);
+    Config.Resolution = 4;
+    Config.HistRange = 2;
+    Config.AbsoluteHistRange = true;
+    Config.ThreadCount = 2;
+    const auto Expected = sdf::run<sdf::DistCountTraits>(Config);
+
+    // Nothing is being written, so this stops after the timeout.
+    Config.Follow = true;
+    Config.FollowInterval = 0.01;
+    Config.FollowTimeout = 0.2;
+    size_t Updates = 0;
+    const auto Followed = sdf::run<sdf::DistCountTraits>(
+        Config, [&](const sdf::Distribution2<sdf::DistCountTraits>& so_far)
+        {
+            CHECK(so_far.FrameCount <= Expected.FrameCount);
+            Updates++;
+        });
+    CHECK(Updates > 0);
+    CHECK(Followed.FrameCount == Expected.FrameCount);
+    for(size_t i = 0; i < 4; i++)
+    {
+        for(size_t j = 0; j < 4; j++)
+        {
+            CHECK(Followed.value(i, j) == Expected.value(i, j));
+        }
+    }
+
+    Config.XtcFiles = { "../test/test.xtc", "../test/test.xtc" };
+    CHECK_THROWS_AS(sdf::run<sdf::DistCountTraits>(Config), std::runtime_error);
+}
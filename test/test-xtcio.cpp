@@ -14,11 +14,28 @@
 // along with this program. If not, see
 // <https://www.gnu.org/licenses/>.
 
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <thread>
+
 #include <catch2/catch.hpp>
 #include <Eigen/Dense>
 
+#include "testutils.h"
+#include "alloccount.h"
+#include "xdrref.h"
 #include "utils.h"
+#include "bitreader.h"
+#include "framecache.h"
+#include "selection.h"
+#include "topology.h"
+#include "simd.h"
 #include "xtcio.h"
+#include "xtcscan.h"
 #include "trajectory.h"
 
 TEST_CASE("XTC reading")
@@ -52,7 +69,642 @@ TEST_CASE("XTC reading")
     CHECK(data[2] == Approx(4.405f));
 
     REQUIRE(f.eof());
+    // The position stays known after the end has been hit.
+    CHECK(f.tell() == f.fileSize());
+    CHECK(f.eof());
+    f.close();
+}
+
+TEST_CASE("XTC reading memory mapped")
+{
+    libmd::XtcFile f;
+    f.open("../test/test.xtc", libmd::XtcFile::MMAP);
+    REQUIRE(f.ioMode() == libmd::XtcFile::MMAP);
+
+    std::vector<float> data(10 * 3, 0.0f);
+    auto Meta = f.readFrame(data.data());
+    CHECK(Meta.Step == 1000000);
+    CHECK(data[0] == Approx(4.249f));
+    CHECK(data[29] == Approx(4.708f));
+
+    f.seekFrame(2);
+    f.readFrame(data.data());
+    CHECK(data[0] == Approx(4.269f));
+    CHECK(f.eof());
+
+    f.rewind();
+    CHECK(f.readFrameMeta().Step == 1000000);
+    f.close();
+}
+
+TEST_CASE("Prefetch reader")
+{
+    // Several 4 KiB reads, the last one short.
+    std::string Data(5 * 4096 + 100, '\0');
+    for(size_t i = 0; i < Data.size(); i++)
+    {
+        Data[i] = static_cast<char>(i * 7 + i / 256);
+    }
+    {
+        std::ofstream Out("test-prefetch.bin", std::ios::binary);
+        Out.write(Data.data(), Data.size());
+    }
+
+    libmd::PrefetchOptions Options;
+    // Rounded up to 4 KiB.
+    Options.ReadSize = 1;
+    Options.QueueDepth = 2;
+    libmd::PrefetchReader Reader;
+    REQUIRE(Reader.open("test-prefetch.bin", Options));
+    REQUIRE(Reader.size() == Data.size());
+
+    std::string Got(Data.size(), '\0');
+    REQUIRE(Reader.read(&Got[0], Got.size()));
+    CHECK(Got == Data);
+    CHECK(Reader.eof());
+    CHECK_FALSE(Reader.read(&Got[0], 1));
+
+    for(int i = 0; i < 200; i++)
+    {
+        const size_t Begin = randUni(0.0f, Data.size() - 1.0f);
+        const size_t Size = randUni(0.0f, Data.size() - Begin);
+        Reader.seek(Begin);
+        std::string Part(Size, '\0');
+        REQUIRE(Reader.read(&Part[0], Size));
+        REQUIRE(Part == Data.substr(Begin, Size));
+    }
+
+    Reader.seek(4);
+    const unsigned char* View = Reader.view(4);
+    REQUIRE(View != nullptr);
+    CHECK(std::memcmp(View, Data.data() + 4, 4) == 0);
+    CHECK(Reader.tell() == 8);
+    // Crosses into the next read.
+    Reader.seek(4090);
+    CHECK(Reader.view(8) == nullptr);
+    CHECK(Reader.tell() == 4090);
+    Reader.close();
+    CHECK_FALSE(Reader.isOpen());
+
+    CHECK_FALSE(Reader.open("does-not-exist.bin", Options));
+    std::remove("test-prefetch.bin");
+}
+
+TEST_CASE("XTC reading with prefetch")
+{
+    libmd::XtcFile f;
+    f.open("../test/test.xtc", libmd::XtcFile::ASYNC);
+    REQUIRE(f.ioMode() == libmd::XtcFile::ASYNC);
+
+    std::vector<float> data(10 * 3, 0.0f);
+    auto Meta = f.readFrame(data.data());
+    CHECK(Meta.Step == 1000000);
+    CHECK(data[0] == Approx(4.249f));
+    CHECK(data[29] == Approx(4.708f));
+    CHECK(f.skipFrame().Step == 1000020);
+    f.readFrame(data.data());
+    CHECK(data[0] == Approx(4.269f));
+    CHECK(f.eof());
+
+    f.seekFrame(1);
+    CHECK(f.readFrameMeta().Step == 1000020);
+    f.rewind();
+    REQUIRE(f.syncToFrame(1, 10));
+    CHECK(f.tell() == f.index()[1].Offset);
+    f.close();
+}
+
+TEST_CASE("XTC reading compressed input")
+{
+    std::vector<std::vector<float>> Expected;
+    {
+        libmd::XtcFile f;
+        f.open("../test/test.xtc");
+        while(!f.eof())
+        {
+            std::vector<float> Data(10 * 3);
+            f.readFrame(Data.data());
+            Expected.push_back(Data);
+        }
+    }
+
+    // Two gzip members, which should read as the file twice.
+    REQUIRE(std::system("gzip -c ../test/test.xtc > test-compressed.xtc.gz && "
+                        "gzip -c ../test/test.xtc >> test-compressed.xtc.gz") == 0);
+    CHECK(libmd::SequentialReader::needed("test-compressed.xtc.gz"));
+    CHECK_FALSE(libmd::SequentialReader::needed("../test/test.xtc"));
+
+    libmd::XtcFile f;
+    f.open("test-compressed.xtc.gz", libmd::XtcFile::MMAP);
+    REQUIRE(f.isOpen());
+    CHECK_FALSE(f.seekable());
+    CHECK_THROWS_AS(f.index(), std::runtime_error);
+
+    // Peeking goes back a little.
+    CHECK(f.readFrameMeta().Step == 1000000);
+    size_t Frame = 0;
+    while(!f.eof())
+    {
+        std::vector<float> Data(10 * 3);
+        if(Frame == 1)
+        {
+            CHECK(f.skipFrame().Step == 1000020);
+        }
+        else
+        {
+            f.readFrame(Data.data());
+            CHECK(Data == Expected[Frame % Expected.size()]);
+        }
+        Frame++;
+    }
+    CHECK(Frame == Expected.size() * 2);
+    CHECK(f.tell() == f.fileSize());
+    f.close();
+
+    // Garbage after the magic number.
+    {
+        std::ofstream Bad("test-compressed-bad.xtc.gz", std::ios::binary);
+        Bad << "\x1f\x8b\x08\x00 this is not gzip";
+    }
+    f.open("test-compressed-bad.xtc.gz");
+    CHECK_THROWS_AS(f.readFrameMeta(), std::runtime_error);
     f.close();
+    std::remove("test-compressed.xtc.gz");
+    std::remove("test-compressed-bad.xtc.gz");
+}
+
+// Rewrite a trajectory with only compressed frames in the large-system
+// format: magic 2023 and 64-bit byte counts.
+static void writeLargeVariant(const std::string& from, const std::string& to)
+{
+    std::ifstream In(from, std::ios::binary);
+    const std::vector<char> Data((std::istreambuf_iterator<char>(In)),
+                                 std::istreambuf_iterator<char>());
+    auto Word = [&](size_t pos)
+    {
+        uint32_t Value = 0;
+        for(size_t i = 0; i < 4; i++)
+        {
+            Value = (Value << 8) | static_cast<unsigned char>(Data[pos + i]);
+        }
+        return Value;
+    };
+
+    std::ofstream Out(to, std::ios::binary);
+    // Header, atom count, precision, ranges and smallidx.
+    constexpr size_t BEFORE_COUNT = (13 + 1 + 1 + 6 + 1) * 4;
+    size_t Pos = 0;
+    while(Pos < Data.size())
+    {
+        std::vector<char> Frame(Data.begin() + Pos, Data.begin() + Pos + BEFORE_COUNT);
+        Frame[2] = 0x07;
+        Frame[3] = static_cast<char>(0xe7);
+        Out.write(Frame.data(), Frame.size());
+        Out.write("\0\0\0\0", 4);
+        const uint32_t Count = Word(Pos + BEFORE_COUNT);
+        const size_t Padded = (Count + 3) / 4 * 4;
+        Out.write(Data.data() + Pos + BEFORE_COUNT, 4 + Padded);
+        Pos += BEFORE_COUNT + 4 + Padded;
+    }
+}
+
+TEST_CASE("XTC reading the large-system format")
+{
+    writeLargeVariant("../test/test.xtc", "test-large.xtc");
+    for(auto Mode: {libmd::XtcFile::STREAM, libmd::XtcFile::MMAP,
+                    libmd::XtcFile::ASYNC})
+    {
+        libmd::XtcFile Classic, Large;
+        Classic.open("../test/test.xtc", Mode);
+        Large.open("test-large.xtc", Mode);
+        CHECK(Large.fileSize() == Classic.fileSize() + 3 * 4);
+        while(!Classic.eof())
+        {
+            std::vector<float> Expected(10 * 3), Data(10 * 3);
+            const auto Meta = Classic.readFrame(Expected.data());
+            CHECK(Large.readFrame(Data.data()).Step == Meta.Step);
+            CHECK(Data == Expected);
+        }
+        CHECK(Large.eof());
+
+        REQUIRE(Large.index().size() == 3);
+        Large.rewind();
+        CHECK(Large.skipFrame().Step == 1000000);
+        CHECK(Large.tell() == Large.index()[1].Offset);
+        REQUIRE(Large.syncToFrame(1, 10));
+        CHECK(Large.tell() == Large.index()[1].Offset);
+
+        Large.rewind();
+        const auto Summary = libmd::scanXtc(Large);
+        CHECK(Summary.FrameCount == 3);
+        CHECK_FALSE(Summary.Truncated);
+    }
+    std::remove("test-large.xtc");
+    std::remove(libmd::XtcIndex::sidecarPath("test-large.xtc").c_str());
+}
+
+TEST_CASE("Frame cache")
+{
+    {
+        libmd::XtcFile f;
+        f.open("../test/test.xtc");
+        CHECK(libmd::FrameCache::build(f, "test.sdfcache") == 3);
+    }
+    CHECK(libmd::FrameCache::isCache("test.sdfcache"));
+    CHECK_FALSE(libmd::FrameCache::isCache("../test/test.xtc"));
+
+    libmd::FrameCache Cache;
+    Cache.open("test.sdfcache");
+    CHECK(Cache.frameCount() == 3);
+    CHECK(Cache.atomCount() == 10);
+    CHECK(reinterpret_cast<uintptr_t>(Cache.y(1)) % 64 == 0);
+    CHECK(Cache.x(0)[0] == Approx(4.249f));
+    CHECK(Cache.z(0)[9] == Approx(4.708f));
+    CHECK(Cache.meta(2).Step == 1000040);
+    CHECK(Cache.frameAt(Cache.offset(1) - 1) == 1);
+    CHECK(Cache.frameAt(Cache.offset(3)) == 3);
+    CHECK(Cache.offset(3) == Cache.size());
+    Cache.close();
+
+    libmd::Trajectory Xtc, Cached;
+    Xtc.open("../test/test.xtc", "../test/test.gro");
+    Cached.open("test.sdfcache", "../test/test.gro");
+    while(Xtc.nextFrame())
+    {
+        REQUIRE(Cached.nextFrame());
+        CHECK(Cached.meta().Step == Xtc.meta().Step);
+        CHECK(Cached.meta().BoxDim == Xtc.meta().BoxDim);
+        for(size_t i = 0; i < Xtc.size(); i++)
+        {
+            CHECK(Cached.vec(i) == Xtc.vec(i));
+        }
+    }
+    CHECK(Cached.eof());
+    CHECK_FALSE(Cached.nextFrame());
+
+    CHECK(Cached.frameIndex().size() == 3);
+    Cached.seekFrame(1);
+    CHECK(Cached.peekMeta().Step == 1000020);
+    REQUIRE(Cached.syncToFrame(Cached.frameIndex()[1].Offset + 1));
+    CHECK(Cached.tell() == Cached.frameIndex()[2].Offset);
+    CHECK(Cached.skipFrame());
+    CHECK(Cached.eof());
+    CHECK_FALSE(Cached.syncToFrame(Cached.fileSize()));
+    Cached.rewind();
+    Cached.limitAtoms(2);
+    REQUIRE(Cached.nextFrame());
+    CHECK(Cached.size() == 2);
+    CHECK(Cached.vec(1)[0] == Approx(4.291f));
+    Cached.close();
+    std::remove("test.sdfcache");
+}
+
+TEST_CASE("XTC partial decoding")
+{
+    libmd::XtcFile f;
+    f.open("../test/test.xtc");
+    std::vector<std::vector<float>> Full;
+    while(!f.eof())
+    {
+        std::vector<float> Data(10 * 3);
+        f.readFrame(Data.data());
+        Full.push_back(Data);
+    }
+
+    for(size_t Limit = 0; Limit <= 11; Limit++)
+    {
+        f.rewind();
+        for(const auto& Expected: Full)
+        {
+            // One more than asked for, to catch overruns.
+            std::vector<float> Data(Limit * 3 + 3, -1.0f);
+            const auto Meta = f.readFrame(Data.data(), Limit);
+            CHECK(Meta.AtomCount == 10);
+            const size_t Decoded = std::min<size_t>(Limit, 10);
+            for(size_t i = 0; i < Decoded * 3; i++)
+            {
+                REQUIRE(Data[i] == Expected[i]);
+            }
+            CHECK(Data[Decoded * 3] == -1.0f);
+        }
+        CHECK(f.eof());
+    }
+    f.close();
+
+    libmd::Trajectory t;
+    t.open("../test/test.xtc", "../test/test.gro");
+    t.limitAtoms(4);
+    REQUIRE(t.nextFrame());
+    CHECK(t.size() == 4);
+    CHECK(t.meta().AtomCount == 4);
+    CHECK(t.vec(0).isApprox(Eigen::Vector3f(4.249, 2.67, 4.389)));
+    CHECK(t.hasAtom(t.atomId(3)));
+    CHECK_FALSE(t.hasAtom("18+BCDEF"));
+    REQUIRE(t.nextFrame());
+    REQUIRE(t.nextFrame());
+    CHECK_FALSE(t.nextFrame());
+}
+
+TEST_CASE("XTC decoding does not allocate in steady state")
+{
+    for(auto Mode: {libmd::XtcFile::STREAM, libmd::XtcFile::MMAP})
+    {
+        libmd::XtcFile f;
+        f.open("../test/test.xtc", Mode);
+        std::vector<float> data(10 * 3, 0.0f);
+
+        // Warm up with every frame once.
+        while(!f.eof())
+        {
+            f.readFrame(data.data());
+        }
+        const size_t Growths = f.scratchAllocations();
+        f.rewind();
+
+        AllocationCounter Counter;
+        size_t Frames = 0;
+        while(!f.eof())
+        {
+            f.readFrame(data.data());
+            Frames++;
+        }
+        const size_t Allocations = Counter.count();
+        CHECK(Frames == 3);
+        CHECK(Allocations == 0);
+        CHECK(f.scratchAllocations() == Growths);
+        f.close();
+    }
+}
+
+TEST_CASE("Bit reader")
+{
+    std::vector<unsigned char> Data(4096);
+    for(auto& Byte: Data)
+    {
+        Byte = static_cast<unsigned char>(randUni(0.0f, 256.0f));
+    }
+
+    // Read bits one at a time as reference.
+    libmd::BitReader Reference(Data.data(), Data.size());
+    libmd::BitReader Reader(Data.data(), Data.size());
+    for(int i = 0; i < 500; i++)
+    {
+        const int Bits = 1 + i % 56;
+        uint64_t Expected = 0;
+        for(int b = 0; b < Bits; b++)
+        {
+            Expected = (Expected << 1) | Reference.read(1);
+        }
+        REQUIRE(Reader.read(Bits) == Expected);
+    }
+
+    // The same as xdrfile, for every width it reads.
+    libmd::BitReader Fast(Data.data(), Data.size());
+    XdrReference::BitStream Xdr = { Data.data(), 0, 0, 0 };
+    for(int i = 0; i < 1000; i++)
+    {
+        const int Bits = 1 + i % 31;
+        REQUIRE(Fast.read(Bits) ==
+                static_cast<uint32_t>(XdrReference::decodebits(Xdr, Bits)));
+    }
+
+    // Past the end are zeros.
+    libmd::BitReader Short(Data.data(), 3);
+    Short.read(20);
+    CHECK(Short.read(4) == (Data[2] & 0xf));
+    CHECK(Short.read(40) == 0);
+}
+
+TEST_CASE("Bulk byte swap and dequantization")
+{
+    // Odd sizes, so that the scalar tail is used as well.
+    for(size_t Size: {0, 1, 3, 4, 7, 8, 9, 17, 31, 64, 100, 300})
+    {
+        std::vector<uint32_t> Words(Size);
+        std::vector<int32_t> Ints(Size);
+        for(size_t i = 0; i < Size; i++)
+        {
+            Words[i] = 0x01020304u * static_cast<uint32_t>(i + 1);
+            Ints[i] = static_cast<int32_t>(randUni(-100000.0f, 100000.0f));
+        }
+
+        std::vector<uint32_t> Swapped = Words;
+        libmd::swapBytes32(Swapped.data(), Swapped.size());
+        std::vector<float> Floats(Size);
+        const float Scale = 1.0f / 1000.0f;
+        libmd::dequantize(Ints.data(), Ints.size(), Scale, Floats.data());
+        for(size_t i = 0; i < Size; i++)
+        {
+            REQUIRE(Swapped[i] == libmd::Endian::swapped(Words[i]));
+            // Exactly what the scalar code gives.
+            REQUIRE(Floats[i] == Ints[i] * Scale);
+        }
+
+        const size_t Triples = Size / 3;
+        std::vector<float> X(Triples), Y(Triples), Z(Triples);
+        libmd::dequantizePlanar(Ints.data(), Triples, Scale, X.data(), Y.data(), Z.data());
+        for(size_t i = 0; i < Triples; i++)
+        {
+            REQUIRE(X[i] == Ints[i * 3] * Scale);
+            REQUIRE(Y[i] == Ints[i * 3 + 1] * Scale);
+            REQUIRE(Z[i] == Ints[i * 3 + 2] * Scale);
+        }
+    }
+}
+
+TEST_CASE("Fast integer unpacking")
+{
+    std::vector<unsigned char> Data(4096);
+    for(auto& Byte: Data)
+    {
+        Byte = static_cast<unsigned char>(randUni(0.0f, 256.0f));
+    }
+
+    // Decode the same bits the way XtcFile does, and with xdrfile’s
+    // decodeints().
+    auto Check = [&Data](size_t offset, const uint32_t sizes[3], bool small)
+    {
+        const int Bits = XdrReference::sizeofints(3, sizes);
+        const libmd::Divisor Divisors[3] = {
+            libmd::Divisor(sizes[0]), libmd::Divisor(sizes[1]),
+            libmd::Divisor(sizes[2]) };
+        libmd::BitReader Fast(Data.data() + offset, Data.size() - offset);
+        XdrReference::BitStream Xdr = { Data.data() + offset, 0, 0, 0 };
+        for(int j = 0; j < 4; j++)
+        {
+            int32_t Expected[3], Actual[3];
+            XdrReference::decodeints(Xdr, 3, Bits, sizes, Expected);
+            if(Bits > 64)
+            {
+                libmd::decodeIntsGeneric(Fast, 3, Bits, sizes, Actual);
+            }
+            else if(small)
+            {
+                libmd::decodeSmallInts3(Fast, Bits, Divisors[0], Actual);
+            }
+            else
+            {
+                libmd::decodeInts3(Fast, Bits, Divisors, Actual);
+            }
+            REQUIRE(Actual[0] == Expected[0]);
+            REQUIRE(Actual[1] == Expected[1]);
+            REQUIRE(Actual[2] == Expected[2]);
+        }
+    };
+
+    for(int i = 0; i < 200; i++)
+    {
+        const size_t Offset = i * 8;
+        // Combined into at most 64 bits.
+        uint32_t Sizes[3];
+        for(auto& Size: Sizes)
+        {
+            Size = 1 + static_cast<uint32_t>(randUni(0.0f, 2000000.0f));
+        }
+        Check(Offset, Sizes, false);
+
+        // Run-length encoded small integers.
+        const uint32_t Small = 1 + static_cast<uint32_t>(randUni(0.0f, 2000000.0f));
+        const uint32_t SmallSizes[3] = { Small, Small, Small };
+        Check(Offset, SmallSizes, true);
+
+        // Too large for 64 bits.
+        uint32_t LargeSizes[3];
+        for(auto& Size: LargeSizes)
+        {
+            Size = static_cast<uint32_t>(randUni(4000000.0f, 8000000.0f));
+        }
+        REQUIRE(XdrReference::sizeofints(3, LargeSizes) > 64);
+        Check(Offset, LargeSizes, false);
+    }
+}
+
+TEST_CASE("Atom names")
+{
+    const uint32_t Id = libmd::NameTable::intern("C64");
+    CHECK(libmd::NameTable::intern("C64") == Id);
+    CHECK(libmd::NameTable::intern("C65") != Id);
+    CHECK(libmd::NameTable::name(Id) == "C64");
+
+    const libmd::AtomIdentifier Atom("17+C64");
+    CHECK(Atom == libmd::AtomIdentifier(17, "C64"));
+    CHECK(Atom == libmd::AtomIdentifier(17, Id));
+    CHECK_FALSE(Atom == libmd::AtomIdentifier(18, "C64"));
+    CHECK(Atom.name() == "C64");
+    CHECK(Atom.toStr() == "17+C64");
+    CHECK(sizeof(libmd::AtomIdentifier) == 8);
+
+    std::hash<libmd::AtomIdentifier> Hash;
+    CHECK(Hash(Atom) != Hash(libmd::AtomIdentifier(18, "C64")));
+    CHECK(Hash(Atom) != Hash(libmd::AtomIdentifier(17, "C65")));
+
+    // Threads interning the same names get the same ids.
+    std::vector<std::vector<uint32_t>> Ids(4);
+    std::vector<std::thread> Threads;
+    for(size_t i = 0; i < Ids.size(); i++)
+    {
+        Threads.emplace_back([&Ids, i]()
+        {
+            for(size_t n = 0; n < 1000; n++)
+            {
+                Ids[i].push_back(libmd::NameTable::intern(
+                                     "T" + std::to_string((n * 7 + i) % 1000)));
+            }
+        });
+    }
+    for(auto& Thread: Threads)
+    {
+        Thread.join();
+    }
+    for(size_t i = 0; i < Ids.size(); i++)
+    {
+        for(size_t n = 0; n < 1000; n++)
+        {
+            CHECK(libmd::NameTable::name(Ids[i][n]) ==
+                  "T" + std::to_string((n * 7 + i) % 1000));
+        }
+    }
+}
+
+TEST_CASE("GRO reading")
+{
+    const auto Atoms = libmd::readGro("../test/test.gro");
+    REQUIRE(Atoms.size() == 10);
+    CHECK(Atoms.atom(0) == libmd::AtomIdentifier(17, "C64"));
+    CHECK(Atoms.atom(4) == libmd::AtomIdentifier(18, "BCDEF"));
+    CHECK(Atoms.atom(5) == libmd::AtomIdentifier(17, "O2"));
+    CHECK(libmd::NameTable::name(Atoms.resName(0)) == "PCBM");
+    CHECK(libmd::NameTable::name(Atoms.resName(4)) == "PCBMA");
+    CHECK(Atoms.find(libmd::AtomIdentifier(18, "BCDEF")) == 4);
+    CHECK(Atoms.index(libmd::AtomIdentifier(17, "O2")) == 5);
+    CHECK(Atoms.find(libmd::AtomIdentifier(18, "O2")) == Atoms.size());
+    CHECK_THROWS_AS(Atoms.index(libmd::AtomIdentifier(18, "O2")), std::out_of_range);
+
+    std::ifstream In("../test/test.gro");
+    const std::string Data((std::istreambuf_iterator<char>(In)),
+                           std::istreambuf_iterator<char>());
+    {
+        std::ofstream Out("test-topology.gro", std::ios::trunc);
+        Out << Data;
+    }
+    std::remove(libmd::topologyCachePath("test-topology.gro").c_str());
+    CHECK(libmd::loadTopology("test-topology.gro") == Atoms);
+    CHECK(std::ifstream(libmd::topologyCachePath("test-topology.gro")).good());
+    CHECK(libmd::loadTopology("test-topology.gro") == Atoms);
+
+    // Fewer atoms than the file says.
+    {
+        std::ofstream Out("test-topology.gro", std::ios::trunc);
+        Out << Data.substr(0, Data.find("H12"));
+    }
+    CHECK_THROWS_AS(libmd::loadTopology("test-topology.gro"), std::runtime_error);
+    std::remove("test-topology.gro");
+    std::remove(libmd::topologyCachePath("test-topology.gro").c_str());
+}
+
+TEST_CASE("Atom selections")
+{
+    const auto Topo = libmd::readGro("../test/test.gro");
+    auto Select = [&](const std::string& text)
+    {
+        const auto Selected = libmd::AtomSelection::parse(text).resolve(Topo);
+        REQUIRE(Selected.size() == Topo.size());
+        std::vector<size_t> Result;
+        for(size_t i = 0; i < Topo.size(); i++)
+        {
+            if(Selected.contains(i))
+            {
+                Result.push_back(i);
+            }
+        }
+        return Result;
+    };
+    CHECK(Select("17+H10") == std::vector<size_t>{1});
+    CHECK(Select("name H10 H11 H12") == std::vector<size_t>{1, 2, 7});
+    CHECK(Select("resname PCBMA") == std::vector<size_t>{4});
+    CHECK(Select("resid 18") == std::vector<size_t>{4});
+    CHECK(Select("resid 10-17 and name C64 C65 BCDEF") == std::vector<size_t>{0, 3});
+    CHECK(Select("resname PCBM and resid 18-20").empty());
+
+    CHECK_THROWS_AS(libmd::AtomSelection::parse(""), std::runtime_error);
+    CHECK_THROWS_AS(libmd::AtomSelection::parse("name"), std::runtime_error);
+    CHECK_THROWS_AS(libmd::AtomSelection::parse("resid 3-1"), std::runtime_error);
+    CHECK_THROWS_AS(libmd::AtomSelection::parse("resid x"), std::runtime_error);
+    CHECK_THROWS_AS(libmd::AtomSelection::parse("resid 99999999999"), std::runtime_error);
+    CHECK_THROWS_AS(libmd::AtomSelection::parse("resid 1-99999999999"), std::runtime_error);
+    CHECK_THROWS_AS(libmd::AtomSelection::parse("name H10 and"), std::runtime_error);
+    CHECK_THROWS_AS(libmd::AtomSelection::parse("atom H10"), std::runtime_error);
+
+    libmd::AtomSet Set(70);
+    Set.insert(3);
+    Set.insert(69);
+    libmd::AtomSet Other(70);
+    Other.insert(64);
+    Set |= Other;
+    CHECK(Set.count() == 3);
+    CHECK(Set.contains(64));
+    CHECK_FALSE(Set.contains(4));
+    CHECK_FALSE(Set.contains(70));
 }
 
 TEST_CASE("Trajectory")
@@ -76,6 +728,58 @@ TEST_CASE("Trajectory")
     t.close();
 }
 
+TEST_CASE("Trajectory frame skipping")
+{
+    libmd::Trajectory t;
+    t.open("../test/test.xtc", "../test/test.gro");
+
+    CHECK(t.peekMeta().Step == 1000000);
+    REQUIRE(t.skipFrame());
+    CHECK(t.countFrames() == 0);
+    REQUIRE(t.nextFrame());
+    CHECK(t.meta().Step == 1000020);
+    CHECK(t.vec("17+H11").isApprox(Eigen::Vector3f(4.209, 2.698, 4.304)));
+    REQUIRE(t.skipFrame());
+    CHECK(t.eof());
+    CHECK_FALSE(t.skipFrame());
+    t.close();
+}
+
+TEST_CASE("Frame selection")
+{
+    libmd::FrameSelection All;
+    CHECK(All.all());
+    CHECK(All.selects(0, -1000.0f));
+
+    libmd::FrameSelection Range;
+    Range.Begin = 0.1f;
+    Range.End = 0.3f;
+    CHECK_FALSE(Range.all());
+    CHECK_FALSE(Range.needsOrigin());
+    // Slightly off, as times in a file often are.
+    CHECK(Range.selects(5, 0.099999994f));
+    CHECK(Range.selects(15, 0.30000001f));
+    CHECK_FALSE(Range.selects(4, 0.08f));
+    CHECK_FALSE(Range.selects(16, 0.32f));
+
+    libmd::FrameSelection Strided = Range;
+    Strided.Stride = 3;
+    REQUIRE(Strided.needsOrigin());
+    Strided.origin(5, 0.1f);
+    CHECK(Strided.selects(5, 0.1f));
+    CHECK_FALSE(Strided.selects(6, 0.12f));
+    CHECK(Strided.selects(8, 0.16f));
+
+    libmd::FrameSelection ByTime;
+    ByTime.Dt = 0.1f;
+    ByTime.origin(1, 0.02f);
+    CHECK_FALSE(ByTime.selects(0, 0.0f));
+    CHECK(ByTime.selects(1, 0.02f));
+    CHECK_FALSE(ByTime.selects(2, 0.04f));
+    CHECK(ByTime.selects(6, 0.12f));
+    CHECK(ByTime.selects(51, 1000.02f));
+}
+
 TEST_CASE("Trajectory filter")
 {
     libmd::Trajectory t;
@@ -92,6 +796,296 @@ TEST_CASE("Trajectory filter")
             return name.toStr() == "18+BCDEF";
         });
     CHECK(Snap.meta().AtomCount == 1);
-    CHECK(Snap.data().size() == 3);
+    CHECK(Snap.coords().size() == 1);
     CHECK(Snap.vec("18+BCDEF").isApprox(Eigen::Vector3f(4.145, 2.535, 4.553)));
 }
+
+TEST_CASE("Snapshots are views of the topology")
+{
+    libmd::Trajectory t;
+    t.open("../test/test.xtc", "../test/test.gro");
+    t.nextFrame();
+
+    // Every other atom, and then every other one of those.
+    auto Half = libmd::filterFrame(
+        t, [](const libmd::AtomIdentifier&, size_t i, const libmd::V3Map&)
+           { return i % 2 == 1; });
+    auto Quarter = libmd::filterFrame(
+        Half, [](const libmd::AtomIdentifier&, size_t i, const libmd::V3Map&)
+              { return i % 2 == 1; });
+    t.close();
+
+    CHECK(&Half.topology() == &t.topology());
+    CHECK(&Quarter.topology() == &t.topology());
+    REQUIRE(Quarter.size() == t.size() / 4);
+    for(size_t i = 0; i < Quarter.size(); i++)
+    {
+        const size_t Atom = i * 4 + 3;
+        CHECK(Quarter.atomIndex(i) == Atom);
+        CHECK(Quarter.find(Atom) == i);
+        CHECK(Quarter.atomId(i) == t.atomId(Atom));
+        CHECK(Quarter.hasAtom(t.atomId(Atom)));
+        CHECK(Quarter.vec(t.atomId(Atom)) == t.vec(Atom));
+    }
+    CHECK(Quarter.find(1) == Quarter.size());
+    CHECK(Half.hasAtom(t.atomId(1)));
+    CHECK_FALSE(Quarter.hasAtom(t.atomId(1)));
+    CHECK_THROWS_AS(Quarter.vec(t.atomId(1)), std::out_of_range);
+
+    // A copy shares the topology, but not the coordinates.
+    auto Copy = Quarter;
+    Copy.vec(0)[0] += 1.0f;
+    CHECK(&Copy.topology() == &t.topology());
+    CHECK(Copy.vec(0)[0] != Quarter.vec(0)[0]);
+
+    // So does another reader of the trajectory.
+    libmd::Trajectory Other;
+    Other.open("../test/test.xtc", t);
+    CHECK(&Other.topology() == &t.topology());
+}
+
+TEST_CASE("XTC frame index")
+{
+    libmd::XtcFile f;
+    f.open("../test/test.xtc");
+
+    const auto& Index = f.index();
+    REQUIRE(Index.size() == 3);
+    CHECK(Index[0].Offset == 0);
+    CHECK(Index[1].Step == 1000020);
+    CHECK(Index[2].Time == Approx(1000.04));
+
+    std::vector<float> data(10 * 3, 0.0f);
+    f.seekFrame(2);
+    f.readFrame(data.data());
+    CHECK(data[0] == Approx(4.269f));
+    REQUIRE(f.eof());
+
+    f.seekFrame(0);
+    auto Meta = f.readFrame(data.data());
+    CHECK(Meta.Step == 1000000);
+    CHECK(data[0] == Approx(4.249f));
+
+    CHECK(f.seekTime(1000.01) == 1);
+    Meta = f.readFrame(data.data());
+    CHECK(Meta.Step == 1000020);
+    CHECK(data[0] == Approx(4.26f));
+
+    CHECK_THROWS_AS(f.seekFrame(3), std::out_of_range);
+    CHECK_THROWS_AS(f.seekTime(2000.0), std::out_of_range);
+    const uint64_t SecondFrame = Index[1].Offset;
+    f.close();
+
+    // Give the second frame a negative atom count in front of its
+    // coordinates. Skipping it must fail instead of seeking to a
+    // wrapped-around body size.
+    {
+        std::ifstream In("../test/test.xtc", std::ios::binary);
+        std::string Data((std::istreambuf_iterator<char>(In)),
+                         std::istreambuf_iterator<char>());
+        std::fill_n(Data.begin() + SecondFrame + 13 * 4, 4, '\xff');
+        std::ofstream Out("test-corrupt.xtc", std::ios::binary);
+        Out.write(Data.data(), Data.size());
+    }
+    for(auto Mode: {libmd::XtcFile::STREAM, libmd::XtcFile::MMAP})
+    {
+        std::remove(libmd::XtcIndex::sidecarPath("test-corrupt.xtc").c_str());
+        libmd::XtcFile Corrupt;
+        Corrupt.open("test-corrupt.xtc", Mode);
+        CHECK(Corrupt.index().size() == 1);
+        Corrupt.rewind();
+        Corrupt.skipFrame();
+        CHECK_THROWS_AS(Corrupt.skipFrame(), std::runtime_error);
+        Corrupt.rewind();
+        const auto Summary = libmd::scanXtc(Corrupt);
+        CHECK(Summary.FrameCount == 1);
+        CHECK(Summary.Truncated);
+        Corrupt.close();
+    }
+    std::remove("test-corrupt.xtc");
+    std::remove(libmd::XtcIndex::sidecarPath("test-corrupt.xtc").c_str());
+}
+
+TEST_CASE("XTC frame index sidecar")
+{
+    libmd::XtcFile f;
+    f.open("../test/test.xtc");
+    libmd::XtcIndex Index = f.index();
+    f.close();
+
+    REQUIRE(Index.save("test-sidecar.sdfidx"));
+    libmd::XtcIndex Loaded;
+    REQUIRE(Loaded.load("test-sidecar.sdfidx", Index.Source));
+    REQUIRE(Loaded.size() == Index.size());
+    CHECK(Loaded[2].Offset == Index[2].Offset);
+    CHECK(Loaded[2].BoxDim == Index[2].BoxDim);
+
+    // A changed trajectory makes the index stale.
+    libmd::FileFingerprint Changed = Index.Source;
+    Changed.Size += 4;
+    CHECK_FALSE(Loaded.load("test-sidecar.sdfidx", Changed));
+    Changed = Index.Source;
+    Changed.MTime += 1;
+    CHECK_FALSE(Loaded.load("test-sidecar.sdfidx", Changed));
+    std::remove("test-sidecar.sdfidx");
+}
+
+TEST_CASE("XTC frame resync")
+{
+    libmd::XtcFile f;
+    f.open("../test/test.xtc");
+    const libmd::XtcIndex Index = f.index();
+
+    REQUIRE(f.syncToFrame(0, 10));
+    CHECK(f.tell() == 0);
+
+    REQUIRE(f.syncToFrame(1, 10));
+    CHECK(f.tell() == Index[1].Offset);
+    CHECK(f.readFrameMeta().Step == 1000020);
+
+    REQUIRE(f.syncToFrame(Index[2].Offset, 10));
+    CHECK(f.tell() == Index[2].Offset);
+
+    CHECK_FALSE(f.syncToFrame(Index[2].Offset + 1, 10));
+    // Wrong atom count never matches.
+    CHECK_FALSE(f.syncToFrame(0, 11));
+    f.close();
+
+    // Something that looks like a frame header, whose payload would
+    // end far past the first read of the prefetch reader, in front of
+    // the real frames. Checking it moves the reader on, and with one
+    // read in flight, the memory of the first read is reused.
+    {
+        std::string Data(200000, '\0');
+        auto Put = [&Data](size_t pos, uint32_t value)
+        {
+            for(size_t i = 0; i < 4; i++)
+            {
+                Data[pos + i] = static_cast<char>(value >> (24 - i * 8));
+            }
+        };
+        Put(0, 1995);
+        Put(4, 10);
+        Put(13 * 4, 10);
+        Put(22 * 4, 100000);
+        std::ifstream In("../test/test.xtc", std::ios::binary);
+        const std::string Frames((std::istreambuf_iterator<char>(In)),
+                                 std::istreambuf_iterator<char>());
+        Data.replace(1000, Frames.size(), Frames);
+        std::ofstream Out("test-resync.xtc", std::ios::binary);
+        Out.write(Data.data(), Data.size());
+    }
+    libmd::PrefetchOptions Options;
+    Options.QueueDepth = 1;
+    Options.ReadSize = 1 << 16;
+    for(auto Mode: {libmd::XtcFile::STREAM, libmd::XtcFile::MMAP,
+                    libmd::XtcFile::ASYNC})
+    {
+        libmd::XtcFile Decoy;
+        Decoy.open("test-resync.xtc", Mode, Options);
+        REQUIRE(Decoy.syncToFrame(0, 10));
+        CHECK(Decoy.tell() == 1000);
+        CHECK(Decoy.readFrameMeta().Step == 1000000);
+        Decoy.close();
+    }
+    std::remove("test-resync.xtc");
+}
+
+TEST_CASE("XTC reading a growing file")
+{
+    std::ifstream In("../test/test.xtc", std::ios::binary);
+    const std::string Data((std::istreambuf_iterator<char>(In)),
+                           std::istreambuf_iterator<char>());
+    libmd::XtcIndex Index;
+    {
+        libmd::XtcFile f;
+        f.open("../test/test.xtc");
+        Index = f.index();
+    }
+
+    for(auto Mode: {libmd::XtcFile::STREAM, libmd::XtcFile::MMAP,
+                    libmd::XtcFile::ASYNC})
+    {
+        // The second frame is only half written.
+        const size_t Cut = (Index[1].Offset + Index[2].Offset) / 2;
+        {
+            std::ofstream Out("test-growing.xtc", std::ios::binary | std::ios::trunc);
+            Out.write(Data.data(), Cut);
+        }
+        libmd::XtcFile f;
+        f.open("test-growing.xtc", Mode);
+        REQUIRE(f.frameComplete());
+        f.skipFrame();
+        CHECK_FALSE(f.frameComplete());
+        CHECK(f.tell() == Index[1].Offset);
+
+        {
+            std::ofstream Out("test-growing.xtc", std::ios::binary | std::ios::app);
+            Out.write(Data.data() + Cut, Data.size() - Cut);
+        }
+        f.refresh();
+        CHECK(f.tell() == Index[1].Offset);
+        REQUIRE(f.frameComplete());
+        CHECK(f.skipFrame().Step == 1000020);
+        REQUIRE(f.frameComplete());
+        CHECK(f.skipFrame().Step == 1000040);
+        CHECK_FALSE(f.frameComplete());
+        f.close();
+    }
+    std::remove("test-growing.xtc");
+}
+
+TEST_CASE("XTC header scan")
+{
+    for(auto Mode: {libmd::XtcFile::STREAM, libmd::XtcFile::MMAP})
+    {
+        libmd::XtcFile f;
+        f.open("../test/test.xtc", Mode);
+        CHECK(f.skipFrame().Step == 1000000);
+        CHECK(f.tell() == f.index()[1].Offset);
+        f.rewind();
+
+        std::stringstream Listing;
+        const auto Summary = libmd::scanXtc(f, &Listing);
+        CHECK(Summary.FrameCount == 3);
+        CHECK(Summary.AtomCount == 10);
+        CHECK(Summary.FirstStep == 1000000);
+        CHECK(Summary.LastStep == 1000040);
+        CHECK(Summary.LastTime == Approx(1000.04));
+        CHECK(Summary.BoxChanges == 0);
+        CHECK_FALSE(Summary.Truncated);
+        CHECK(f.eof());
+
+        std::string Line;
+        size_t LineCount = 0;
+        while(std::getline(Listing, Line))
+        {
+            LineCount++;
+        }
+        CHECK(LineCount == 3);
+        f.close();
+    }
+
+    // Cut the last frame short.
+    {
+        std::ifstream In("../test/test.xtc", std::ios::binary);
+        std::string Data((std::istreambuf_iterator<char>(In)),
+                         std::istreambuf_iterator<char>());
+        std::ofstream Out("test-truncated.xtc", std::ios::binary);
+        Out.write(Data.data(), Data.size() - 8);
+    }
+    for(auto Mode: {libmd::XtcFile::STREAM, libmd::XtcFile::MMAP})
+    {
+        libmd::XtcFile f;
+        f.open("test-truncated.xtc", Mode);
+        f.skipFrame();
+        f.skipFrame();
+        CHECK_THROWS_AS(f.skipFrame(), std::runtime_error);
+        f.rewind();
+        const auto Summary = libmd::scanXtc(f);
+        CHECK(Summary.FrameCount == 2);
+        CHECK(Summary.Truncated);
+        f.close();
+    }
+    std::remove("test-truncated.xtc");
+}
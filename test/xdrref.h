@@ -0,0 +1,176 @@
+// -*- mode: c++; -*-
+// Copyright 2020 MetroWind <chris.corsair@gmail.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef SDF_TEST_XDRREF_H
+#define SDF_TEST_XDRREF_H
+
+#include <cstdint>
+
+// The bit decoding routines of xdrfile, as the XTC reader used them
+// before BitReader. The tests check the fast decoder against these,
+// so keep them as they are.
+namespace XdrReference
+{
+    // Shamelessly copied from
+    // https://github.com/wesbarnett/libxdrfile/blob/master/src/xdrfile.c.
+    //
+/*
+ * sizeofints - calculate 'bitsize' of compressed ints
+ *
+ * given a number of small unsigned integers and the maximum value
+ * return the number of bits needed to read or write them with the
+ * routines encodeints/decodeints. You need this parameter when
+ * calling those routines.
+ * (However, in some cases we can just use the variable 'smallidx'
+ * which is the exact number of bits, and them we dont need to call
+ * this routine).
+ */
+    inline uint32_t sizeofints(uint32_t num_of_ints, const uint32_t sizes[])
+    {
+        uint32_t i, num;
+        uint32_t num_of_bytes, num_of_bits, bytes[32], bytecnt, tmp;
+        num_of_bytes = 1;
+        bytes[0] = 1;
+        num_of_bits = 0;
+        for (i=0; i < num_of_ints; i++)
+        {
+            tmp = 0;
+            for (bytecnt = 0; bytecnt < num_of_bytes; bytecnt++)
+            {
+                tmp = bytes[bytecnt] * sizes[i] + tmp;
+                bytes[bytecnt] = tmp & 0xff;
+                tmp >>= 8;
+            }
+            while (tmp != 0)
+            {
+                bytes[bytecnt++] = tmp & 0xff;
+                tmp >>= 8;
+            }
+            num_of_bytes = bytecnt;
+        }
+        num = 1;
+        num_of_bytes--;
+        while (bytes[num_of_bytes] >= num)
+        {
+            num_of_bits++;
+            num *= 2;
+        }
+        return num_of_bits + num_of_bytes * 8;
+    }
+
+    // Keeps the decoding state instead of the first 3 ints of the
+    // buffer, so that the data can be read from wherever it is.
+    struct BitStream
+    {
+        const unsigned char* Data;
+        int32_t Count;
+        uint32_t LastBits;
+        uint32_t LastByte;
+    };
+
+    // Shamelessly copied from
+    // https://github.com/wesbarnett/libxdrfile/blob/master/src/xdrfile.c.
+    //
+/*
+ * decodebits - decode number from buf using specified number of bits
+ *
+ * extract the number of bits from the array buf and construct an integer
+ * from it. Return that value.
+ *
+ */
+    inline int32_t decodebits(BitStream& buf, int32_t num_of_bits)
+    {
+        int32_t cnt, num;
+        uint32_t lastbits, lastbyte;
+        const unsigned char * cbuf;
+        int32_t mask = (1 << num_of_bits) -1;
+        cbuf = buf.Data;
+        cnt = buf.Count;
+        lastbits = buf.LastBits;
+        lastbyte = buf.LastByte;
+
+        num = 0;
+        while (num_of_bits >= 8)
+        {
+            lastbyte = ( lastbyte << 8 ) | cbuf[cnt++];
+            num |=  (lastbyte >> lastbits) << (num_of_bits - 8);
+            num_of_bits -=8;
+        }
+        if (num_of_bits > 0)
+        {
+            if (lastbits < static_cast<uint32_t>(num_of_bits))
+            {
+                lastbits += 8;
+                lastbyte = (lastbyte << 8) | cbuf[cnt++];
+            }
+            lastbits -= num_of_bits;
+            num |= (lastbyte >> lastbits) & ((1 << num_of_bits) -1);
+        }
+        num &= mask;
+        buf.Count = cnt;
+        buf.LastBits = lastbits;
+        buf.LastByte = lastbyte;
+        return num;
+    }
+
+    // Shamelessly copied from
+    // https://github.com/wesbarnett/libxdrfile/blob/master/src/xdrfile.c.
+    //
+/*
+ * decodeints - decode 'small' integers from the buf array
+ *
+ * this routine is the inverse from encodeints() and decodes the small integers
+ * written to buf by calculating the remainder and doing divisions with
+ * the given sizes[]. You need to specify the total number of bits to be
+ * used from buf in num_of_bits.
+ *
+ */
+    inline void decodeints(BitStream& buf, int32_t num_of_ints, int32_t num_of_bits,
+                           const uint32_t sizes[], int32_t nums[])
+    {
+        int32_t bytes[32];
+        int32_t i, j, num_of_bytes, p, num;
+
+        bytes[1] = bytes[2] = bytes[3] = 0;
+        num_of_bytes = 0;
+        while (num_of_bits > 8)
+        {
+            int32_t x = decodebits(buf, 8);
+            bytes[num_of_bytes++] = x;
+            num_of_bits -= 8;
+        }
+        if (num_of_bits > 0)
+        {
+            bytes[num_of_bytes++] = decodebits(buf, num_of_bits);
+        }
+        for (i = num_of_ints-1; i > 0; i--)
+        {
+            num = 0;
+            for (j = num_of_bytes-1; j >=0; j--)
+            {
+                num = (num << 8) | bytes[j];
+                p = num / sizes[i];
+                bytes[j] = p;
+                num = num - p * sizes[i];
+            }
+            nums[i] = num;
+        }
+        nums[0] = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (bytes[3] << 24);
+    }
+} // namespace XdrReference
+
+#endif